@@ -0,0 +1,376 @@
+/*
+cartotype_cch.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_CCH_H__
+#define CARTOTYPE_CCH_H__
+
+#include <cartotype_route_matrix.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace CartoType
+{
+
+namespace Router
+    {
+    /**
+    A customizable contraction hierarchy.
+
+    Unlike a standard contraction hierarchy, which is built for a single route profile when a map is created,
+    a customizable contraction hierarchy is built in two phases. The first phase depends only on the road network:
+    nodes are contracted in a fixed order, normally found by nested dissection and stored in the map, and every
+    possible shortcut is added, giving a hierarchy whose shape does not depend on arc costs. The second phase, customization,
+    takes the costs of all arcs, which may come from any route profile and include traffic information and speed limits,
+    and calculates the costs of the shortcuts. Customization does not change the shape of the hierarchy and runs in parallel,
+    so it can be repeated whenever the profile or the traffic information changes. Queries then search the hierarchy in the same way as for a standard contraction hierarchy.
+
+    Nodes are identified by the numbers used in the routing graph, and arcs by their indexes in the arc array passed to the constructor.
+    */
+    class CCustomizableContractionHierarchy
+        {
+        public:
+        /** The state of a query, which may be reused between queries to avoid allocating memory. Each thread needs its own query state. */
+        class CQuery
+            {
+            public:
+            CMatrixSearchState iForward;
+            CMatrixSearchState iBackward;
+            std::vector<uint32_t> iForwardParent;
+            std::vector<uint32_t> iBackwardParent;
+            };
+
+        /**
+        Creates the metric-independent part of the hierarchy. aNodeOrder gives the nodes in order of contraction, least important first,
+        and must contain every node exactly once. aArc gives the start and end node of each arc.
+        The hierarchy must be customized before it is used.
+        */
+        CCustomizableContractionHierarchy(const std::vector<uint32_t>& aNodeOrder,const std::vector<std::pair<uint32_t,uint32_t>>& aArc):
+            iNodeOfRank(aNodeOrder),
+            iRank(aNodeOrder.size()),
+            iArcEdge(aArc.size()),
+            iArcIsUpward(aArc.size())
+            {
+            const uint32_t node_count = uint32_t(aNodeOrder.size());
+            for (uint32_t r = 0; r < node_count; r++)
+                iRank[aNodeOrder[r]] = r;
+
+            // Play the elimination game: contracting a node joins all its higher neighbours, which is done by passing them to the lowest of them.
+            std::vector<std::vector<uint32_t>> higher(node_count);
+            for (const auto& a : aArc)
+                {
+                uint32_t x = iRank[a.first], y = iRank[a.second];
+                if (x != y)
+                    higher[std::min(x,y)].push_back(std::max(x,y));
+                }
+            iFirstUp.assign(node_count + 1,0);
+            for (uint32_t r = 0; r < node_count; r++)
+                {
+                auto& h = higher[r];
+                std::sort(h.begin(),h.end());
+                h.erase(std::unique(h.begin(),h.end()),h.end());
+                if (h.size() > 1)
+                    higher[h[0]].insert(higher[h[0]].end(),h.begin() + 1,h.end());
+                iFirstUp[r + 1] = iFirstUp[r] + uint32_t(h.size());
+                iUpTarget.insert(iUpTarget.end(),h.begin(),h.end());
+                std::vector<uint32_t>().swap(h);
+                }
+
+            // Create the downward adjacency lists.
+            iFirstDown.assign(node_count + 1,0);
+            for (uint32_t t : iUpTarget)
+                iFirstDown[t + 1]++;
+            for (uint32_t r = 0; r < node_count; r++)
+                iFirstDown[r + 1] += iFirstDown[r];
+            iDownSource.resize(iUpTarget.size());
+            iDownEdge.resize(iUpTarget.size());
+            std::vector<uint32_t> next(iFirstDown.begin(),iFirstDown.end() - 1);
+            for (uint32_t r = 0; r < node_count; r++)
+                for (uint32_t e = iFirstUp[r]; e < iFirstUp[r + 1]; e++)
+                    {
+                    uint32_t i = next[iUpTarget[e]]++;
+                    iDownSource[i] = r;
+                    iDownEdge[i] = e;
+                    }
+
+            // Group the nodes into levels: a node's edges depend only on nodes in lower levels, so the nodes in each level can be customized in parallel.
+            std::vector<uint32_t> level(node_count,0);
+            uint32_t max_level = 0;
+            for (uint32_t r = 0; r < node_count; r++)
+                {
+                for (uint32_t i = iFirstDown[r]; i < iFirstDown[r + 1]; i++)
+                    level[r] = std::max(level[r],level[iDownSource[i]] + 1);
+                max_level = std::max(max_level,level[r]);
+                }
+            iFirstInLevel.assign(node_count ? max_level + 2 : 1,0);
+            for (uint32_t r = 0; r < node_count; r++)
+                iFirstInLevel[level[r] + 1]++;
+            for (size_t i = 1; i < iFirstInLevel.size(); i++)
+                iFirstInLevel[i] += iFirstInLevel[i - 1];
+            iLevelNode.resize(node_count);
+            next.assign(iFirstInLevel.begin(),iFirstInLevel.end() - 1);
+            for (uint32_t r = 0; r < node_count; r++)
+                iLevelNode[next[level[r]]++] = r;
+
+            // Map the arcs to edges.
+            for (size_t i = 0; i < aArc.size(); i++)
+                {
+                uint32_t x = iRank[aArc[i].first], y = iRank[aArc[i].second];
+                iArcIsUpward[i] = x < y;
+                iArcEdge[i] = x == y ? KNoEdge : FindEdge(std::min(x,y),std::max(x,y));
+                }
+            }
+
+        /**
+        Customizes the hierarchy. aArcCost(aArc,aTime,aDistance) must set the time in seconds and the distance in metres of an arc
+        and return true, or return false if the arc may not be used: for example, because the current route profile forbids it.
+        Nodes are processed in parallel using up to aThreadCount threads.
+        */
+        template<class F> void Customize(F aArcCost,size_t aThreadCount = 0)
+            {
+            const size_t edge_count = iUpTarget.size();
+            iForward.assign(edge_count,TCost());
+            iBackward.assign(edge_count,TCost());
+            for (uint32_t a = 0; a < iArcEdge.size(); a++)
+                {
+                TCost c;
+                if (iArcEdge[a] == KNoEdge || !aArcCost(a,c.iTime,c.iDistance))
+                    continue;
+                TCost& e = iArcIsUpward[a] ? iForward[iArcEdge[a]] : iBackward[iArcEdge[a]];
+                if (c.iTime < e.iTime)
+                    e = c;
+                }
+
+            // Apply the lower triangles of each edge: u -> v -> w, where v is lower than u and w.
+            for (size_t level = 0; level + 1 < iFirstInLevel.size(); level++)
+                {
+                ParallelFor(iFirstInLevel[level + 1] - iFirstInLevel[level],[&](size_t aBegin,size_t aEnd)
+                    {
+                    for (size_t i = aBegin; i < aEnd; i++)
+                        {
+                        uint32_t u = iLevelNode[iFirstInLevel[level] + i];
+                        for (uint32_t d = iFirstDown[u]; d < iFirstDown[u + 1]; d++)
+                            {
+                            uint32_t v = iDownSource[d];
+                            uint32_t vu = iDownEdge[d];
+                            // The higher neighbours of v above u are all neighbours of u, and both lists are sorted, so they can be merged.
+                            uint32_t uw = iFirstUp[u];
+                            for (uint32_t vw = iFirstUp[v]; vw < iFirstUp[v + 1]; vw++)
+                                {
+                                uint32_t w = iUpTarget[vw];
+                                if (w <= u)
+                                    continue;
+                                while (iUpTarget[uw] != w)
+                                    uw++;
+                                Improve(iForward[uw],iBackward[vu],iForward[vw]);
+                                Improve(iBackward[uw],iBackward[vw],iForward[vu]);
+                                }
+                            }
+                        }
+                    },aThreadCount,256);
+                }
+            }
+
+        /** Returns true if the hierarchy has been customized. */
+        bool IsCustomized() const { return iForward.size() == iUpTarget.size() && (!iUpTarget.empty() || !iArcEdge.empty()); }
+        /** Returns the number of nodes. */
+        size_t NodeCount() const { return iRank.size(); }
+        /** Returns the number of edges, including shortcuts. Each edge is used in both directions. */
+        size_t EdgeCount() const { return iUpTarget.size(); }
+        /** Returns the number of levels, which limits the number of nodes that can be customized in parallel. */
+        size_t LevelCount() const { return iFirstInLevel.size() - 1; }
+
+        /** Returns the nodes in order of contraction. The position of a node in this array is its rank. */
+        const std::vector<uint32_t>& NodeOrder() const { return iNodeOfRank; }
+        /** Returns the index of the first edge from each node to a higher node, indexed by rank, with an extra index at the end. */
+        const std::vector<uint32_t>& FirstUpwardEdge() const { return iFirstUp; }
+        /** Returns the higher node, by rank, of each edge, sorted for each lower node. */
+        const std::vector<uint32_t>& UpwardEdgeTarget() const { return iUpTarget; }
+        /**
+        Gets the time and distance of an edge after customization, upward if aUpward is true, otherwise downward.
+        The time is CRouteMatrix::KUnreachable if the edge cannot be used in that direction.
+        */
+        void GetEdgeCost(uint32_t aEdge,bool aUpward,double& aTime,double& aDistance) const
+            {
+            const TCost& c = aUpward ? iForward[aEdge] : iBackward[aEdge];
+            aTime = c.iTime;
+            aDistance = c.iDistance;
+            }
+
+        /** Calls aFunction(aToNode,aTime,aDistance) for each usable arc or shortcut from aNode to a higher node. */
+        template<class F> void ForEachUpwardArc(uint32_t aNode,F aFunction) const
+            {
+            uint32_t r = iRank[aNode];
+            for (uint32_t e = iFirstUp[r]; e < iFirstUp[r + 1]; e++)
+                if (iForward[e].iTime != CRouteMatrix::KUnreachable)
+                    aFunction(iNodeOfRank[iUpTarget[e]],iForward[e].iTime,iForward[e].iDistance);
+            }
+        /** Calls aFunction(aFromNode,aTime,aDistance) for each usable arc or shortcut from a higher node to aNode. */
+        template<class F> void ForEachUpwardReverseArc(uint32_t aNode,F aFunction) const
+            {
+            uint32_t r = iRank[aNode];
+            for (uint32_t e = iFirstUp[r]; e < iFirstUp[r + 1]; e++)
+                if (iBackward[e].iTime != CRouteMatrix::KUnreachable)
+                    aFunction(iNodeOfRank[iUpTarget[e]],iBackward[e].iTime,iBackward[e].iDistance);
+            }
+
+        /**
+        Finds the fastest route from aStart to aEnd, putting the nodes of the route in aPath, with all shortcuts unpacked,
+        and the time and distance in aTime and aDistance. Returns false if there is no route.
+        */
+        bool FindRoute(CQuery& aQuery,uint32_t aStart,uint32_t aEnd,std::vector<uint32_t>& aPath,double& aTime,double& aDistance) const
+            {
+            aPath.clear();
+            const size_t node_count = NodeCount();
+            if (!IsCustomized() || aStart >= node_count || aEnd >= node_count)
+                return false;
+            Search(aQuery.iForward,aQuery.iForwardParent,iRank[aStart],iForward);
+            Search(aQuery.iBackward,aQuery.iBackwardParent,iRank[aEnd],iBackward);
+
+            // Find the best meeting node. Upward search spaces are small, so both searches are run to completion.
+            uint32_t meeting = KNoEdge;
+            aTime = CRouteMatrix::KUnreachable;
+            for (uint32_t r = iRank[aEnd]; ; )
+                {
+                // The backward search space is the set of ancestors of aEnd in the elimination tree, which is found by following the lowest upward edge.
+                double t = aQuery.iForward.iTime[r] + aQuery.iBackward.iTime[r];
+                if (t < aTime)
+                    {
+                    aTime = t;
+                    aDistance = aQuery.iForward.iDistance[r] + aQuery.iBackward.iDistance[r];
+                    meeting = r;
+                    }
+                if (iFirstUp[r] == iFirstUp[r + 1])
+                    break;
+                r = iUpTarget[iFirstUp[r]];
+                }
+            if (meeting == KNoEdge)
+                return false;
+
+            // Collect the edges of the route in order, then unpack them.
+            std::vector<std::pair<uint32_t,uint32_t>> route_edge;
+            for (uint32_t r = meeting; r != iRank[aStart]; )
+                {
+                uint32_t n = LowerNode(aQuery.iForwardParent[r]);
+                route_edge.emplace_back(n,r);
+                r = n;
+                }
+            std::reverse(route_edge.begin(),route_edge.end());
+            for (uint32_t r = meeting; r != iRank[aEnd]; )
+                {
+                uint32_t n = LowerNode(aQuery.iBackwardParent[r]);
+                route_edge.emplace_back(r,n);
+                r = n;
+                }
+
+            aPath.push_back(aStart);
+            for (const auto& e : route_edge)
+                Unpack(e.first,e.second,aPath);
+            return true;
+            }
+
+        private:
+        static constexpr uint32_t KNoEdge = UINT32_MAX;
+
+        class TCost
+            {
+            public:
+            double iTime = CRouteMatrix::KUnreachable;
+            double iDistance = 0;
+            };
+
+        static void Improve(TCost& aCost,const TCost& aFirst,const TCost& aSecond)
+            {
+            double t = aFirst.iTime + aSecond.iTime;
+            if (t < aCost.iTime)
+                {
+                aCost.iTime = t;
+                aCost.iDistance = aFirst.iDistance + aSecond.iDistance;
+                }
+            }
+
+        /** Returns the edge between aLow and aHigh, where aLow has the lower rank, or KNoEdge if there is none. */
+        uint32_t FindEdge(uint32_t aLow,uint32_t aHigh) const
+            {
+            auto begin = iUpTarget.begin() + iFirstUp[aLow], end = iUpTarget.begin() + iFirstUp[aLow + 1];
+            auto p = std::lower_bound(begin,end,aHigh);
+            return p != end && *p == aHigh ? uint32_t(p - iUpTarget.begin()) : KNoEdge;
+            }
+        /** Returns the lower node of an edge. */
+        uint32_t LowerNode(uint32_t aEdge) const { return uint32_t(std::upper_bound(iFirstUp.begin(),iFirstUp.end(),aEdge) - iFirstUp.begin() - 1); }
+
+        /** Runs an upward search from aStart using the costs aCost, recording the edge by which each node was reached. */
+        void Search(CMatrixSearchState& aState,std::vector<uint32_t>& aParent,uint32_t aStart,const std::vector<TCost>& aCost) const
+            {
+            aState.Reset(NodeCount());
+            aParent.resize(NodeCount());
+            aState.Relax(aStart,0,0);
+            aParent[aStart] = KNoEdge;
+            uint32_t r;
+            while (aState.Pop(r))
+                {
+                double time = aState.iTime[r];
+                double distance = aState.iDistance[r];
+                for (uint32_t e = iFirstUp[r]; e < iFirstUp[r + 1]; e++)
+                    if (aCost[e].iTime != CRouteMatrix::KUnreachable && aState.Relax(iUpTarget[e],time + aCost[e].iTime,distance + aCost[e].iDistance))
+                        aParent[iUpTarget[e]] = e;
+                }
+            }
+
+        /** Appends the nodes after aFrom on the path from aFrom to aTo, which are joined by an edge, to aPath. */
+        void Unpack(uint32_t aFrom,uint32_t aTo,std::vector<uint32_t>& aPath) const
+            {
+            std::vector<std::pair<uint32_t,uint32_t>> stack { { aFrom,aTo } };
+            while (!stack.empty())
+                {
+                auto e = stack.back();
+                stack.pop_back();
+                bool upward = e.first < e.second;
+                uint32_t low = std::min(e.first,e.second), high = std::max(e.first,e.second);
+                uint32_t edge = FindEdge(low,high);
+                double time = upward ? iForward[edge].iTime : iBackward[edge].iTime;
+
+                // Look for a lower triangle giving the cost of the edge; if there is none the edge is an arc.
+                bool found = false;
+                for (uint32_t d = iFirstDown[low]; d < iFirstDown[low + 1] && !found; d++)
+                    {
+                    uint32_t v = iDownSource[d];
+                    uint32_t v_low = iDownEdge[d];
+                    uint32_t v_high = FindEdge(v,high);
+                    if (v_high == KNoEdge)
+                        continue;
+                    double t = upward ? iBackward[v_low].iTime + iForward[v_high].iTime : iBackward[v_high].iTime + iForward[v_low].iTime;
+                    if (t == time)
+                        {
+                        stack.emplace_back(v,e.second);
+                        stack.emplace_back(e.first,v);
+                        found = true;
+                        }
+                    }
+                if (!found)
+                    aPath.push_back(iNodeOfRank[e.second]);
+                }
+            }
+
+        std::vector<uint32_t> iNodeOfRank;
+        std::vector<uint32_t> iRank;
+        std::vector<uint32_t> iFirstUp;         // the first upward edge of each node, indexed by rank
+        std::vector<uint32_t> iUpTarget;        // the higher node of each edge, by rank, sorted for each lower node
+        std::vector<uint32_t> iFirstDown;       // the first downward edge of each node, indexed by rank
+        std::vector<uint32_t> iDownSource;      // the lower node of each downward edge
+        std::vector<uint32_t> iDownEdge;        // the edge index of each downward edge
+        std::vector<uint32_t> iFirstInLevel;
+        std::vector<uint32_t> iLevelNode;
+        std::vector<uint32_t> iArcEdge;
+        std::vector<bool> iArcIsUpward;
+        std::vector<TCost> iForward;            // the cost of each edge from the lower to the higher node
+        std::vector<TCost> iBackward;           // the cost of each edge from the higher to the lower node
+        };
+    }
+
+}
+
+#endif
@@ -0,0 +1,235 @@
+/*
+cartotype_color_matrix.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_COLOR_MATRIX_H__
+#define CARTOTYPE_COLOR_MATRIX_H__
+
+#include <cartotype_bitmap.h>
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CARTOTYPE_COLOR_MATRIX_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && (!defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define CARTOTYPE_COLOR_MATRIX_NEON
+#include <arm_neon.h>
+#endif
+
+namespace CartoType
+{
+
+/**
+An affine color transformation which can be applied quickly to whole RGBA32 bitmaps,
+for example to convert a day-mode map image to night mode without drawing it again.
+
+The red, green and blue levels of the result are each a weighted sum of the red, green and blue
+levels of the source and a constant. The alpha level is not changed. Because RGBA32 bitmaps
+use premultiplied alpha, the constant is scaled by the alpha level of each pixel, and the results
+are clamped to the range 0...alpha.
+
+Coefficients are stored as fixed-point numbers with 8 fractional bits, so that the transformation
+can be done using 16-bit integer arithmetic: SSE2 or NEON instructions are used where available.
+The result is the same whichever instructions are used.
+*/
+class TColorMatrix
+    {
+    public:
+    /** Creates an identity matrix, which leaves colors unchanged. */
+    TColorMatrix() { }
+
+    /**
+    Creates a matrix from a 3 x 4 array of coefficients. Each row gives the weights for red, green and blue,
+    and the constant, for the red, green and blue levels of the result in that order.
+    The constants are in the range 0...255.
+    */
+    explicit TColorMatrix(const double aCoeff[3][4])
+        {
+        for (int i = 0; i < 3; i++)
+            {
+            for (int j = 0; j < 3; j++)
+                iCoeff[i][j] = ToFixed(aCoeff[i][j] * 256);
+            iCoeff[i][3] = ToFixed(aCoeff[i][3] * 256 / 255);
+            }
+        }
+
+    /**
+    Returns a matrix approximating the colors of night mode. Lightness is reversed, so that light
+    backgrounds become dark and dark lines and text become light, while hue and saturation are kept.
+    The result is then blended with aNightColor, using its alpha level as the blending weight.
+    If aNightColor is null, KDefaultNightColor is used.
+
+    Unlike the night mode applied by the style sheet, roads are not treated differently
+    from other objects, but the transformation can be applied to images that have already been drawn.
+    */
+    static TColorMatrix NightMode(TColor aNightColor = KTransparentBlack)
+        {
+        if (aNightColor.IsNull())
+            aNightColor = KDefaultNightColor;
+        const double t = aNightColor.Alpha() / 255.0;
+        const double grey[3] = { 0.299,0.587,0.114 };
+        const double night[3] = { double(aNightColor.Red()),double(aNightColor.Green()),double(aNightColor.Blue()) };
+
+        // Inverting the grey level while keeping the difference between each level and grey gives C' = C + 255 - 2 * Grey;
+        // that is then blended with the night color: C'' = C' * (1 - t) + Night * t.
+        double coeff[3][4];
+        for (int i = 0; i < 3; i++)
+            {
+            for (int j = 0; j < 3; j++)
+                coeff[i][j] = ((i == j ? 1 : 0) - 2 * grey[j]) * (1 - t);
+            coeff[i][3] = 255 * (1 - t) + night[i] * t;
+            }
+        return TColorMatrix(coeff);
+        }
+
+    /** Returns true if this is the identity matrix. */
+    bool IsIdentity() const { return *this == TColorMatrix(); }
+    /** The equality operator. */
+    bool operator==(const TColorMatrix& aOther) const { return std::equal(&iCoeff[0][0],&iCoeff[0][0] + 12,&aOther.iCoeff[0][0]); }
+    /** The inequality operator. */
+    bool operator!=(const TColorMatrix& aOther) const { return !(*this == aOther); }
+
+    /** Transforms a color, which uses premultiplied alpha. */
+    TColor Transform(TColor aColor) const
+        {
+        uint32_t p = aColor.iValue;
+        Transform(&p,1);
+        return TColor(p);
+        }
+
+    /** Transforms a sequence of pixels stored as 32-bit values in the same format as TColor, using premultiplied alpha. */
+    void Transform(uint32_t* aPixel,size_t aCount) const
+        {
+        size_t i = 0;
+#if defined(CARTOTYPE_COLOR_MATRIX_SSE2)
+        i = TransformSse2(aPixel,aCount);
+#elif defined(CARTOTYPE_COLOR_MATRIX_NEON)
+        i = TransformNeon(aPixel,aCount);
+#endif
+        for (; i < aCount; i++)
+            {
+            const uint32_t p = aPixel[i];
+            const int32_t level[4] = { int32_t(p & 0xFF),int32_t((p >> 8) & 0xFF),int32_t((p >> 16) & 0xFF),int32_t(p >> 24) };
+            uint32_t result = p & 0xFF000000;
+            for (int c = 0; c < 3; c++)
+                {
+                int32_t x = iCoeff[c][0] * level[0] + iCoeff[c][1] * level[1] + iCoeff[c][2] * level[2] + iCoeff[c][3] * level[3] + 128;
+                x = std::clamp(x >> 8,0,level[3]);
+                result |= uint32_t(x) << (c * 8);
+                }
+            aPixel[i] = result;
+            }
+        }
+
+    /** Transforms an RGBA32 bitmap in place. Returns KErrorUnimplemented if the bitmap is not of type RGBA32. */
+    TResult Transform(TBitmap& aBitmap) const
+        {
+        if (aBitmap.Type() != TBitmapType::RGBA32)
+            return KErrorUnimplemented;
+        if (IsIdentity())
+            return KErrorNone;
+        uint8_t* row = aBitmap.Data();
+        for (int32_t y = 0; y < aBitmap.Height(); y++, row += aBitmap.RowBytes())
+            Transform(reinterpret_cast<uint32_t*>(row),size_t(aBitmap.Width()));
+        return KErrorNone;
+        }
+
+    /** The default night mode color: a dark blue with an alpha level giving a blending weight of about 30%. */
+    static constexpr uint32_t KDefaultNightColor = 0x4D402010;
+
+    private:
+    static int16_t ToFixed(double aValue)
+        {
+        return int16_t(std::clamp(std::lround(aValue),-32767L,32767L));
+        }
+
+#if defined(CARTOTYPE_COLOR_MATRIX_SSE2)
+    /** Transforms pixels four at a time, returning the number transformed. */
+    size_t TransformSse2(uint32_t* aPixel,size_t aCount) const
+        {
+        // Each row of coefficients is repeated for two pixels, for use with _mm_madd_epi16 on a pair of unpacked pixels.
+        const __m128i red = _mm_setr_epi16(iCoeff[0][0],iCoeff[0][1],iCoeff[0][2],iCoeff[0][3],iCoeff[0][0],iCoeff[0][1],iCoeff[0][2],iCoeff[0][3]);
+        const __m128i green = _mm_setr_epi16(iCoeff[1][0],iCoeff[1][1],iCoeff[1][2],iCoeff[1][3],iCoeff[1][0],iCoeff[1][1],iCoeff[1][2],iCoeff[1][3]);
+        const __m128i blue = _mm_setr_epi16(iCoeff[2][0],iCoeff[2][1],iCoeff[2][2],iCoeff[2][3],iCoeff[2][0],iCoeff[2][1],iCoeff[2][2],iCoeff[2][3]);
+        const __m128i alpha = _mm_setr_epi16(0,0,0,256,0,0,0,256);
+        const __m128i zero = _mm_setzero_si128();
+
+        auto transform_two = [&](__m128i aLevel) // two pixels as eight 16-bit levels
+            {
+            __m128i r = _mm_madd_epi16(aLevel,red);
+            __m128i g = _mm_madd_epi16(aLevel,green);
+            __m128i b = _mm_madd_epi16(aLevel,blue);
+            __m128i a = _mm_madd_epi16(aLevel,alpha);
+
+            // Add the pairs of partial sums to get red, green, blue and alpha for each pixel.
+            __m128i rg0 = _mm_unpacklo_epi32(r,g);
+            __m128i rg1 = _mm_unpackhi_epi32(r,g);
+            __m128i ba0 = _mm_unpacklo_epi32(b,a);
+            __m128i ba1 = _mm_unpackhi_epi32(b,a);
+            __m128i p0 = _mm_add_epi32(_mm_unpacklo_epi64(rg0,ba0),_mm_unpackhi_epi64(rg0,ba0));
+            __m128i p1 = _mm_add_epi32(_mm_unpacklo_epi64(rg1,ba1),_mm_unpackhi_epi64(rg1,ba1));
+            const __m128i round = _mm_set1_epi32(128);
+            p0 = _mm_srai_epi32(_mm_add_epi32(p0,round),8);
+            p1 = _mm_srai_epi32(_mm_add_epi32(p1,round),8);
+
+            // Clamp to 0...alpha.
+            __m128i max_level = _mm_shufflehi_epi16(_mm_shufflelo_epi16(aLevel,_MM_SHUFFLE(3,3,3,3)),_MM_SHUFFLE(3,3,3,3));
+            return _mm_max_epi16(_mm_min_epi16(_mm_packs_epi32(p0,p1),max_level),zero);
+            };
+
+        size_t i = 0;
+        for (; i + 4 <= aCount; i += 4)
+            {
+            __m128i* p = reinterpret_cast<__m128i*>(aPixel + i);
+            __m128i source = _mm_loadu_si128(p);
+            __m128i lo = transform_two(_mm_unpacklo_epi8(source,zero));
+            __m128i hi = transform_two(_mm_unpackhi_epi8(source,zero));
+            _mm_storeu_si128(p,_mm_packus_epi16(lo,hi));
+            }
+        return i;
+        }
+#endif
+
+#if defined(CARTOTYPE_COLOR_MATRIX_NEON)
+    /** Transforms pixels eight at a time, returning the number transformed. */
+    size_t TransformNeon(uint32_t* aPixel,size_t aCount) const
+        {
+        size_t i = 0;
+        for (; i + 8 <= aCount; i += 8)
+            {
+            uint8_t* p = reinterpret_cast<uint8_t*>(aPixel + i);
+            uint8x8x4_t source = vld4_u8(p);
+            int16x8_t level[4];
+            for (int c = 0; c < 4; c++)
+                level[c] = vreinterpretq_s16_u16(vmovl_u8(source.val[c]));
+            for (int c = 0; c < 3; c++)
+                {
+                const int16_t* k = iCoeff[c];
+                int32x4_t lo = vmull_n_s16(vget_low_s16(level[0]),k[0]);
+                int32x4_t hi = vmull_n_s16(vget_high_s16(level[0]),k[0]);
+                for (int j = 1; j < 4; j++)
+                    {
+                    lo = vmlal_n_s16(lo,vget_low_s16(level[j]),k[j]);
+                    hi = vmlal_n_s16(hi,vget_high_s16(level[j]),k[j]);
+                    }
+                int16x8_t x = vcombine_s16(vqrshrn_n_s32(lo,8),vqrshrn_n_s32(hi,8));
+                x = vmaxq_s16(vminq_s16(x,level[3]),vdupq_n_s16(0));
+                source.val[c] = vqmovun_s16(x);
+                }
+            vst4_u8(p,source);
+            }
+        return i;
+        }
+#endif
+
+    /** The coefficients, with 8 fractional bits; the fourth column is multiplied by the alpha level. */
+    int16_t iCoeff[3][4] = { { 256,0,0,0 },{ 0,256,0,0 },{ 0,0,256,0 } };
+    };
+
+}
+
+#endif
@@ -20,7 +20,20 @@ See www.cartotype.com for more information.
 #include <cartotype_legend.h>
 #include <cartotype_style_sheet_data.h>
 #include <cartotype_expression.h>
-
+#include <cartotype_spatial_join.h>
+#include <cartotype_polygon_index.h>
+#include <cartotype_route_matrix.h>
+#include <cartotype_map_matcher.h>
+#include <cartotype_waypoint_order.h>
+#include <cartotype_route_binary.h>
+#include <cartotype_xml_import.h>
+#include <cartotype_track_recorder.h>
+#include <cartotype_style_sheet_diff.h>
+#include <cartotype_color_matrix.h>
+#include <cartotype_wms_client.h>
+#include <cartotype_tile_pool.h>
+
+#include <limits>
 #include <memory>
 #include <set>
 
@@ -334,9 +347,6 @@ class TViewState
     auto Tuple() const { return std::forward_as_tuple(iWidthInPixels,iHeightInPixels,iViewCenterDegrees,iScaleDenominator,iRotationDegrees,iPerspective,iPerspectiveParam); }
     };
 
-/** A type for a sequence of track points. */
-using CTrackGeometry = CGeneralGeometry<TTrackPoint>;
-
 /**
 The CFramework class provides a high-level API for CartoType,
 through which map data can be loaded, maps can be created and viewed,
@@ -537,6 +547,28 @@ class CFramework: public MNavigatorObserver
     TResult DeleteMapObjects(uint32_t aMapHandle,uint64_t aStartId,uint64_t aEndId,uint64_t& aDeletedCount,CString aCondition = nullptr);
     std::unique_ptr<CMapObject> LoadMapObject(TResult& aError,uint32_t aMapHandle,uint64_t aId);
     TResult ReadGpx(uint32_t aMapHandle,const CString& aFileName);
+    /**
+    Imports the waypoints, routes and tracks in a GPX file, or the placemarks in a KML file, into the layer aLayerName
+    of the writable map aMapHandle. The file is read in chunks, so memory use does not depend on its size.
+    */
+    TResult ImportMapObjects(uint32_t aMapHandle,const CString& aLayerName,const CString& aFileName,const TXmlImportParam& aParam = TXmlImportParam())
+        {
+        TResult error;
+        std::unique_ptr<CSimpleFileInputStream> input = CSimpleFileInputStream::New(error,aFileName);
+        if (error)
+            return error;
+        return ImportXmlMapData(*input,aParam,[&](std::vector<CImportedMapObject>& aBatch) -> TResult
+            {
+            for (const auto& object : aBatch)
+                {
+                uint64_t id = 0;
+                TResult insert_error = InsertMapObject(aMapHandle,object.iType,aLayerName,object.iGeometry,CString(object.iStringAttributes),0,id,false);
+                if (insert_error)
+                    return insert_error;
+                }
+            return KErrorNone;
+            });
+        }
     CGeometry Range(TResult& aError,const TRouteProfile* aProfile,double aX,double aY,TCoordType aCoordType,double aTimeOrDistance,bool aIsTime);
 
     void EnableLayer(const CString& aLayerName,bool aEnable);
@@ -596,6 +628,29 @@ class CFramework: public MNavigatorObserver
     // using a web map service to get an underlay or overlay for the current map
     TResult UseWebMapService(MInternetAccessor& aInternetAccessor,const std::string& aUrl,const std::string& aUrlSuffix);
     const TBitmap* WebMapServiceBitmap(TResult& aError,bool* aRedrawWasNeeded = nullptr);
+    /**
+    Creates a loader which fetches images from a web map service as tiles, several at once, and caches them, for use with DrawWebMapService.
+    Unlike UseWebMapService, which makes one request at a time for the whole view, the loader is owned by the caller.
+    If aTileArrived is non-null it is called from a worker thread when a tile has arrived, so that the map can be drawn again.
+    */
+    std::unique_ptr<CWebMapServiceTileLoader> NewWebMapServiceTileLoader(TResult& aError,MInternetAccessor& aInternetAccessor,const std::string& aUrl,const std::string& aUrlSuffix,
+                                                                          const TWebMapServiceClientParam& aParam,CWebMapServiceTileLoader::TTileArrivedFunction aTileArrived = nullptr)
+        {
+        return CWebMapServiceTileLoader::New(aError,aInternetAccessor,aUrl,aUrlSuffix,aParam,aTileArrived);
+        }
+    /**
+    Draws the current view into aBitmap, which must be of type RGBA32 and the size of the display, using the tiles fetched by aLoader.
+    The web map service must use the projection of the map, with coordinates in projected meters, and the view should not be rotated.
+    If aComplete is non-null it is set to false if the view should be drawn again after more tiles have arrived.
+    */
+    TResult DrawWebMapService(CWebMapServiceTileLoader& aLoader,TBitmap& aBitmap,bool* aComplete = nullptr) const
+        {
+        TRectFP view;
+        TResult error = GetView(view,TCoordType::MapMeter);
+        if (!error)
+            error = aLoader.Draw(aBitmap,view,aComplete);
+        return error;
+        }
     
     // providing data for a web map service
     TResult WebMapServiceGetMap(const char* aWebMapServiceRequest,std::vector<uint8_t>& aData);
@@ -619,6 +674,86 @@ class CFramework: public MNavigatorObserver
     TResult FindBuildingsNearStreet(CMapObjectArray& aObjectArray,const CMapObject& aStreet) const;
     TResult FindPolygonsContainingPath(CMapObjectArray& aObjectArray,const CGeometry& aPath,const TFindParam* aParam = nullptr) const;
     TResult FindPointsInPath(CMapObjectArray& aObjectArray,const CGeometry& aPath,const TFindParam* aParam = nullptr) const;
+    /**
+    Finds the polygons containing any of the points in aPointArray, which use the coordinate type aCoordType.
+    The polygons are returned in aPolygonArray, clipped to a rectangle just enclosing the points, and element N
+    of aPolygonIndexArray gives the indexes in aPolygonArray of the polygons containing point N.
+    If aParam is not null it can be used to restrict the search: for example, by layer or condition; its clip path is not used.
+    */
+    TResult FindPolygonsContainingPoints(CMapObjectArray& aPolygonArray,CJoinIndexArray& aPolygonIndexArray,const std::vector<TPointFP>& aPointArray,TCoordType aCoordType,const TFindParam* aParam = nullptr) const
+        {
+        aPolygonArray.clear();
+        aPolygonIndexArray.assign(aPointArray.size(),{});
+        if (aPointArray.empty())
+            return KErrorNone;
+        std::vector<TPointFP> point(aPointArray);
+        TResult error = ConvertCoords(TWritableCoordSet(&point[0].iX,&point[0].iY,sizeof(TPointFP),point.size()),aCoordType,TCoordType::Map);
+        if (error)
+            return error;
+        TRectFP bounds(point[0].iX,point[0].iY,point[0].iX,point[0].iY);
+        for (const auto& p : point)
+            bounds.Combine(p);
+        error = FindJoinObjects(aPolygonArray,bounds,TMapObjectType::Polygon,aParam);
+        if (error)
+            return error;
+
+        std::vector<TRectFP> polygon_bounds;
+        for (const auto& p : aPolygonArray)
+            polygon_bounds.emplace_back(p->CBox());
+        CPolygonContainmentIndexArray index(aPolygonArray.size());
+        aPolygonIndexArray = JoinPointsAndPolygons(point,polygon_bounds,[&](size_t aPolygonIndex,const TPointFP& aPoint)
+            {
+            return index.Contains(aPolygonIndex,*aPolygonArray[aPolygonIndex],aPoint.iX,aPoint.iY);
+            },true);
+        return KErrorNone;
+        }
+    /**
+    Finds the point objects inside any of the polygons in aPolygonArray, returning them in aPointArray. Element N
+    of aPointIndexArray gives the indexes in aPointArray of the points inside polygon N.
+    If aParam is not null it can be used to restrict the search: for example, by layer or condition; its clip path is not used.
+    */
+    TResult FindPointsInPolygons(CMapObjectArray& aPointArray,CJoinIndexArray& aPointIndexArray,const std::vector<CGeometry>& aPolygonArray,const TFindParam* aParam = nullptr) const
+        {
+        aPointArray.clear();
+        aPointIndexArray.assign(aPolygonArray.size(),{});
+        std::vector<CPolygonContainmentIndex> index;
+        std::vector<TRectFP> polygon_bounds;
+        TRectFP bounds;
+        for (const auto& p : aPolygonArray)
+            {
+            CGeometry polygon(p);
+            const TCoordType coord_type = polygon.CoordType();
+            TResult error = polygon.ConvertCoords(TCoordType::Map,[this,coord_type](TWritableCoordSet& aCoordSet)
+                {
+                return ConvertCoords(aCoordSet,coord_type,TCoordType::Map);
+                });
+            if (error)
+                return error;
+            index.emplace_back(polygon);
+            polygon_bounds.emplace_back(index.back().Bounds());
+            if (polygon_bounds.size() == 1)
+                bounds = polygon_bounds[0];
+            else
+                {
+                bounds.Combine(polygon_bounds.back().iTopLeft);
+                bounds.Combine(polygon_bounds.back().iBottomRight);
+                }
+            }
+        if (index.empty())
+            return KErrorNone;
+        TResult error = FindJoinObjects(aPointArray,bounds,TMapObjectType::Point,aParam);
+        if (error)
+            return error;
+
+        std::vector<TPointFP> point;
+        for (const auto& p : aPointArray)
+            point.push_back(p->Center());
+        aPointIndexArray = JoinPointsAndPolygons(point,polygon_bounds,[&](size_t aPolygonIndex,const TPointFP& aPoint)
+            {
+            return index[aPolygonIndex].Contains(aPoint);
+            },false);
+        return KErrorNone;
+        }
     TResult FindAsync(FindAsyncCallBack aCallBack,const TFindParam& aFindParam,bool aOverride = false);
     TResult FindAsync(FindAsyncGroupCallBack aCallBack,const TFindParam& aFindParam,bool aOverride = false);
     TResult FindAddressAsync(FindAsyncCallBack aCallBack,size_t aMaxObjectCount,const CAddress& aAddress,bool aFuzzy = false,bool aOverride = false);
@@ -691,6 +826,120 @@ class CFramework: public MNavigatorObserver
     std::unique_ptr<CRoute> CreateBestRoute(TResult& aError,const TRouteProfile& aProfile,const TRouteCoordSet& aCoordSet,bool aStartFixed,bool aEndFixed,size_t aIterations);
     std::unique_ptr<CRoute> CreateBestRoute(TResult& aError,const TRouteProfile& aProfile,const TCoordSet& aCoordSet,TCoordType aCoordType,bool aStartFixed,bool aEndFixed,size_t aIterations);
     std::unique_ptr<CRoute> CreateRouteFromXml(TResult& aError,const TRouteProfile& aProfile,const CString& aFileNameOrData);
+    /**
+    Creates a matrix of the travel times and distances, using the profile aProfile, from each of the points in aOrigins
+    to each of the points in aDestinations. Each entry is found by creating a route, which is then discarded.
+    Entries for which there is no route are set to CRouteMatrix::KUnreachable.
+    */
+    TResult CreateRouteMatrix(CRouteMatrix& aMatrix,const TRouteProfile& aProfile,const TRouteCoordSet& aOrigins,const TRouteCoordSet& aDestinations)
+        {
+        const auto& origin = aOrigins.iRoutePointArray;
+        std::vector<TRoutePoint> destination = aDestinations.iRoutePointArray;
+        aMatrix = CRouteMatrix(origin.size(),destination.size());
+        for (auto& d : destination)
+            {
+            TResult error = ConvertPoint(d.iPoint.iX,d.iPoint.iY,aDestinations.iCoordType,aOrigins.iCoordType);
+            if (error)
+                return error;
+            }
+
+        TRouteCoordSet coord_set(aOrigins.iCoordType);
+        coord_set.iRoutePointArray.resize(2);
+        for (size_t o = 0; o < origin.size(); o++)
+            {
+            coord_set.iRoutePointArray[0] = origin[o];
+            for (size_t d = 0; d < destination.size(); d++)
+                {
+                if (origin[o].iPoint == destination[d].iPoint)
+                    {
+                    aMatrix.Set(o,d,0,0);
+                    continue;
+                    }
+                coord_set.iRoutePointArray[1] = destination[d];
+                TResult error;
+                auto route = CreateRoute(error,aProfile,coord_set);
+                if (!error)
+                    aMatrix.Set(o,d,route->iTime,route->iDistance);
+                else if (error != KErrorNoRoute && error != KErrorNoRouteConnectivity &&
+                         error != KErrorNoRoadsNearStartOfRoute && error != KErrorNoRoadsNearEndOfRoute)
+                    return error;
+                }
+            }
+        return KErrorNone;
+        }
+    /**
+    Creates a route visiting all the points in aCoordSet in a good order, with the same parameters as CreateBestRoute.
+    The order is found using only a matrix of travel times made by CreateRouteMatrix, improving it with 2-opt and Or-opt moves,
+    with aIterations starting orders tried in parallel; only the route in the final order is kept.
+    */
+    std::unique_ptr<CRoute> CreateBestRouteUsingMatrix(TResult& aError,const TRouteProfile& aProfile,const TRouteCoordSet& aCoordSet,bool aStartFixed,bool aEndFixed,size_t aIterations)
+        {
+        CRouteMatrix matrix;
+        aError = CreateRouteMatrix(matrix,aProfile,aCoordSet,aCoordSet);
+        if (aError)
+            return nullptr;
+        std::vector<uint32_t> order;
+        Router::OptimizeWaypointOrder(matrix,aStartFixed,aEndFixed,aIterations,order);
+        TRouteCoordSet ordered(aCoordSet.iCoordType);
+        for (auto i : order)
+            ordered.iRoutePointArray.push_back(aCoordSet.iRoutePointArray[i]);
+        return CreateRoute(aError,aProfile,ordered);
+        }
+    /**
+    Matches a GPS track to the roads in the layer "road" using the hidden Markov model of MatchTrace, for offline processing.
+    The roads near the track are put in aRoadArray, and arc numbers in aResult are indexes into aRoadArray.
+    The distance by road between candidate positions is found by creating a route using aProfile, except for two positions on a road
+    with a single line, for which the distance along the road is used. The path in aResult is made from routes joining the matched points.
+    */
+    TResult MatchTrack(CMapMatchResult& aResult,CMapObjectArray& aRoadArray,const CTrackGeometry& aTrack,const TRouteProfile& aProfile,const TMapMatchParam& aParam)
+        {
+        std::vector<TMapMatchObservation> trace;
+        for (size_t i = 0; i < aTrack.ContourCount(); i++)
+            for (size_t j = 0; j < aTrack.PointCount(i); j++)
+                {
+                TMapMatchObservation ob;
+                ob.iPoint = aTrack.Point(i,j);
+                TResult error = ConvertPoint(ob.iPoint.iX,ob.iPoint.iY,aTrack.CoordType(),TCoordType::Map);
+                if (error)
+                    return error;
+                trace.push_back(ob);
+                }
+        return MatchTrace(aResult,aRoadArray,trace,aProfile,aParam);
+        }
+    /**
+    Matches a GPS track, given as navigation data, to the roads in the layer "road", in the same way as the other overload.
+    The course is used where it is valid. Elements without a valid position are not matched.
+    */
+    TResult MatchTrack(CMapMatchResult& aResult,CMapObjectArray& aRoadArray,const std::vector<TNavigationData>& aTrack,const TRouteProfile& aProfile,const TMapMatchParam& aParam)
+        {
+        std::vector<TMapMatchObservation> trace;
+        std::vector<size_t> trace_index;
+        for (size_t i = 0; i < aTrack.size(); i++)
+            {
+            const TNavigationData& d = aTrack[i];
+            if (!(d.iValidity & TNavigationData::KPositionValid))
+                continue;
+            TMapMatchObservation ob;
+            ob.iPoint = d.iPosition;
+            TResult error = ConvertPoint(ob.iPoint.iX,ob.iPoint.iY,TCoordType::Degree,TCoordType::Map);
+            if (error)
+                return error;
+            ob.iCourse = d.iCourse;
+            ob.iCourseKnown = (d.iValidity & TNavigationData::KCourseValid) != 0;
+            trace.push_back(ob);
+            trace_index.push_back(i);
+            }
+        CMapMatchResult result;
+        TResult error = MatchTrace(result,aRoadArray,trace,aProfile,aParam);
+        if (error)
+            return error;
+        aResult.iPoint.assign(aTrack.size(),TMatchedPoint());
+        for (size_t i = 0; i < trace_index.size(); i++)
+            aResult.iPoint[trace_index[i]] = result.iPoint[i];
+        aResult.iArc = std::move(result.iArc);
+        aResult.iPath = std::move(result.iPath);
+        return KErrorNone;
+        }
     std::unique_ptr<CRoute> CreateRouteHelper(TResult& aError,bool aBest,const TRouteProfile& aProfile,const TRouteCoordSet& aCoordSet,bool aStartFixed,bool aEndFixed,size_t aIterations);
     std::unique_ptr<CRoute> CreateRouteHelper(TResult& aError,bool aBest,const TRouteProfile& aProfile,const std::vector<Router::TRoutePointInternal>& aRoutePointArray,bool aStartFixed,bool aEndFixed,size_t aIterations);
     TResult CreateRouteAsync(RouterAsyncCallBack aCallback,const TRouteProfile& aProfile,const TRouteCoordSet& aCoordSet,bool aOverride = false);
@@ -812,6 +1061,105 @@ class CFramework: public MNavigatorObserver
     void HandleChangedLayer() { InvalidateMapBitmaps(); LayerChanged(); }
     TResult CreateTileServer(int32_t aTileWidthInPixels,int32_t aTileHeightInPixels);
     TResult SetRoutePositionAndVector(const TPoint& aPos,const TPoint& aVector);
+    TResult FindJoinObjects(CMapObjectArray& aObjectArray,const TRectFP& aBounds,TMapObjectType aType,const TFindParam* aParam) const
+        {
+        // Clip to a rectangle slightly larger than the bounds so that points on the edges of the bounds are not lost.
+        TFindParam param;
+        if (aParam)
+            param = *aParam;
+        param.iClip = CGeometry(TRectFP(aBounds.Left() - 1,aBounds.Top() - 1,aBounds.Right() + 1,aBounds.Bottom() + 1),TCoordType::Map);
+        // A join must see every object whole, so objects are not merged and the search is not cut short.
+        param.iMerge = false;
+        param.iTimeOut = std::numeric_limits<double>::infinity();
+        TResult error = Find(aObjectArray,param);
+        aObjectArray.erase(std::remove_if(aObjectArray.begin(),aObjectArray.end(),[aType](const std::unique_ptr<CMapObject>& aObject) { return aObject->Type() != aType; }),aObjectArray.end());
+        return error;
+        }
+    TResult MatchTrace(CMapMatchResult& aResult,CMapObjectArray& aRoadArray,const std::vector<TMapMatchObservation>& aTrace,const TRouteProfile& aProfile,const TMapMatchParam& aParam)
+        {
+        aResult = CMapMatchResult();
+        aRoadArray.clear();
+        if (aTrace.empty())
+            return KErrorNone;
+
+        // Find the roads within the maximum road distance of the track, and index their lines.
+        TRectFP bounds(aTrace[0].iPoint.iX,aTrace[0].iPoint.iY,aTrace[0].iPoint.iX,aTrace[0].iPoint.iY);
+        for (const auto& ob : aTrace)
+            bounds.Combine(ob.iPoint);
+        const TPointFP center((bounds.Left() + bounds.Right()) / 2,(bounds.Top() + bounds.Bottom()) / 2);
+        const double meters_per_map_unit = GetDistanceInMeters(center.iX,center.iY,center.iX + 1000,center.iY,TCoordType::Map) / 1000;
+        if (!(meters_per_map_unit > 0))
+            return KErrorInvalidArgument;
+        double margin = aParam.iLocationMatchParam.Normalized().iMaxRoadDistanceInMeters / meters_per_map_unit;
+        TFindParam find_param;
+        find_param.iLayers = "road";
+        find_param.iClip = CGeometry(TRectFP(bounds.Left() - margin,bounds.Top() - margin,bounds.Right() + margin,bounds.Bottom() + margin),TCoordType::Map);
+        find_param.iMerge = false;
+        find_param.iTimeOut = std::numeric_limits<double>::infinity();
+        TResult error = Find(aRoadArray,find_param);
+        if (error)
+            return error;
+        aRoadArray.erase(std::remove_if(aRoadArray.begin(),aRoadArray.end(),[](const std::unique_ptr<CMapObject>& aObject) { return aObject->Type() != TMapObjectType::Line; }),aRoadArray.end());
+        CRoadSnapIndex index;
+        std::vector<TPoint> point;
+        for (uint32_t i = 0; i < aRoadArray.size(); i++)
+            {
+            TContour contour;
+            for (size_t j = 0; j < aRoadArray[i]->Contours(); j++)
+                {
+                aRoadArray[i]->GetContour(j,contour);
+                point.assign(contour.begin(),contour.end());
+                index.AddArc(i,point.data(),point.size());
+                }
+            }
+        index.Build();
+
+        // Find distances by road by creating routes.
+        TRouteCoordSet coord_set(TCoordType::Map);
+        coord_set.iRoutePointArray.resize(2);
+        auto create_route = [&](const TRoadSnapResult& aFrom,const TRoadSnapResult& aTo)
+            {
+            coord_set.iRoutePointArray[0].iPoint = aFrom.iNearestPoint;
+            coord_set.iRoutePointArray[1].iPoint = aTo.iNearestPoint;
+            TResult route_error;
+            auto route = CreateRoute(route_error,aProfile,coord_set);
+            if (route_error)
+                route.reset();
+            return route;
+            };
+        auto route_distance = [&](const TRoadSnapResult& aFrom,const TRoadSnapResult& aTo,double aMaxDistance)
+            {
+            if (aFrom.iArc == aTo.iArc && aRoadArray[aFrom.iArc]->Contours() == 1)
+                return std::fabs(aTo.iDistanceAlongArc - aFrom.iDistanceAlongArc) * meters_per_map_unit;
+            auto route = create_route(aFrom,aTo);
+            return route && route->iDistance <= aMaxDistance ? route->iDistance : -1.0;
+            };
+        CartoType::MatchTrace(index,aTrace,meters_per_map_unit,aParam,route_distance,[](uint32_t) { return true; },aResult);
+
+        // Join the matched points by routes to make the path, starting a new contour at each break.
+        const TMatchedPoint* prev = nullptr;
+        for (const auto& p : aResult.iPoint)
+            {
+            if (!p.iMatched)
+                continue;
+            if (!prev || p.iBreakBefore)
+                {
+                aResult.iPath.BeginContour();
+                aResult.iPath.AppendPoint(p.iSnap.iNearestPoint);
+                }
+            else if (auto route = create_route(prev->iSnap,p.iSnap))
+                {
+                TContour path;
+                route->iPath.GetContour(0,path);
+                for (const auto& q : path)
+                    aResult.iPath.AppendPoint(q.iX,q.iY);
+                }
+            else
+                aResult.iPath.AppendPoint(p.iSnap.iNearestPoint);
+            prev = &p;
+            }
+        return KErrorNone;
+        }
     TResult CreateNavigator();
     void SetCameraParam(TCameraParam& aCameraParam,double aViewWidth,double aViewHeight);
     TResult InsertMapObject(uint32_t aMapHandle,TMapObjectType aType,const CString& aLayerName,const MPath& aGeometry,
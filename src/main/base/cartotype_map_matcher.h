@@ -0,0 +1,246 @@
+/*
+cartotype_map_matcher.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_MAP_MATCHER_H__
+#define CARTOTYPE_MAP_MATCHER_H__
+
+#include <cartotype_geometry.h>
+#include <cartotype_navigation.h>
+#include <cartotype_road_snap_index.h>
+#include <cartotype_parallel.h>
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace CartoType
+{
+
+/** Parameters used when matching GPS traces to roads. */
+class TMapMatchParam
+    {
+    public:
+    /**
+    Location accuracy, heading accuracy and maximum road distance, with the same meanings as when matching a single location.
+    Zero values select the same defaults.
+    */
+    TLocationMatchParam iLocationMatchParam;
+    /** The maximum number of candidate roads considered for each point. */
+    size_t iMaxCandidateCount = 8;
+    /**
+    The scale in metres of the exponential distribution of the difference between the distance by road between
+    successive candidates and the straight-line distance between successive points. Larger values allow more detours.
+    */
+    double iTransitionScaleInMeters = 10;
+    /** The maximum ratio of the distance by road to the straight-line distance between successive points; longer detours are not considered. */
+    double iMaxDetourFactor = 4;
+    };
+
+/** A point of a GPS trace to be matched to the road network. */
+class TMapMatchObservation
+    {
+    public:
+    /** The position in map coordinates. */
+    TPointFP iPoint;
+    /** The course in degrees clockwise from north. */
+    double iCourse = 0;
+    /** True if the course is known. */
+    bool iCourseKnown = false;
+    };
+
+/** A point of a GPS trace after map matching. */
+class TMatchedPoint
+    {
+    public:
+    /** True if the point was matched to a road. Points with no road within the maximum road distance are not matched. */
+    bool iMatched = false;
+    /** True if the point starts a new sequence because no plausible path by road joined it to the previous matched point. */
+    bool iBreakBefore = false;
+    /** The road the point was matched to, and the matched position on it. */
+    TRoadSnapResult iSnap;
+    };
+
+/** The result of matching a GPS trace to the road network. */
+class CMapMatchResult
+    {
+    public:
+    /** The matched points, one for each point in the trace. */
+    std::vector<TMatchedPoint> iPoint;
+    /** The arcs the matched points are on, in order, without consecutive duplicates. */
+    std::vector<uint32_t> iArc;
+    /**
+    The most likely path along the roads, in map coordinates. MatchTrace leaves it empty; CFramework::MatchTrack fills it in
+    with routes joining the matched points.
+    */
+    CGeometry iPath { TCoordType::Map };
+    };
+
+/**
+Matches a GPS trace to roads using a hidden Markov model and the Viterbi algorithm.
+
+Candidate roads for each point are found using aIndex. The probability of each candidate is
+based on its distance from the point and, where the course is known, its direction. The probability of moving
+between candidates for successive points is based on the difference between the distance by road, returned by
+aRouteDistance, and the straight-line distance between the points.
+
+aRouteDistance(aFrom,aTo,aMaxDistance) must return the distance in metres by road from aFrom to aTo, both of type TRoadSnapResult,
+or a negative number if there is no route shorter than aMaxDistance metres. aAccept(aArc) must return true if an arc may be used.
+aMetersPerMapUnit converts map units to metres near the trace.
+
+Where no plausible path joins two successive points the trace is split and matching continues with a new sequence.
+*/
+template<class route_distance_t,class accept_t> void MatchTrace(const CRoadSnapIndex& aIndex,const std::vector<TMapMatchObservation>& aTrace,double aMetersPerMapUnit,
+                                                                const TMapMatchParam& aParam,route_distance_t aRouteDistance,accept_t aAccept,CMapMatchResult& aResult)
+    {
+    aResult.iPoint.assign(aTrace.size(),TMatchedPoint());
+    aResult.iArc.clear();
+    if (aTrace.empty() || aMetersPerMapUnit <= 0)
+        return;
+
+    // Apply the same defaults and limits as when matching a single location.
+    const TLocationMatchParam lp = aParam.iLocationMatchParam.Normalized();
+    double accuracy = lp.iLocationAccuracyInMeters;
+    double heading_accuracy = lp.iHeadingAccuracyInDegrees;
+    double max_road_distance = lp.iMaxRoadDistanceInMeters;
+
+    // Convert the 95% errors to standard deviations.
+    double location_sigma = accuracy / 1.96;
+    double heading_sigma = heading_accuracy / 1.96 * KDegreesToRadiansDouble;
+    double beta = std::max(1.0,aParam.iTransitionScaleInMeters);
+    const double impossible = -std::numeric_limits<double>::infinity();
+
+    class TStep
+        {
+        public:
+        size_t iPointIndex = 0;
+        std::vector<TRoadSnapResult> iCandidate;
+        std::vector<double> iScore;
+        std::vector<int32_t> iPrevious;
+        };
+    std::vector<TStep> chain;
+
+    auto emission = [&](const TMapMatchObservation& aObservation,const TRoadSnapResult& aCandidate)
+        {
+        double d = aCandidate.iDistance * aMetersPerMapUnit / location_sigma;
+        double score = -0.5 * d * d;
+        if (aObservation.iCourseKnown)
+            {
+            // Compare the course with the road direction, ignoring the direction of travel along the road.
+            double course = (90 - aObservation.iCourse) * KDegreesToRadiansDouble;
+            double diff = std::fmod(std::fabs(course - aCandidate.iDirection),KPiDouble);
+            diff = std::min(diff,KPiDouble - diff) / heading_sigma;
+            score -= 0.5 * diff * diff;
+            }
+        return score;
+        };
+
+    auto finish_chain = [&]()
+        {
+        if (chain.empty())
+            return;
+        const TStep& last = chain.back();
+        int32_t best = int32_t(std::max_element(last.iScore.begin(),last.iScore.end()) - last.iScore.begin());
+        for (size_t i = chain.size(); i > 0; i--)
+            {
+            const TStep& step = chain[i - 1];
+            TMatchedPoint& p = aResult.iPoint[step.iPointIndex];
+            p.iMatched = true;
+            p.iSnap = step.iCandidate[best];
+            best = step.iPrevious[best];
+            }
+        chain.clear();
+        };
+
+    std::vector<TRoadSnapResult> candidate;
+    bool break_before = false;
+    for (size_t i = 0; i < aTrace.size(); i++)
+        {
+        const TMapMatchObservation& ob = aTrace[i];
+        aIndex.FindNearestArcs(ob.iPoint,max_road_distance / aMetersPerMapUnit,aParam.iMaxCandidateCount,candidate,aAccept);
+        if (candidate.empty())
+            {
+            finish_chain();
+            break_before = true;
+            continue;
+            }
+
+        TStep step;
+        step.iPointIndex = i;
+        step.iCandidate = candidate;
+        step.iScore.resize(candidate.size());
+        step.iPrevious.assign(candidate.size(),-1);
+        bool connected = false;
+        if (!chain.empty())
+            {
+            const TStep& prev = chain.back();
+            const TMapMatchObservation& prev_ob = aTrace[prev.iPointIndex];
+            double straight = std::hypot(ob.iPoint.iX - prev_ob.iPoint.iX,ob.iPoint.iY - prev_ob.iPoint.iY) * aMetersPerMapUnit;
+            double max_route_distance = straight * std::max(1.0,aParam.iMaxDetourFactor) + 2 * max_road_distance;
+            for (size_t j = 0; j < candidate.size(); j++)
+                {
+                double best = impossible;
+                for (size_t k = 0; k < prev.iCandidate.size(); k++)
+                    {
+                    if (prev.iScore[k] == impossible)
+                        continue;
+                    double route = aRouteDistance(prev.iCandidate[k],candidate[j],max_route_distance);
+                    if (route < 0)
+                        continue;
+                    double score = prev.iScore[k] - std::fabs(route - straight) / beta;
+                    if (score > best)
+                        {
+                        best = score;
+                        step.iPrevious[j] = int32_t(k);
+                        }
+                    }
+                step.iScore[j] = best == impossible ? impossible : best + emission(ob,candidate[j]);
+                if (best != impossible)
+                    connected = true;
+                }
+            }
+
+        // Start a new sequence if this is the first point or no candidate can be reached from the previous point.
+        if (!connected)
+            {
+            if (!chain.empty())
+                break_before = true;
+            finish_chain();
+            for (size_t j = 0; j < candidate.size(); j++)
+                {
+                step.iScore[j] = emission(ob,candidate[j]);
+                step.iPrevious[j] = -1;
+                }
+            }
+        aResult.iPoint[i].iBreakBefore = break_before;
+        break_before = false;
+        chain.push_back(std::move(step));
+        }
+    finish_chain();
+
+    for (const auto& p : aResult.iPoint)
+        if (p.iMatched && (aResult.iArc.empty() || aResult.iArc.back() != p.iSnap.iArc || p.iBreakBefore))
+            aResult.iArc.push_back(p.iSnap.iArc);
+    }
+
+/**
+Matches many GPS traces in parallel using MatchTrace, using up to aThreadCount threads,
+or DefaultThreadCount() if aThreadCount is zero. aRouteDistance must be safe to call from more than one thread at once.
+*/
+template<class route_distance_t,class accept_t> void MatchTraces(const CRoadSnapIndex& aIndex,const std::vector<std::vector<TMapMatchObservation>>& aTraceArray,double aMetersPerMapUnit,
+                                                                 const TMapMatchParam& aParam,route_distance_t aRouteDistance,accept_t aAccept,std::vector<CMapMatchResult>& aResultArray,
+                                                                 size_t aThreadCount = 0)
+    {
+    aResultArray.resize(aTraceArray.size());
+    ParallelFor(aTraceArray.size(),[&](size_t aBegin,size_t aEnd)
+        {
+        for (size_t i = aBegin; i < aEnd; i++)
+            MatchTrace(aIndex,aTraceArray[i],aMetersPerMapUnit,aParam,aRouteDistance,aAccept,aResultArray[i]);
+        },aThreadCount,1);
+    }
+
+}
+
+#endif
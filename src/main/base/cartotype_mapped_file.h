@@ -0,0 +1,156 @@
+/*
+cartotype_mapped_file.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_MAPPED_FILE_H__
+#define CARTOTYPE_MAPPED_FILE_H__
+
+#include <cartotype_errors.h>
+
+#include <memory>
+#include <stdio.h>
+#include <vector>
+
+#if defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+    #define CARTOTYPE_MAPPED_FILE_WINDOWS
+#elif defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    #define CARTOTYPE_MAPPED_FILE_POSIX
+#endif
+
+namespace CartoType
+{
+
+/**
+A read-only file mapped into memory. The data is not copied: pages are read by the operating system when they are first used,
+and are shared by all processes mapping the same file, so that many processes or frameworks using the same data
+need only one copy of it in physical memory.
+
+On platforms without memory mapping the file is read into memory.
+*/
+class CMappedFile
+    {
+    public:
+    /** Maps the file aFileName into memory. */
+    static std::unique_ptr<CMappedFile> New(TResult& aError,const char* aFileName)
+        {
+        std::unique_ptr<CMappedFile> f(new CMappedFile);
+        aError = f->Open(aFileName);
+        if (aError)
+            f.reset();
+        return f;
+        }
+    ~CMappedFile()
+        {
+#if defined(CARTOTYPE_MAPPED_FILE_WINDOWS)
+        if (iData)
+            UnmapViewOfFile(iData);
+#elif defined(CARTOTYPE_MAPPED_FILE_POSIX)
+        if (iData && iSize)
+            munmap(const_cast<uint8_t*>(iData),iSize);
+#endif
+        }
+    CMappedFile(const CMappedFile&) = delete;
+    CMappedFile& operator=(const CMappedFile&) = delete;
+
+    /** Returns a pointer to the start of the data, which is aligned to at least an 8-byte boundary. */
+    const uint8_t* Data() const { return iData; }
+    /** Returns the size of the data in bytes. */
+    size_t Size() const { return iSize; }
+
+    private:
+    CMappedFile() = default;
+
+    TResult Open(const char* aFileName)
+        {
+#if defined(CARTOTYPE_MAPPED_FILE_WINDOWS)
+        HANDLE file = CreateFileA(aFileName,GENERIC_READ,FILE_SHARE_READ,nullptr,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return KErrorNotFound;
+        LARGE_INTEGER size;
+        TResult error = KErrorNone;
+        if (!GetFileSizeEx(file,&size))
+            error = KErrorIo;
+        else if (uint64_t(size.QuadPart) > SIZE_MAX)
+            error = KErrorOverflow;
+        else if (size.QuadPart)
+            {
+            HANDLE mapping = CreateFileMappingA(file,nullptr,PAGE_READONLY,0,0,nullptr);
+            if (!mapping)
+                error = KErrorIo;
+            else
+                {
+                iData = (const uint8_t*)MapViewOfFile(mapping,FILE_MAP_READ,0,0,0);
+                CloseHandle(mapping);
+                if (!iData)
+                    error = KErrorIo;
+                else
+                    iSize = size_t(size.QuadPart);
+                }
+            }
+        CloseHandle(file);
+        return error;
+#elif defined(CARTOTYPE_MAPPED_FILE_POSIX)
+        int file = open(aFileName,O_RDONLY);
+        if (file < 0)
+            return KErrorNotFound;
+        struct stat s;
+        TResult error = KErrorNone;
+        if (fstat(file,&s))
+            error = KErrorIo;
+        else if (uint64_t(s.st_size) > SIZE_MAX)
+            error = KErrorOverflow;
+        else if (s.st_size)
+            {
+            void* p = mmap(nullptr,size_t(s.st_size),PROT_READ,MAP_SHARED,file,0);
+            if (p == MAP_FAILED)
+                error = KErrorIo;
+            else
+                {
+                iData = (const uint8_t*)p;
+                iSize = size_t(s.st_size);
+                }
+            }
+        close(file);
+        return error;
+#else
+        FILE* file = fopen(aFileName,"rb");
+        if (!file)
+            return KErrorNotFound;
+        TResult error = KErrorNone;
+        long size = 0;
+        if (fseek(file,0,SEEK_END) || (size = ftell(file)) < 0 || fseek(file,0,SEEK_SET))
+            error = KErrorIo;
+        else
+            {
+            // Read the data into 8-byte aligned memory.
+            iBuffer.resize((size_t(size) + 7) / 8);
+            iData = (const uint8_t*)iBuffer.data();
+            iSize = size_t(size);
+            if (fread(iBuffer.data(),1,iSize,file) != iSize)
+                error = KErrorIo;
+            }
+        fclose(file);
+        return error;
+#endif
+        }
+
+    const uint8_t* iData = nullptr;
+    size_t iSize = 0;
+#if !defined(CARTOTYPE_MAPPED_FILE_WINDOWS) && !defined(CARTOTYPE_MAPPED_FILE_POSIX)
+    std::vector<uint64_t> iBuffer;
+#endif
+    };
+
+}
+
+#endif
@@ -0,0 +1,367 @@
+/*
+cartotype_nav_data_format.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_NAV_DATA_FORMAT_H__
+#define CARTOTYPE_NAV_DATA_FORMAT_H__
+
+#include <cartotype_base.h>
+#include <cartotype_mapped_file.h>
+#include <cartotype_stream.h>
+
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace CartoType
+{
+
+/**
+The format of mapped navigation data: a routing graph laid out so that it can be used directly
+from a memory-mapped file, without reading, parsing or copying.
+
+The file starts with a THeader object, followed by a table of TSection objects,
+followed by the sections themselves. Every section is an array of fixed-size elements starting at an 8-byte aligned offset
+from the start of the file. There are no pointers: all references are array indexes or offsets. All values are
+in the byte order of the platform that wrote the file, which is recorded in the header; files with a different byte order are rejected.
+
+As well as the plain graph, a file may contain a contraction hierarchy in the form used by CCustomizableContractionHierarchy:
+the node order, the edges including shortcuts, and the costs of the edges for one route profile.
+*/
+namespace MappedNavData
+    {
+    /** The identifiers of the sections. */
+    enum class TSectionId: uint32_t
+        {
+        /** The nodes, as an array of TNode, with an extra node at the end giving the end of the last node's arcs. */
+        Node = 1,
+        /** The arcs, as an array of TArc, in order of start node. */
+        Arc = 2,
+        /** The index of the first point of each arc in the ArcPoint section, as an array of uint32_t, with an extra index at the end. */
+        ArcPointIndex = 3,
+        /** The intermediate points of arcs, excluding the start and end nodes, as an array of TPoint. */
+        ArcPoint = 4,
+        /** The node order used by contraction hierarchies, as an array of uint32_t: the nodes in order of contraction. */
+        NodeOrder = 5,
+        /**
+        The edges of a contraction hierarchy, including shortcuts, as an array of uint32_t indexed by rank (position in the node order),
+        giving the index in HierarchyUpTarget of the first edge from each node to a higher node, with an extra index at the end.
+        */
+        HierarchyFirstUp = 6,
+        /** The higher node, by rank, of each edge of a contraction hierarchy, as an array of uint32_t, sorted for each lower node. */
+        HierarchyUpTarget = 7,
+        /** The cost of each edge of a contraction hierarchy from the lower to the higher node, as an array of TEdgeCost. */
+        HierarchyForwardCost = 8,
+        /** The cost of each edge of a contraction hierarchy from the higher to the lower node, as an array of TEdgeCost. */
+        HierarchyBackwardCost = 9
+        };
+
+    /** The identifying bytes at the start of every file. */
+    constexpr char KMagic[8] = { 'C','T','N','A','V','M','A','P' };
+    /** The current version of the format. */
+    constexpr uint32_t KVersion = 1;
+    /** A value used to detect the byte order. */
+    constexpr uint32_t KByteOrderMark = 0x01020304;
+    /** The alignment of sections in bytes. */
+    constexpr size_t KAlignment = 8;
+
+    /** The header at the start of a file. */
+    class THeader
+        {
+        public:
+        char iMagic[8];
+        uint32_t iVersion;
+        uint32_t iByteOrderMark;
+        uint64_t iFileSize;
+        uint32_t iSectionCount;
+        uint32_t iReserved;
+        };
+
+    /** An entry in the section table. */
+    class TSection
+        {
+        public:
+        uint32_t iId;
+        uint32_t iElementSize;
+        uint64_t iOffset;
+        uint64_t iCount;
+        };
+
+    /** A node in the routing graph. */
+    class TNode
+        {
+        public:
+        /** The position in map coordinates. */
+        TPoint iPoint;
+        /** The index of the first arc starting at this node. */
+        uint32_t iFirstArc;
+        /** Reserved; always zero. */
+        uint32_t iReserved;
+        };
+
+    /** An arc in the routing graph. */
+    class TArc
+        {
+        public:
+        /** The node at the end of the arc. */
+        uint32_t iEndNode;
+        /** The road type and access flags, using the values defined in cartotype_road_type.h. */
+        uint32_t iRoadType;
+        /** The length in metres. */
+        float iLength;
+        /** The maximum speed in kilometres per hour, or zero if it is not known. */
+        float iMaxSpeed;
+        /** The map object identifier of the road this arc is part of. */
+        uint64_t iObjectId;
+        };
+
+    /**
+    The cost of an edge of a contraction hierarchy in one direction, for a particular route profile.
+    Shortcut costs are those of the paths they represent, as calculated by CCustomizableContractionHierarchy::Customize.
+    */
+    class TEdgeCost
+        {
+        public:
+        /** The time in seconds, or infinity if the edge cannot be used in this direction. */
+        float iTime;
+        /** The distance in metres. */
+        float iDistance;
+        };
+
+    static_assert(sizeof(THeader) == 32 && sizeof(TSection) == 24 && sizeof(TNode) == 16 && sizeof(TArc) == 24 && sizeof(TEdgeCost) == 8,
+                  "mapped navigation data structures must have no padding");
+
+    /** A read-only view of an array in mapped data. */
+    template<class T> class TArrayView
+        {
+        public:
+        TArrayView() = default;
+        TArrayView(const T* aData,size_t aCount): iData(aData), iCount(aCount) { }
+        /** Returns the number of elements. */
+        size_t Count() const { return iCount; }
+        /** Returns true if there are no elements. */
+        bool Empty() const { return iCount == 0; }
+        /** Returns a pointer to the elements. */
+        const T* Data() const { return iData; }
+        /** Returns an element. */
+        const T& operator[](size_t aIndex) const { return iData[aIndex]; }
+        /** Returns a pointer to the first element, for use in range-based for loops. */
+        const T* begin() const { return iData; }
+        /** Returns a pointer after the last element, for use in range-based for loops. */
+        const T* end() const { return iData + iCount; }
+
+        private:
+        const T* iData = nullptr;
+        size_t iCount = 0;
+        };
+
+    /**
+    Mapped navigation data. Opening it maps the file and checks the header and section table; no other data is read until it is used.
+    The object may be shared by any number of frameworks and used from more than one thread at once.
+    */
+    class CData
+        {
+        public:
+        /** Maps the file aFileName and checks that it contains navigation data. */
+        static std::shared_ptr<CData> New(TResult& aError,const char* aFileName)
+            {
+            std::unique_ptr<CMappedFile> file = CMappedFile::New(aError,aFileName);
+            if (aError)
+                return nullptr;
+            std::shared_ptr<CData> data(new CData(std::move(file)));
+            aError = data->Check();
+            if (aError)
+                data.reset();
+            return data;
+            }
+
+        /** Returns the nodes, with an extra node at the end. */
+        TArrayView<TNode> Node() const { return Section<TNode>(TSectionId::Node); }
+        /** Returns the arcs. */
+        TArrayView<TArc> Arc() const { return Section<TArc>(TSectionId::Arc); }
+        /** Returns the number of nodes, not including the extra node. */
+        size_t NodeCount() const { auto n = Node(); return n.Empty() ? 0 : n.Count() - 1; }
+        /** Returns the arcs starting at a node. */
+        TArrayView<TArc> ArcsOfNode(uint32_t aNode) const
+            {
+            auto n = Node();
+            return TArrayView<TArc>(Arc().Data() + n[aNode].iFirstArc,n[aNode + 1].iFirstArc - n[aNode].iFirstArc);
+            }
+        /** Returns the intermediate points of an arc, or an empty array if there are none or the file does not store them. */
+        TArrayView<TPoint> ArcPoints(uint32_t aArc) const
+            {
+            auto index = Section<uint32_t>(TSectionId::ArcPointIndex);
+            if (aArc + 1 >= index.Count())
+                return TArrayView<TPoint>();
+            return TArrayView<TPoint>(Section<TPoint>(TSectionId::ArcPoint).Data() + index[aArc],index[aArc + 1] - index[aArc]);
+            }
+        /** Returns the contraction hierarchy node order, or an empty array if the file does not store it. */
+        TArrayView<uint32_t> NodeOrder() const { return Section<uint32_t>(TSectionId::NodeOrder); }
+        /** Returns the index of the first upward edge of each node of the contraction hierarchy, by rank, or an empty array if the file does not store the hierarchy. */
+        TArrayView<uint32_t> HierarchyFirstUp() const { return Section<uint32_t>(TSectionId::HierarchyFirstUp); }
+        /** Returns the higher node, by rank, of each edge of the contraction hierarchy, or an empty array if the file does not store the hierarchy. */
+        TArrayView<uint32_t> HierarchyUpTarget() const { return Section<uint32_t>(TSectionId::HierarchyUpTarget); }
+        /** Returns the upward costs of the edges of the contraction hierarchy, or an empty array if the file does not store them. */
+        TArrayView<TEdgeCost> HierarchyForwardCost() const { return Section<TEdgeCost>(TSectionId::HierarchyForwardCost); }
+        /** Returns the downward costs of the edges of the contraction hierarchy, or an empty array if the file does not store them. */
+        TArrayView<TEdgeCost> HierarchyBackwardCost() const { return Section<TEdgeCost>(TSectionId::HierarchyBackwardCost); }
+
+        /** Returns a section as an array of T, or an empty array if the section does not exist or has the wrong element size. */
+        template<class T> TArrayView<T> Section(TSectionId aId) const
+            {
+            const THeader& h = Header();
+            const TSection* s = (const TSection*)(iFile->Data() + sizeof(THeader));
+            for (uint32_t i = 0; i < h.iSectionCount; i++)
+                if (s[i].iId == uint32_t(aId) && s[i].iElementSize == sizeof(T))
+                    return TArrayView<T>((const T*)(iFile->Data() + s[i].iOffset),size_t(s[i].iCount));
+            return TArrayView<T>();
+            }
+
+        private:
+        explicit CData(std::unique_ptr<CMappedFile> aFile): iFile(std::move(aFile)) { }
+        const THeader& Header() const { return *(const THeader*)iFile->Data(); }
+
+        TResult Check() const
+            {
+            const uint8_t* data = iFile->Data();
+            const size_t size = iFile->Size();
+            if (size < sizeof(THeader))
+                return KErrorUnknownDataFormat;
+            const THeader& h = Header();
+            if (memcmp(h.iMagic,KMagic,sizeof(KMagic)))
+                return KErrorUnknownDataFormat;
+            if (h.iByteOrderMark != KByteOrderMark)
+                return KErrorUnknownDataFormat;
+            if (h.iVersion > KVersion)
+                return KErrorUnknownVersion;
+            if (h.iFileSize != size || (size - sizeof(THeader)) / sizeof(TSection) < h.iSectionCount)
+                return KErrorCorrupt;
+            const TSection* s = (const TSection*)(data + sizeof(THeader));
+            for (uint32_t i = 0; i < h.iSectionCount; i++)
+                {
+                if (s[i].iOffset % KAlignment || s[i].iOffset > size || !s[i].iElementSize ||
+                    s[i].iCount > (size - s[i].iOffset) / s[i].iElementSize)
+                    return KErrorCorrupt;
+                }
+
+            // Check the references between sections, so that they can be used later without checks.
+            auto node = Node();
+            auto arc = Arc();
+            if (node.Empty() || node[node.Count() - 1].iFirstArc != arc.Count())
+                return KErrorCorrupt;
+            for (size_t i = 1; i < node.Count(); i++)
+                if (node[i].iFirstArc < node[i - 1].iFirstArc)
+                    return KErrorCorrupt;
+            for (const auto& a : arc)
+                if (a.iEndNode >= NodeCount())
+                    return KErrorCorrupt;
+            auto point_index = Section<uint32_t>(TSectionId::ArcPointIndex);
+            if (!point_index.Empty())
+                {
+                if (point_index.Count() != arc.Count() + 1 || point_index[point_index.Count() - 1] != Section<TPoint>(TSectionId::ArcPoint).Count())
+                    return KErrorCorrupt;
+                for (size_t i = 1; i < point_index.Count(); i++)
+                    if (point_index[i] < point_index[i - 1])
+                        return KErrorCorrupt;
+                }
+            // The node order must be a permutation of the nodes.
+            auto order = NodeOrder();
+            if (!order.Empty() && order.Count() != NodeCount())
+                return KErrorCorrupt;
+            std::vector<bool> ordered(order.Count());
+            for (auto n : order)
+                {
+                if (n >= NodeCount() || ordered[n])
+                    return KErrorCorrupt;
+                ordered[n] = true;
+                }
+
+            // Edges must go from lower to higher nodes, and costs must be given for every edge.
+            auto first_up = HierarchyFirstUp();
+            auto up_target = HierarchyUpTarget();
+            if (!first_up.Empty() || !up_target.Empty())
+                {
+                if (order.Empty() || first_up.Count() != NodeCount() + 1 || first_up[0] || first_up[NodeCount()] != up_target.Count())
+                    return KErrorCorrupt;
+                for (uint32_t r = 0; r < NodeCount(); r++)
+                    {
+                    if (first_up[r + 1] < first_up[r])
+                        return KErrorCorrupt;
+                    for (uint32_t e = first_up[r]; e < first_up[r + 1]; e++)
+                        if (up_target[e] <= r || up_target[e] >= NodeCount())
+                            return KErrorCorrupt;
+                    }
+                }
+            auto forward_cost = HierarchyForwardCost();
+            auto backward_cost = HierarchyBackwardCost();
+            if ((!forward_cost.Empty() && forward_cost.Count() != up_target.Count()) ||
+                (!backward_cost.Empty() && backward_cost.Count() != up_target.Count()))
+                return KErrorCorrupt;
+            return KErrorNone;
+            }
+
+        std::unique_ptr<CMappedFile> iFile;
+        };
+
+    /** A class to write mapped navigation data. */
+    class CWriter
+        {
+        public:
+        /** Adds a section. The data is not copied and must remain valid until Write is called. */
+        template<class T> void AddSection(TSectionId aId,const std::vector<T>& aData)
+            {
+            static_assert(std::is_trivially_copyable<T>::value,"mapped navigation data sections must be trivially copyable");
+            TSection s;
+            s.iId = uint32_t(aId);
+            s.iElementSize = uint32_t(sizeof(T));
+            s.iOffset = 0;
+            s.iCount = aData.size();
+            iSection.push_back(s);
+            iSectionData.push_back((const uint8_t*)aData.data());
+            }
+
+        /** Writes the header, the section table and the sections. */
+        TResult Write(MOutputStream& aOutput)
+            {
+            THeader h;
+            memcpy(h.iMagic,KMagic,sizeof(KMagic));
+            h.iVersion = KVersion;
+            h.iByteOrderMark = KByteOrderMark;
+            h.iSectionCount = uint32_t(iSection.size());
+            h.iReserved = 0;
+            uint64_t offset = sizeof(THeader) + iSection.size() * sizeof(TSection);
+            for (auto& s : iSection)
+                {
+                offset = (offset + KAlignment - 1) / KAlignment * KAlignment;
+                s.iOffset = offset;
+                offset += s.iCount * s.iElementSize;
+                }
+            h.iFileSize = offset;
+
+            TResult error = aOutput.Write((const uint8_t*)&h,sizeof(h));
+            if (!error && !iSection.empty())
+                error = aOutput.Write((const uint8_t*)iSection.data(),iSection.size() * sizeof(TSection));
+            uint64_t position = sizeof(THeader) + iSection.size() * sizeof(TSection);
+            const uint8_t padding[KAlignment] = { };
+            for (size_t i = 0; !error && i < iSection.size(); i++)
+                {
+                error = aOutput.Write(padding,size_t(iSection[i].iOffset - position));
+                size_t bytes = size_t(iSection[i].iCount * iSection[i].iElementSize);
+                if (!error && bytes)
+                    error = aOutput.Write(iSectionData[i],bytes);
+                position = iSection[i].iOffset + bytes;
+                }
+            return error;
+            }
+
+        private:
+        std::vector<TSection> iSection;
+        std::vector<const uint8_t*> iSectionData;
+        };
+    }
+
+}
+
+#endif
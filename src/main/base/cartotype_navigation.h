@@ -600,6 +600,13 @@ or end of a route.
 */
 class TRouteProfile
     {
+    private:
+    auto Tuple() const
+        {
+        return std::forward_as_tuple(iVehicleType,iSpeed,iBonus,iRestrictionOverride,iTurnTime,iUTurnTime,iCrossTrafficTurnTime,iTrafficLightTime,
+                                     iShortest,iTollPenalty,iGradientSpeed,iGradientBonus,iGradientFlags);
+        }
+
     public:
     /** Creates a route profile. If the profile type is not supplied the default value is the car profile type. */
     TRouteProfile(TRouteProfileType aProfileType = TRouteProfileType::Car);
@@ -607,6 +614,37 @@ class TRouteProfile
     TResult WriteAsXml(MOutputStream& aOutput) const;
     /** Reads the route profile from XML format as a CartoTypeRouteProfile element. */
     TResult ReadFromXml(MInputStream& aInput);
+    /** The equality operator. */
+    bool operator==(const TRouteProfile& aOther) const { return Tuple() == aOther.Tuple(); }
+    /** The inequality operator. */
+    bool operator!=(const TRouteProfile& aOther) const { return !(*this == aOther); }
+    /** Returns a hash of all the parameters of the profile, suitable for use as part of a cache key. */
+    uint64_t Hash() const
+        {
+        // FNV-1a over the values of the members.
+        uint64_t hash = 14695981039346656037ULL;
+        auto add = [&hash](const void* aData,size_t aBytes)
+            {
+            for (size_t i = 0; i < aBytes; i++)
+                {
+                hash ^= ((const uint8_t*)aData)[i];
+                hash *= 1099511628211ULL;
+                }
+            };
+        auto add_value = [&add](auto aValue) { add(&aValue,sizeof(aValue)); };
+        const TVehicleType& v = iVehicleType;
+        add_value(v.iAccessFlags); add_value(v.iWeight); add_value(v.iAxleLoad); add_value(v.iDoubleAxleLoad); add_value(v.iTripleAxleLoad);
+        add_value(v.iHeight); add_value(v.iWidth); add_value(v.iLength); add_value(v.iHazMat);
+        add(iSpeed.data(),sizeof(iSpeed));
+        add(iBonus.data(),sizeof(iBonus));
+        add(iRestrictionOverride.data(),sizeof(iRestrictionOverride));
+        add_value(iTurnTime); add_value(iUTurnTime); add_value(iCrossTrafficTurnTime); add_value(iTrafficLightTime);
+        add_value(iShortest); add_value(iTollPenalty);
+        add(iGradientSpeed.data(),sizeof(iGradientSpeed));
+        add(iGradientBonus.data(),sizeof(iGradientBonus));
+        add_value(iGradientFlags);
+        return hash;
+        }
 
     /** The vehicle type, defined using access flags, dimensions, weight, etc. */
     TVehicleType iVehicleType;
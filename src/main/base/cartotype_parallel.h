@@ -0,0 +1,71 @@
+/*
+cartotype_parallel.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_PARALLEL_H__
+#define CARTOTYPE_PARALLEL_H__
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace CartoType
+{
+
+/** Returns the number of threads to use for parallel operations by default: the number of hardware threads, or 1 if that is unknown. */
+inline size_t DefaultThreadCount()
+    {
+    unsigned int n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+    }
+
+/**
+Calls aFunction(aBegin,aEnd) for consecutive ranges covering the indexes 0...aCount - 1, using up to aThreadCount threads,
+including the calling thread. If aThreadCount is zero, DefaultThreadCount() is used.
+
+Ranges are at most aGrainSize indexes long, and are handed out to threads as they become free, so that uneven amounts of work
+are balanced. If aGrainSize is zero a size is chosen giving each thread about eight ranges.
+
+aFunction must be safe to call from more than one thread at once. Returns when all the ranges have been processed.
+*/
+template<class F> void ParallelFor(size_t aCount,F aFunction,size_t aThreadCount = 0,size_t aGrainSize = 0)
+    {
+    if (!aCount)
+        return;
+    if (!aThreadCount)
+        aThreadCount = DefaultThreadCount();
+    if (!aGrainSize)
+        aGrainSize = std::max(size_t(1),aCount / (aThreadCount * 8));
+    aThreadCount = std::min(aThreadCount,(aCount + aGrainSize - 1) / aGrainSize);
+    if (aThreadCount <= 1)
+        {
+        aFunction(size_t(0),aCount);
+        return;
+        }
+
+    std::atomic<size_t> next { 0 };
+    auto worker = [&]()
+        {
+        for (;;)
+            {
+            size_t begin = next.fetch_add(aGrainSize);
+            if (begin >= aCount)
+                break;
+            aFunction(begin,std::min(aCount,begin + aGrainSize));
+            }
+        };
+    std::vector<std::thread> thread;
+    thread.reserve(aThreadCount - 1);
+    for (size_t i = 1; i < aThreadCount; i++)
+        thread.emplace_back(worker);
+    worker();
+    for (auto& t : thread)
+        t.join();
+    }
+
+}
+
+#endif
@@ -0,0 +1,353 @@
+/*
+cartotype_polygon_index.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_POLYGON_INDEX_H__
+#define CARTOTYPE_POLYGON_INDEX_H__
+
+#include <cartotype_geometry.h>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace CartoType
+{
+
+/**
+An index for fast point-in-polygon tests on polygons with many points, such as
+country boundaries and coastlines.
+
+The edges of the polygon are bucketed into horizontal rows, and each row is divided into cells.
+Cells crossed by no edges are classified when the index is built as wholly inside or wholly outside the polygon,
+so that most points are classified by a single table lookup. Points in cells crossed by edges are tested
+against the edges of their row only, using the even-odd rule.
+
+The index is immutable once built, so it can be shared between threads.
+*/
+class CPolygonContainmentIndex
+    {
+    public:
+    /** Creates an empty index, which contains no points. */
+    CPolygonContainmentIndex() = default;
+
+    /**
+    Creates an index for a polygon. All contours are treated as closed.
+    If the path has curves it is flattened first, using aMaxFlatteningDistance as the maximum
+    distance between the curves and the straight lines replacing them.
+    */
+    explicit CPolygonContainmentIndex(const MPath& aPath,double aMaxFlatteningDistance = 1)
+        {
+        if (HasCurves(aPath))
+            Construct(aPath.FlatPath(aMaxFlatteningDistance));
+        else
+            Construct(aPath);
+        }
+
+    /**
+    Creates an index for a polygon given as a geometry object, which must use map coordinates.
+    All contours are treated as closed.
+    */
+    explicit CPolygonContainmentIndex(const CGeometry& aGeometry,double aMaxFlatteningDistance = 1):
+        CPolygonContainmentIndex(TGeometryPath(aGeometry),aMaxFlatteningDistance)
+        {
+        }
+
+    /** Returns true if the polygon contains the point (aX,aY). */
+    bool Contains(double aX,double aY) const
+        {
+        if (iEdge.empty() ||
+            aX < iBounds.Left() || aX > iBounds.Right() ||
+            aY < iBounds.Top() || aY > iBounds.Bottom())
+            return false;
+        int32_t row = Row(aY);
+        switch (iCell[(size_t)row * iColumns + Column(aX)])
+            {
+            case TCellType::Outside: return false;
+            case TCellType::Inside: return true;
+            default: return RowContains(row,aX,aY);
+            }
+        }
+    /** Returns true if the polygon contains aPoint. */
+    bool Contains(const TPoint& aPoint) const { return Contains(aPoint.iX,aPoint.iY); }
+    /** Returns true if the polygon contains aPoint. */
+    bool Contains(const TPointFP& aPoint) const { return Contains(aPoint.iX,aPoint.iY); }
+
+    /** Returns the number of non-horizontal edges in the polygon. */
+    size_t EdgeCount() const { return iEdge.size(); }
+    /** Returns the bounding box of the polygon. */
+    const TRect& Bounds() const { return iBounds; }
+    /** Returns the approximate number of bytes of memory used by the index. */
+    size_t MemoryUsed() const
+        {
+        return sizeof(*this) + iEdge.size() * sizeof(TEdge) + iRowStart.size() * sizeof(uint32_t) +
+               iRowEdge.size() * sizeof(uint32_t) + iCell.size() * sizeof(TCellType);
+        }
+
+    /**
+    The number of points below which it is not worth creating an index,
+    because a simple test on all the edges is about as fast as an index lookup.
+    */
+    static constexpr size_t KMinPointCount = 64;
+
+    private:
+    enum class TCellType: uint8_t
+        {
+        Outside,
+        Inside,
+        Mixed
+        };
+
+    class TEdge
+        {
+        public:
+        TEdge(const TPoint& aStart,const TPoint& aEnd): iStart(aStart), iEnd(aEnd) { }
+        int32_t MinY() const { return std::min(iStart.iY,iEnd.iY); }
+        int32_t MaxY() const { return std::max(iStart.iY,iEnd.iY); }
+        int32_t MaxX() const { return std::max(iStart.iX,iEnd.iX); }
+        /** Returns the x coordinate at aY, which must be within the y range of the edge. */
+        double XAt(double aY) const
+            {
+            return iStart.iX + (double(iEnd.iX) - iStart.iX) * (aY - iStart.iY) / (double(iEnd.iY) - iStart.iY);
+            }
+
+        TPoint iStart;
+        TPoint iEnd;
+        };
+
+    /** A path made from a geometry object by rounding its coordinates to integers. */
+    class TGeometryPath: public MPath
+        {
+        public:
+        explicit TGeometryPath(const CGeometry& aGeometry)
+            {
+            for (size_t i = 0; i < aGeometry.ContourCount(); i++)
+                {
+                iContour.emplace_back();
+                for (size_t j = 0; j < aGeometry.PointCount(i); j++)
+                    {
+                    const auto& p = aGeometry.Point(i,j);
+                    iContour.back().emplace_back(int32_t(std::lround(p.iX)),int32_t(std::lround(p.iY)),p.iType);
+                    }
+                }
+            }
+        size_t Contours() const override { return iContour.size(); }
+        void GetContour(size_t aIndex,TContour& aContour) const override
+            {
+            aContour = TContour(iContour[aIndex].data(),iContour[aIndex].size(),true);
+            }
+
+        private:
+        std::vector<std::vector<TOutlinePoint>> iContour;
+        };
+
+    static bool HasCurves(const MPath& aPath)
+        {
+        if (!aPath.MayHaveCurves())
+            return false;
+        TContour contour;
+        for (size_t i = 0; i < aPath.Contours(); i++)
+            {
+            aPath.GetContour(i,contour);
+            for (const auto& p : contour)
+                if (p.iType != TPointType::OnCurve)
+                    return true;
+            }
+        return false;
+        }
+
+    void Construct(const MPath& aPath)
+        {
+        TContour contour;
+        std::vector<TEdge> horizontal_edge;
+        bool have_bounds = false;
+        for (size_t i = 0; i < aPath.Contours(); i++)
+            {
+            aPath.GetContour(i,contour);
+            size_t n = contour.Points();
+            if (n < 3)
+                continue;
+            for (size_t j = 0; j < n; j++)
+                {
+                const TPoint& p = contour.Point(j);
+                const TPoint& q = contour.Point(j + 1 < n ? j + 1 : 0);
+                if (p.iY != q.iY)
+                    iEdge.emplace_back(p,q);
+                else if (p.iX != q.iX)
+                    horizontal_edge.emplace_back(p,q);
+                if (!have_bounds)
+                    {
+                    iBounds = TRect(p.iX,p.iY,p.iX,p.iY);
+                    have_bounds = true;
+                    }
+                else
+                    {
+                    iBounds.iTopLeft.iX = std::min(iBounds.iTopLeft.iX,p.iX);
+                    iBounds.iTopLeft.iY = std::min(iBounds.iTopLeft.iY,p.iY);
+                    iBounds.iBottomRight.iX = std::max(iBounds.iBottomRight.iX,p.iX);
+                    iBounds.iBottomRight.iY = std::max(iBounds.iBottomRight.iY,p.iY);
+                    }
+                }
+            }
+        if (iEdge.empty())
+            return;
+
+        // Choose a grid with more rows than columns, because only the rows are used when testing edges.
+        double root = std::sqrt((double)iEdge.size());
+        iRows = std::max(1,std::min(4096,int32_t(root * 2)));
+        iColumns = std::max(1,std::min(1024,int32_t(root)));
+        iRowHeight = std::max(1.0,double(iBounds.Height()) / iRows);
+        iColumnWidth = std::max(1.0,double(iBounds.Width()) / iColumns);
+
+        // Put the edges into rows, using a counting sort.
+        iRowStart.assign(iRows + 1,0);
+        for (const auto& e : iEdge)
+            for (int32_t row = Row(e.MinY()), last = Row(e.MaxY()); row <= last; row++)
+                iRowStart[row + 1]++;
+        for (int32_t row = 0; row < iRows; row++)
+            iRowStart[row + 1] += iRowStart[row];
+        iRowEdge.resize(iRowStart[iRows]);
+        std::vector<uint32_t> next(iRowStart.begin(),iRowStart.end() - 1);
+        for (uint32_t i = 0; i < (uint32_t)iEdge.size(); i++)
+            for (int32_t row = Row(iEdge[i].MinY()), last = Row(iEdge[i].MaxY()); row <= last; row++)
+                iRowEdge[next[row]++] = i;
+
+        // Sort the edges in each row by descending maximum x so that row tests can stop early.
+        for (int32_t row = 0; row < iRows; row++)
+            std::sort(iRowEdge.begin() + iRowStart[row],iRowEdge.begin() + iRowStart[row + 1],
+                      [this](uint32_t aP,uint32_t aQ) { return iEdge[aP].MaxX() > iEdge[aQ].MaxX(); });
+
+        // Mark the cells crossed by edges, allowing a small margin for rounding errors.
+        iCell.assign((size_t)iRows * iColumns,TCellType::Outside);
+        double margin = iColumnWidth * 1e-6;
+        for (int32_t row = 0; row < iRows; row++)
+            {
+            double row_top = iBounds.Top() + row * iRowHeight;
+            double row_bottom = row_top + iRowHeight;
+            for (uint32_t i = iRowStart[row]; i < iRowStart[row + 1]; i++)
+                {
+                const TEdge& e = iEdge[iRowEdge[i]];
+                double x0 = e.XAt(std::max(row_top,(double)e.MinY()));
+                double x1 = e.XAt(std::min(row_bottom,(double)e.MaxY()));
+                if (x0 > x1)
+                    std::swap(x0,x1);
+                TCellType* cell = &iCell[(size_t)row * iColumns];
+                for (int32_t col = Column(x0 - margin), last = Column(x1 + margin); col <= last; col++)
+                    cell[col] = TCellType::Mixed;
+                }
+            }
+
+        // Horizontal edges are not used when testing rows, because they cannot cross a horizontal ray,
+        // but points on either side of them may be on different sides of the boundary, so they must mark cells too.
+        double row_margin = iRowHeight * 1e-6;
+        for (const auto& e : horizontal_edge)
+            {
+            double x0 = std::min(e.iStart.iX,e.iEnd.iX);
+            double x1 = std::max(e.iStart.iX,e.iEnd.iX);
+            for (int32_t row = Row(e.iStart.iY - row_margin), last_row = Row(e.iStart.iY + row_margin); row <= last_row; row++)
+                {
+                TCellType* cell = &iCell[(size_t)row * iColumns];
+                for (int32_t col = Column(x0 - margin), last = Column(x1 + margin); col <= last; col++)
+                    cell[col] = TCellType::Mixed;
+                }
+            }
+
+        // Classify the cells not crossed by any edge using their centers.
+        for (int32_t row = 0; row < iRows; row++)
+            {
+            double y = iBounds.Top() + (row + 0.5) * iRowHeight;
+            TCellType* cell = &iCell[(size_t)row * iColumns];
+            for (int32_t col = 0; col < iColumns; col++)
+                if (cell[col] != TCellType::Mixed)
+                    cell[col] = RowContains(row,iBounds.Left() + (col + 0.5) * iColumnWidth,y) ? TCellType::Inside : TCellType::Outside;
+            }
+        }
+
+    int32_t Row(double aY) const
+        {
+        int32_t row = int32_t((aY - iBounds.Top()) / iRowHeight);
+        return row < 0 ? 0 : (row >= iRows ? iRows - 1 : row);
+        }
+
+    int32_t Column(double aX) const
+        {
+        int32_t col = int32_t((aX - iBounds.Left()) / iColumnWidth);
+        return col < 0 ? 0 : (col >= iColumns ? iColumns - 1 : col);
+        }
+
+    bool RowContains(int32_t aRow,double aX,double aY) const
+        {
+        bool inside = false;
+        for (uint32_t i = iRowStart[aRow]; i < iRowStart[aRow + 1]; i++)
+            {
+            const TEdge& e = iEdge[iRowEdge[i]];
+            if (e.MaxX() <= aX)
+                break;
+            if ((e.iStart.iY > aY) != (e.iEnd.iY > aY) && aX < e.XAt(aY))
+                inside = !inside;
+            }
+        return inside;
+        }
+
+    TRect iBounds;
+    std::vector<TEdge> iEdge;
+    std::vector<uint32_t> iRowStart;
+    std::vector<uint32_t> iRowEdge;
+    std::vector<TCellType> iCell;
+    int32_t iRows = 0;
+    int32_t iColumns = 0;
+    double iRowHeight = 1;
+    double iColumnWidth = 1;
+    };
+
+/**
+Containment indexes for an array of polygons, created when first needed.
+Indexes are identified by the positions of the polygons in the array, not by their addresses,
+and are created only for polygons with at least CPolygonContainmentIndex::KMinPointCount points;
+smaller polygons are tested directly.
+
+The polygons must not be changed while this object exists. It is safe to call Contains from more than one thread at once.
+*/
+class CPolygonContainmentIndexArray
+    {
+    public:
+    /** Creates an object to hold the indexes for aCount polygons. */
+    explicit CPolygonContainmentIndexArray(size_t aCount):
+        iIndex(aCount),
+        iOnce(new std::once_flag[aCount])
+        {
+        }
+
+    /**
+    Returns true if aPolygon, which is polygon number aPolygonIndex, contains the point (aX,aY),
+    creating its containment index if necessary.
+    */
+    bool Contains(size_t aPolygonIndex,const MPath& aPolygon,double aX,double aY)
+        {
+        std::call_once(iOnce[aPolygonIndex],[&]()
+            {
+            size_t points = 0;
+            TContour contour;
+            for (size_t i = 0; i < aPolygon.Contours() && points < CPolygonContainmentIndex::KMinPointCount; i++)
+                {
+                aPolygon.GetContour(i,contour);
+                points += contour.Points();
+                }
+            if (points >= CPolygonContainmentIndex::KMinPointCount)
+                iIndex[aPolygonIndex] = std::make_unique<CPolygonContainmentIndex>(aPolygon);
+            });
+        const auto& index = iIndex[aPolygonIndex];
+        return index ? index->Contains(aX,aY) : aPolygon.Contains(aX,aY);
+        }
+
+    private:
+    std::vector<std::unique_ptr<CPolygonContainmentIndex>> iIndex;
+    std::unique_ptr<std::once_flag[]> iOnce;
+    };
+
+}
+
+#endif
@@ -0,0 +1,165 @@
+/*
+cartotype_reroute.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_REROUTE_H__
+#define CARTOTYPE_REROUTE_H__
+
+#include <cartotype_route_matrix.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace CartoType
+{
+
+namespace Router
+    {
+    /** The state of a forward search made by CReverseSearchTree::FindRoute, which can be reused between calls to avoid allocating memory. */
+    class CRerouteSearchState
+        {
+        public:
+        /** The times and distances from the origin. */
+        CMatrixSearchState iSearch;
+        /** The previous node on the best known route to each node. */
+        std::vector<uint32_t> iPrevious;
+        };
+
+    /**
+    A search tree rooted at a route's destination, kept after a route is created so that
+    new routes to the same destination can be found quickly when the vehicle goes off route.
+
+    The tree records, for every node it reaches, the time and distance to the destination and the next node on the way there.
+    A new route from a nearby position then needs only a small forward search, which stops as soon as
+    no route through an unexplored node can be better than the best route found through the tree.
+
+    For routers without contraction hierarchies the tree is a backward Dijkstra search over all arcs.
+    For contraction hierarchies it is the backward upward search from the destination, and the forward search uses upward arcs only;
+    the nodes returned may then be joined by shortcut arcs, which must be unpacked by the caller.
+
+    FindRoute does not change the tree, so once it has been built it can be used by more than one thread at once,
+    each with its own search state.
+    */
+    class CReverseSearchTree
+        {
+        public:
+        /** The value used for nodes with no next node, including the destination nodes. */
+        static constexpr uint32_t KNoNode = UINT32_MAX;
+
+        /**
+        Builds the tree for a graph with aNodeCount nodes, starting at the endpoints in aDestination.
+        aForEachReverseArc(aNode,aFunction) must call aFunction(aFromNode,aTime,aDistance) for each usable arc leading to aNode.
+        If aMaxTime is finite the search stops at that time from the destination, limiting the memory used.
+        */
+        template<class F> void Build(size_t aNodeCount,const std::vector<TMatrixEndpoint>& aDestination,F aForEachReverseArc,double aMaxTime = CRouteMatrix::KUnreachable)
+            {
+            iState.Reset(aNodeCount);
+            iNext.assign(aNodeCount,KNoNode);
+            iSettled.assign(aNodeCount,false);
+            iSettledCount = 0;
+            for (const auto& e : aDestination)
+                iState.Relax(e.iNode,e.iTime,e.iDistance);
+            uint32_t node;
+            while (iState.Pop(node))
+                {
+                double time = iState.iTime[node];
+                if (time > aMaxTime)
+                    break;
+                double distance = iState.iDistance[node];
+                iSettled[node] = true;
+                iSettledCount++;
+                aForEachReverseArc(node,[&](uint32_t aFrom,double aTime,double aDistance)
+                    {
+                    if (iState.Relax(aFrom,time + aTime,distance + aDistance))
+                        iNext[aFrom] = node;
+                    });
+                }
+            }
+
+        /** Discards the tree: for example, when the routing graph has changed because of new traffic information. */
+        void Clear()
+            {
+            iState = CMatrixSearchState();
+            iNext.clear();
+            iSettled.clear();
+            iSettledCount = 0;
+            }
+
+        /** Returns true if the tree has been built. */
+        bool IsBuilt() const { return !iSettled.empty(); }
+        /** Returns the number of nodes in the tree. */
+        size_t NodeCount() const { return iSettledCount; }
+        /** Returns true if a node is in the tree. */
+        bool Contains(uint32_t aNode) const { return aNode < iSettled.size() && iSettled[aNode]; }
+        /** Returns the time in seconds from a node to the destination, or CRouteMatrix::KUnreachable if the node is not in the tree. */
+        double Time(uint32_t aNode) const { return Contains(aNode) ? iState.iTime[aNode] : CRouteMatrix::KUnreachable; }
+
+        /**
+        Finds the fastest route from the endpoints in aOrigin to the destination, using the tree and a forward search.
+        aForEachArc(aNode,aFunction) must call aFunction(aToNode,aTime,aDistance) for each usable arc leaving aNode.
+        aState holds the state of the forward search and may be reused between calls to avoid allocating memory.
+
+        On success puts the nodes of the route in aPath, starting at one of the origin nodes and ending at one of the destination nodes,
+        puts the time and distance in aTime and aDistance, and returns true. Returns false if no route is found.
+        */
+        template<class F> bool FindRoute(const std::vector<TMatrixEndpoint>& aOrigin,F aForEachArc,CRerouteSearchState& aState,
+                                         std::vector<uint32_t>& aPath,double& aTime,double& aDistance) const
+            {
+            aPath.clear();
+            if (!IsBuilt())
+                return false;
+            size_t node_count = iSettled.size();
+            CMatrixSearchState& search = aState.iSearch;
+            std::vector<uint32_t>& previous = aState.iPrevious;
+            search.Reset(node_count);
+            previous.resize(node_count);
+            for (const auto& e : aOrigin)
+                if (search.Relax(e.iNode,e.iTime,e.iDistance))
+                    previous[e.iNode] = KNoNode;
+
+            double best_time = CRouteMatrix::KUnreachable;
+            uint32_t meeting_node = KNoNode;
+            uint32_t node;
+            while (search.Pop(node))
+                {
+                double time = search.iTime[node];
+                if (time >= best_time)
+                    break;
+                if (iSettled[node] && time + iState.iTime[node] < best_time)
+                    {
+                    best_time = time + iState.iTime[node];
+                    aDistance = search.iDistance[node] + iState.iDistance[node];
+                    meeting_node = node;
+                    }
+                double distance = search.iDistance[node];
+                aForEachArc(node,[&](uint32_t aTo,double aTime,double aDistance)
+                    {
+                    if (search.Relax(aTo,time + aTime,distance + aDistance))
+                        previous[aTo] = node;
+                    });
+                }
+            if (meeting_node == KNoNode)
+                return false;
+
+            for (uint32_t n = meeting_node; n != KNoNode; n = previous[n])
+                aPath.push_back(n);
+            std::reverse(aPath.begin(),aPath.end());
+            for (uint32_t n = iNext[meeting_node]; n != KNoNode; n = iNext[n])
+                aPath.push_back(n);
+            aTime = best_time;
+            return true;
+            }
+
+        private:
+        CMatrixSearchState iState;
+        std::vector<uint32_t> iNext;
+        std::vector<bool> iSettled;
+        size_t iSettledCount = 0;
+        };
+    }
+
+}
+
+#endif
@@ -0,0 +1,304 @@
+/*
+cartotype_road_snap_index.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_ROAD_SNAP_INDEX_H__
+#define CARTOTYPE_ROAD_SNAP_INDEX_H__
+
+#include <cartotype_base.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace CartoType
+{
+
+/** A point on a routable arc found by CRoadSnapIndex. */
+class TRoadSnapResult
+    {
+    public:
+    /** The arc identifier supplied when the arc was added to the index. */
+    uint32_t iArc = 0;
+    /** The nearest point on the arc, in map coordinates. */
+    TPointFP iNearestPoint;
+    /** The distance from the query point to the nearest point, in map units. */
+    double iDistance = 0;
+    /** The distance along the arc from its start to the nearest point, in map units. */
+    double iDistanceAlongArc = 0;
+    /** The direction of the arc at the nearest point, in radians anticlockwise from the positive x axis, in map coordinates. */
+    double iDirection = 0;
+    };
+
+/**
+A static spatial index of the line segments of routable arcs, used to snap points such as GPS fixes
+and route points to the nearest road.
+
+Segments are stored compactly, with integer endpoints, in the cells of a uniform grid, and queries search
+rings of cells outward from the query point, stopping as soon as no nearer segment can exist. This makes
+snapping a bounded local search, independent of the size of the map, rather than a general map object query.
+The arcs are supplied by the caller; CFramework::FindNearestRoad and the router's own snapping do not use this index.
+The index is immutable once built and may be used by more than one thread at once.
+*/
+class CRoadSnapIndex
+    {
+    public:
+    /** Creates an empty index. */
+    CRoadSnapIndex() = default;
+
+    /**
+    Adds an arc, identified by aArc, with the aCount points in aPoint, in map coordinates.
+    Arcs must be added before Build is called.
+    */
+    void AddArc(uint32_t aArc,const TPoint* aPoint,size_t aCount)
+        {
+        float offset = 0;
+        for (size_t i = 1; i < aCount; i++)
+            {
+            TSegment s;
+            s.iStart = aPoint[i - 1];
+            s.iEnd = aPoint[i];
+            s.iArc = aArc;
+            s.iArcOffset = offset;
+            iSegment.push_back(s);
+            offset += float(std::hypot(double(s.iEnd.iX) - s.iStart.iX,double(s.iEnd.iY) - s.iStart.iY));
+            }
+        }
+
+    /**
+    Builds the grid after all arcs have been added. If aCellSize is zero or less a cell size is chosen
+    giving about four segments per cell.
+    */
+    void Build(double aCellSize = 0)
+        {
+        iCellStart.clear();
+        iCellSegment.clear();
+        if (iSegment.empty())
+            return;
+
+        iBounds = TRect(iSegment[0].iStart.iX,iSegment[0].iStart.iY,iSegment[0].iStart.iX,iSegment[0].iStart.iY);
+        for (const auto& s : iSegment)
+            {
+            for (const TPoint* p : { &s.iStart, &s.iEnd })
+                {
+                iBounds.iTopLeft.iX = std::min(iBounds.iTopLeft.iX,p->iX);
+                iBounds.iTopLeft.iY = std::min(iBounds.iTopLeft.iY,p->iY);
+                iBounds.iBottomRight.iX = std::max(iBounds.iBottomRight.iX,p->iX);
+                iBounds.iBottomRight.iY = std::max(iBounds.iBottomRight.iY,p->iY);
+                }
+            }
+        double width = std::max(1.0,double(iBounds.Width()));
+        double height = std::max(1.0,double(iBounds.Height()));
+        if (aCellSize <= 0)
+            aCellSize = std::sqrt(width * height / (double(iSegment.size()) / 4));
+        const double max_cells = 1 << 22;
+        aCellSize = std::max({ aCellSize,1.0,std::sqrt(width * height / max_cells) });
+        iCellSize = aCellSize;
+        iColumns = int32_t(width / iCellSize) + 1;
+        iRows = int32_t(height / iCellSize) + 1;
+
+        // Put the segments into the cells they cross, using a counting sort.
+        iCellStart.assign(size_t(iColumns) * iRows + 1,0);
+        for (int pass = 0; pass < 2; pass++)
+            {
+            std::vector<uint32_t> next;
+            if (pass == 1)
+                {
+                for (size_t i = 1; i < iCellStart.size(); i++)
+                    iCellStart[i] += iCellStart[i - 1];
+                iCellSegment.resize(iCellStart.back());
+                next.assign(iCellStart.begin(),iCellStart.end() - 1);
+                }
+            for (uint32_t i = 0; i < (uint32_t)iSegment.size(); i++)
+                {
+                ForEachCell(iSegment[i],[&](size_t aCell)
+                    {
+                    if (pass == 0)
+                        iCellStart[aCell + 1]++;
+                    else
+                        iCellSegment[next[aCell]++] = i;
+                    });
+                }
+            }
+        }
+
+    /** Returns the number of segments in the index. */
+    size_t SegmentCount() const { return iSegment.size(); }
+    /** Returns the approximate number of bytes of memory used by the index. */
+    size_t MemoryUsed() const { return sizeof(*this) + iSegment.size() * sizeof(TSegment) + (iCellStart.size() + iCellSegment.size()) * sizeof(uint32_t); }
+
+    /**
+    Finds the nearest accepted arc to aPoint within aMaxDistance map units, returning false if there is none.
+    aAccept(aArc) must return true if arc number aArc may be used: for example if it is allowed by the current route profile.
+    */
+    template<class F> bool FindNearest(const TPointFP& aPoint,double aMaxDistance,TRoadSnapResult& aResult,F aAccept) const
+        {
+        std::vector<TRoadSnapResult> result;
+        FindNearestArcs(aPoint,aMaxDistance,1,result,aAccept);
+        if (result.empty())
+            return false;
+        aResult = result[0];
+        return true;
+        }
+    /** Finds the nearest arc to aPoint within aMaxDistance map units, returning false if there is none. */
+    bool FindNearest(const TPointFP& aPoint,double aMaxDistance,TRoadSnapResult& aResult) const
+        {
+        return FindNearest(aPoint,aMaxDistance,aResult,[](uint32_t) { return true; });
+        }
+
+    /**
+    Finds up to aMaxCount different accepted arcs within aMaxDistance map units of aPoint, giving the nearest point
+    on each arc, and puts them in aResult in order of increasing distance. Returns the number of arcs found.
+    aAccept(aArc) must return true if arc number aArc may be used.
+    */
+    template<class F> size_t FindNearestArcs(const TPointFP& aPoint,double aMaxDistance,size_t aMaxCount,std::vector<TRoadSnapResult>& aResult,F aAccept) const
+        {
+        aResult.clear();
+        if (iSegment.empty() || !aMaxCount)
+            return 0;
+
+        int32_t cx = Column(aPoint.iX);
+        int32_t cy = Row(aPoint.iY);
+        // The query point may be outside the grid; allow for its distance from the nearest cell.
+        double outside = std::max({ 0.0,iBounds.Left() - aPoint.iX,aPoint.iX - iBounds.Right(),iBounds.Top() - aPoint.iY,aPoint.iY - iBounds.Bottom() });
+        int32_t max_ring = std::max(iColumns,iRows);
+        for (int32_t ring = 0; ring <= max_ring; ring++)
+            {
+            // No segment in this ring or beyond can be nearer than this.
+            double min_distance = std::max(outside,(ring - 1) * iCellSize);
+            if (min_distance > aMaxDistance ||
+                (aResult.size() == aMaxCount && min_distance > aResult.back().iDistance))
+                break;
+            for (int32_t y = cy - ring; y <= cy + ring; y++)
+                {
+                if (y < 0 || y >= iRows)
+                    continue;
+                bool edge_row = y == cy - ring || y == cy + ring;
+                for (int32_t x = cx - ring; x <= cx + ring; x += (edge_row ? 1 : 2 * ring))
+                    {
+                    if (x >= 0 && x < iColumns)
+                        SearchCell(size_t(y) * iColumns + x,aPoint,aMaxDistance,aMaxCount,aResult,aAccept);
+                    if (ring == 0)
+                        break;
+                    }
+                }
+            }
+        return aResult.size();
+        }
+
+    private:
+    class TSegment
+        {
+        public:
+        TPoint iStart;
+        TPoint iEnd;
+        uint32_t iArc = 0;
+        float iArcOffset = 0;   // the distance along the arc to the start of this segment
+        };
+
+    int32_t Column(double aX) const
+        {
+        int32_t x = int32_t(std::floor((aX - iBounds.Left()) / iCellSize));
+        return x < 0 ? 0 : (x >= iColumns ? iColumns - 1 : x);
+        }
+    int32_t Row(double aY) const
+        {
+        int32_t y = int32_t(std::floor((aY - iBounds.Top()) / iCellSize));
+        return y < 0 ? 0 : (y >= iRows ? iRows - 1 : y);
+        }
+
+    /**
+    Calls aFunction(aCell) for each cell crossed by a segment, walking along the segment from cell to cell.
+    At each step the walk moves to the next column or row, whichever boundary the segment reaches first.
+    */
+    template<class F> void ForEachCell(const TSegment& aSegment,F aFunction) const
+        {
+        double sx = (aSegment.iStart.iX - iBounds.Left()) / iCellSize;
+        double sy = (aSegment.iStart.iY - iBounds.Top()) / iCellSize;
+        double dx = (double(aSegment.iEnd.iX) - aSegment.iStart.iX) / iCellSize;
+        double dy = (double(aSegment.iEnd.iY) - aSegment.iStart.iY) / iCellSize;
+        int32_t x = Column(aSegment.iStart.iX), y = Row(aSegment.iStart.iY);
+        const int32_t end_x = Column(aSegment.iEnd.iX), end_y = Row(aSegment.iEnd.iY);
+        const int32_t step_x = dx > 0 ? 1 : -1, step_y = dy > 0 ? 1 : -1;
+
+        // The fractions of the segment at which it reaches the next column and row boundaries, and the fraction needed to cross a whole cell.
+        const double infinity = std::numeric_limits<double>::infinity();
+        double next_x = dx > 0 ? (x + 1 - sx) / dx : (dx < 0 ? (x - sx) / dx : infinity);
+        double next_y = dy > 0 ? (y + 1 - sy) / dy : (dy < 0 ? (y - sy) / dy : infinity);
+        const double cell_x = dx != 0 ? std::abs(1 / dx) : infinity;
+        const double cell_y = dy != 0 ? std::abs(1 / dy) : infinity;
+
+        aFunction(size_t(y) * iColumns + x);
+        for (int32_t steps = std::abs(end_x - x) + std::abs(end_y - y); steps > 0; steps--)
+            {
+            // Rounding may make the boundary fractions disagree with the end cell, so the end cell decides when only one direction is left.
+            if (y == end_y || (x != end_x && next_x < next_y))
+                {
+                x += step_x;
+                next_x += cell_x;
+                }
+            else
+                {
+                y += step_y;
+                next_y += cell_y;
+                }
+            aFunction(size_t(y) * iColumns + x);
+            }
+        }
+
+    template<class F> void SearchCell(size_t aCell,const TPointFP& aPoint,double aMaxDistance,size_t aMaxCount,std::vector<TRoadSnapResult>& aResult,F& aAccept) const
+        {
+        for (uint32_t i = iCellStart[aCell]; i < iCellStart[aCell + 1]; i++)
+            {
+            const TSegment& s = iSegment[iCellSegment[i]];
+            double dx = double(s.iEnd.iX) - s.iStart.iX;
+            double dy = double(s.iEnd.iY) - s.iStart.iY;
+            double length_squared = dx * dx + dy * dy;
+            double t = length_squared > 0 ? ((aPoint.iX - s.iStart.iX) * dx + (aPoint.iY - s.iStart.iY) * dy) / length_squared : 0;
+            t = std::max(0.0,std::min(1.0,t));
+            TPointFP nearest(s.iStart.iX + t * dx,s.iStart.iY + t * dy);
+            double distance = std::hypot(nearest.iX - aPoint.iX,nearest.iY - aPoint.iY);
+            if (distance > aMaxDistance ||
+                (aResult.size() == aMaxCount && distance >= aResult.back().iDistance))
+                continue;
+
+            if (!aAccept(s.iArc))
+                continue;
+
+            // Keep only the nearest point on each arc.
+            auto same_arc = std::find_if(aResult.begin(),aResult.end(),[&s](const TRoadSnapResult& aR) { return aR.iArc == s.iArc; });
+            if (same_arc != aResult.end())
+                {
+                if (same_arc->iDistance <= distance)
+                    continue;
+                aResult.erase(same_arc);
+                }
+
+            TRoadSnapResult r;
+            r.iArc = s.iArc;
+            r.iNearestPoint = nearest;
+            r.iDistance = distance;
+            r.iDistanceAlongArc = s.iArcOffset + t * std::sqrt(length_squared);
+            r.iDirection = std::atan2(dy,dx);
+            auto pos = std::upper_bound(aResult.begin(),aResult.end(),distance,[](double aD,const TRoadSnapResult& aR) { return aD < aR.iDistance; });
+            aResult.insert(pos,r);
+            if (aResult.size() > aMaxCount)
+                aResult.pop_back();
+            }
+        }
+
+    std::vector<TSegment> iSegment;
+    std::vector<uint32_t> iCellStart;
+    std::vector<uint32_t> iCellSegment;
+    TRect iBounds;
+    double iCellSize = 1;
+    int32_t iColumns = 0;
+    int32_t iRows = 0;
+    };
+
+}
+
+#endif
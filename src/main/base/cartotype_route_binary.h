@@ -0,0 +1,483 @@
+/*
+cartotype_route_binary.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_ROUTE_BINARY_H__
+#define CARTOTYPE_ROUTE_BINARY_H__
+
+#include <cartotype_navigation.h>
+#include <cartotype_stream.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string.h>
+#include <vector>
+
+namespace CartoType
+{
+
+/**
+A compact binary format for routes, used to cache routes or transfer them between processes.
+It is an alternative to the CTROUTE XML format; unlike that format it stores the route exactly, in map units, so that no projection is needed,
+and it is typically more than ten times smaller.
+
+A stream contains a header followed by any number of routes. Within a stream, road names, road references and junction names
+are stored once and afterwards referred to by index, and a route profile identical to that of the previous route is not repeated.
+Paths are stored as differences from the previous point, and the path of the whole route is omitted if it is
+the concatenation of the segment paths, as it normally is. Floating-point values are stored exactly, using fewer bytes
+for round numbers.
+
+Streams must be read using a single CRouteBinaryReader, in order, because routes refer to data stored earlier in the stream.
+*/
+namespace RouteBinary
+    {
+    /** The identifying bytes at the start of every stream. */
+    constexpr char KMagic[8] = { 'C','T','R','O','U','T','E','B' };
+    /** The current version of the format. */
+    constexpr uint32_t KVersion = 1;
+    /** The maximum number of strings stored in the string table of a stream; further new strings are stored in full each time they are used. */
+    constexpr size_t KMaxStringCount = 1 << 16;
+
+    /** Flags used for the boolean members of a route segment. */
+    enum
+        {
+        KRestrictedFlag = 1,
+        KContinueFlag = 2,
+        KForkFlag = 4,
+        KTurnOffFlag = 8,
+        KClosedFlag = 16
+        };
+
+    /** Stores the bit pattern of a double in reverse byte order, so that round numbers, which have zeros in their low bits, become small integers. */
+    inline uint64_t DoubleToUint(double aValue)
+        {
+        uint64_t bits;
+        memcpy(&bits,&aValue,sizeof(bits));
+        uint64_t n = 0;
+        for (int i = 0; i < 8; i++, bits >>= 8)
+            n = (n << 8) | (bits & 0xFF);
+        return n;
+        }
+
+    /** Converts an integer created by DoubleToUint back to a double. */
+    inline double UintToDouble(uint64_t aValue)
+        {
+        uint64_t bits = 0;
+        for (int i = 0; i < 8; i++, aValue >>= 8)
+            bits = (bits << 8) | (aValue & 0xFF);
+        double d;
+        memcpy(&d,&bits,sizeof(d));
+        return d;
+        }
+    }
+
+/** A class to write routes to a stream in the compact binary format. */
+class CRouteBinaryWriter
+    {
+    public:
+    /** Creates a writer for aOutput. The stream header is written before the first route. */
+    explicit CRouteBinaryWriter(MOutputStream& aOutput): iOutput(aOutput) { }
+
+    /** Writes a route. */
+    TResult Write(const CRoute& aRoute)
+        {
+        TResult error = KErrorNone;
+        if (!iHeaderWritten)
+            {
+            error = iOutput.WriteBytes((const uint8_t*)RouteBinary::KMagic,sizeof(RouteBinary::KMagic));
+            if (!error)
+                error = iOutput.WriteUint(uint64_t(RouteBinary::KVersion));
+            if (error)
+                return error;
+            iHeaderWritten = true;
+            }
+
+        iPrevPoint = TPoint();
+        error = WriteDouble(aRoute.iPointScale);
+        if (!error) error = WriteDouble(aRoute.iDistance);
+        if (!error) error = WriteDouble(aRoute.iTime);
+        if (!error)
+            {
+            bool same_profile = iProfileWritten && aRoute.iProfile == iProfile;
+            error = iOutput.WriteUint8(same_profile ? 0 : 1);
+            if (!error && !same_profile)
+                {
+                error = WriteProfile(aRoute.iProfile);
+                iProfile = aRoute.iProfile;
+                iProfileWritten = true;
+                }
+            }
+        if (!error) error = WritePathToJunction(aRoute.iPathToJunctionBefore);
+        if (!error) error = WritePathToJunction(aRoute.iPathToJunctionAfter);
+        if (!error) error = iOutput.WriteUint(uint64_t(aRoute.iRouteSegment.size()));
+        for (size_t i = 0; !error && i < aRoute.iRouteSegment.size(); i++)
+            error = WriteSegment(*aRoute.iRouteSegment[i]);
+        if (!error)
+            {
+            bool joined = PathIsJoinedSegmentPaths(aRoute);
+            error = iOutput.WriteUint8(joined ? 0 : 1);
+            if (!error && !joined)
+                error = WritePath(aRoute.iPath);
+            }
+        return error;
+        }
+
+    private:
+    TResult WriteDouble(double aValue) { return iOutput.WriteUint(RouteBinary::DoubleToUint(aValue)); }
+
+    TResult WriteString(const CString& aString)
+        {
+        auto iter = iStringIndex.find(aString);
+        if (iter != iStringIndex.end())
+            return iOutput.WriteUint(uint64_t(iter->second));
+
+        // An index equal to the current number of strings introduces a new string.
+        uint32_t index = uint32_t(iStringIndex.size());
+        TResult error = iOutput.WriteUint(uint64_t(index));
+        if (!error)
+            error = iOutput.WriteUtf8StringWithLength(aString);
+        if (!error && iStringIndex.size() < RouteBinary::KMaxStringCount)
+            iStringIndex[aString] = index;
+        return error;
+        }
+
+    TResult WritePath(const CContour& aPath)
+        {
+        size_t n = aPath.Points();
+        bool curved = false;
+        for (size_t i = 0; !curved && i < n; i++)
+            curved = aPath.Point(i).iType != TPointType::OnCurve;
+        TResult error = iOutput.WriteUint(uint64_t(n) << 1 | (curved ? 1 : 0));
+        for (size_t i = 0; !error && curved && i < n; i++)
+            error = iOutput.WriteUint8(uint8_t(aPath.Point(i).iType));
+        for (size_t i = 0; !error && i < n; i++)
+            {
+            const TPoint& p = aPath.Point(i);
+            error = iOutput.WriteInt(int64_t(p.iX) - iPrevPoint.iX);
+            if (!error)
+                error = iOutput.WriteInt(int64_t(p.iY) - iPrevPoint.iY);
+            iPrevPoint = p;
+            }
+        return error;
+        }
+
+    TResult WritePathToJunction(const CPathToJunction& aPath)
+        {
+        TResult error = iOutput.WriteUint(uint64_t(uint32_t(aPath.iStartRoadType)));
+        if (!error) error = iOutput.WriteUint(uint64_t(uint32_t(aPath.iEndRoadType)));
+        if (!error) error = WriteDouble(aPath.iDistance);
+        if (!error) error = WritePath(aPath.iPath);
+        return error;
+        }
+
+    TResult WriteSegment(const CRouteSegment& aSegment)
+        {
+        const TTurn& t = aSegment.iTurn;
+        uint8_t flags = 0;
+        if (aSegment.iRestricted) flags |= RouteBinary::KRestrictedFlag;
+        if (t.iContinue) flags |= RouteBinary::KContinueFlag;
+        if (t.iIsFork) flags |= RouteBinary::KForkFlag;
+        if (t.iTurnOff) flags |= RouteBinary::KTurnOffFlag;
+        if (aSegment.iPath.Closed()) flags |= RouteBinary::KClosedFlag;
+
+        TResult error = iOutput.WriteUint8(flags);
+        if (!error) error = iOutput.WriteUint(uint64_t(uint32_t(aSegment.iRoadType)));
+        if (!error) error = WriteDouble(aSegment.iMaxSpeed);
+        if (!error) error = WriteString(aSegment.iName);
+        if (!error) error = WriteString(aSegment.iRef);
+        if (!error) error = WriteDouble(aSegment.iDistance);
+        if (!error) error = WriteDouble(aSegment.iTime);
+        if (!error) error = WriteDouble(aSegment.iTurnTime);
+        if (!error) error = iOutput.WriteInt(aSegment.iSection);
+        if (!error) error = iOutput.WriteUint8(uint8_t(t.iTurnType));
+        if (!error) error = iOutput.WriteUint8(uint8_t(t.iRoundaboutState));
+        if (!error) error = WriteDouble(t.iTurnAngle);
+        if (!error) error = WriteDouble(t.iInDirection);
+        if (!error) error = WriteDouble(t.iOutDirection);
+        if (!error) error = iOutput.WriteInt(t.iExitNumber);
+        if (!error) error = iOutput.WriteInt(t.iChoices);
+        if (!error) error = iOutput.WriteInt(t.iLeftAlternatives);
+        if (!error) error = iOutput.WriteInt(t.iRightAlternatives);
+        if (!error) error = WriteString(t.iJunctionName);
+        if (!error) error = WriteString(t.iJunctionRef);
+        if (!error) error = WritePath(aSegment.iPath);
+        return error;
+        }
+
+    TResult WriteProfile(const TRouteProfile& aProfile)
+        {
+        const TVehicleType& v = aProfile.iVehicleType;
+        TResult error = iOutput.WriteUint(uint64_t(v.iAccessFlags));
+        for (double d : { v.iWeight,v.iAxleLoad,v.iDoubleAxleLoad,v.iTripleAxleLoad,v.iHeight,v.iWidth,v.iLength })
+            if (!error)
+                error = WriteDouble(d);
+        if (!error) error = iOutput.WriteUint8(v.iHazMat ? 1 : 0);
+        for (size_t i = 0; !error && i < KArcRoadTypeCount; i++)
+            {
+            error = WriteDouble(aProfile.iSpeed[i]);
+            if (!error) error = WriteDouble(aProfile.iBonus[i]);
+            if (!error) error = iOutput.WriteUint(uint64_t(aProfile.iRestrictionOverride[i]));
+            }
+        for (int32_t n : { aProfile.iTurnTime,aProfile.iUTurnTime,aProfile.iCrossTrafficTurnTime,aProfile.iTrafficLightTime })
+            if (!error)
+                error = iOutput.WriteInt(n);
+        if (!error) error = iOutput.WriteUint8(aProfile.iShortest ? 1 : 0);
+        if (!error) error = WriteDouble(aProfile.iTollPenalty);
+        for (size_t i = 0; !error && i < KArcGradientCount; i++)
+            {
+            error = WriteDouble(aProfile.iGradientSpeed[i]);
+            if (!error) error = WriteDouble(aProfile.iGradientBonus[i]);
+            }
+        if (!error) error = iOutput.WriteUint(uint64_t(aProfile.iGradientFlags));
+        return error;
+        }
+
+    /** Returns true if the route path is the concatenation of the segment paths, as made by CRoute::AppendSegment. */
+    static bool PathIsJoinedSegmentPaths(const CRoute& aRoute)
+        {
+        size_t n = 0;
+        const size_t path_points = aRoute.iPath.Points();
+        for (const auto& s : aRoute.iRouteSegment)
+            {
+            for (size_t i = 0; i < s->iPath.Points(); i++)
+                {
+                const TOutlinePoint& p = s->iPath.Point(i);
+                if (n && p.iType == TPointType::OnCurve && p == aRoute.iPath.Point(n - 1))
+                    continue;
+                if (n == path_points || p != aRoute.iPath.Point(n))
+                    return false;
+                n++;
+                }
+            }
+        return n == path_points;
+        }
+
+    TDataOutputStream iOutput;
+    bool iHeaderWritten = false;
+    std::map<CString,uint32_t> iStringIndex;
+    TRouteProfile iProfile;
+    bool iProfileWritten = false;
+    TPoint iPrevPoint;
+    };
+
+/** A class to read routes written by CRouteBinaryWriter. */
+class CRouteBinaryReader
+    {
+    public:
+    /** Creates a reader for aInput. The stream header is read and checked before the first route. */
+    explicit CRouteBinaryReader(MInputStream& aInput): iInput(aInput) { }
+
+    /** Returns true if there are no more routes in the stream. */
+    bool EndOfData() const { return iInput.EndOfData(); }
+
+    /** Reads the next route. */
+    std::unique_ptr<CRoute> Read(TResult& aError)
+        {
+        aError = KErrorNone;
+        if (!iHeaderRead)
+            {
+            char magic[sizeof(RouteBinary::KMagic)];
+            size_t bytes = 0;
+            aError = iInput.ReadBytes((uint8_t*)magic,sizeof(magic),bytes);
+            if (!aError && (bytes != sizeof(magic) || memcmp(magic,RouteBinary::KMagic,sizeof(magic))))
+                aError = KErrorUnknownDataFormat;
+            uint64_t version = aError ? 0 : iInput.ReadUint(aError);
+            if (!aError && version > RouteBinary::KVersion)
+                aError = KErrorUnknownVersion;
+            if (aError)
+                return nullptr;
+            iHeaderRead = true;
+            }
+
+        std::unique_ptr<CRoute> route(new CRoute);
+        iPrevPoint = TPoint();
+        route->iPointScale = ReadDouble(aError);
+        route->iDistance = ReadDouble(aError);
+        route->iTime = ReadDouble(aError);
+        uint8_t new_profile = aError ? 0 : iInput.ReadUint8(aError);
+        if (!aError && new_profile)
+            {
+            ReadProfile(aError,iProfile);
+            iProfileRead = !aError;
+            }
+        else if (!aError && !iProfileRead)
+            aError = KErrorCorrupt;
+        route->iProfile = iProfile;
+        ReadPathToJunction(aError,route->iPathToJunctionBefore);
+        ReadPathToJunction(aError,route->iPathToJunctionAfter);
+        uint64_t segment_count = aError ? 0 : iInput.ReadUint(aError);
+        for (uint64_t i = 0; !aError && i < segment_count; i++)
+            {
+            std::unique_ptr<CRouteSegment> s(new CRouteSegment);
+            ReadSegment(aError,*s);
+            route->iRouteSegment.push_back(std::move(s));
+            }
+        uint8_t explicit_path = aError ? 0 : iInput.ReadUint8(aError);
+        if (!aError)
+            {
+            if (explicit_path)
+                ReadPath(aError,route->iPath);
+            else
+                {
+                for (const auto& s : route->iRouteSegment)
+                    for (size_t i = 0; i < s->iPath.Points(); i++)
+                        route->iPath.AppendPoint(s->iPath.Point(i));
+                }
+            }
+        if (aError)
+            return nullptr;
+        return route;
+        }
+
+    private:
+    double ReadDouble(TResult& aError)
+        {
+        uint64_t n = aError ? 0 : iInput.ReadUint(aError);
+        return aError ? 0 : RouteBinary::UintToDouble(n);
+        }
+
+    int32_t ReadInt32(TResult& aError)
+        {
+        int64_t n = aError ? 0 : iInput.ReadInt(aError);
+        if (!aError && (n < INT32_MIN || n > INT32_MAX))
+            aError = KErrorCorrupt;
+        return aError ? 0 : int32_t(n);
+        }
+
+    uint32_t ReadUint32(TResult& aError)
+        {
+        uint64_t n = aError ? 0 : iInput.ReadUint(aError);
+        if (!aError && n > UINT32_MAX)
+            aError = KErrorCorrupt;
+        return aError ? 0 : uint32_t(n);
+        }
+
+    uint8_t ReadEnum(TResult& aError,uint8_t aMaxValue)
+        {
+        uint8_t n = aError ? 0 : iInput.ReadUint8(aError);
+        if (!aError && n > aMaxValue)
+            aError = KErrorCorrupt;
+        return aError ? 0 : n;
+        }
+
+    void ReadString(TResult& aError,CString& aString)
+        {
+        uint64_t index = aError ? 0 : iInput.ReadUint(aError);
+        if (aError)
+            return;
+        if (index < iString.size())
+            aString = iString[size_t(index)];
+        else if (index == iString.size())
+            {
+            aError = iInput.ReadUtf8StringWithLength(aString);
+            if (!aError && iString.size() < RouteBinary::KMaxStringCount)
+                iString.push_back(aString);
+            }
+        else
+            aError = KErrorCorrupt;
+        }
+
+    void ReadPath(TResult& aError,CContour& aPath)
+        {
+        uint64_t n = aError ? 0 : iInput.ReadUint(aError);
+        if (aError)
+            return;
+        bool curved = (n & 1) != 0;
+        n >>= 1;
+        iPointType.clear();
+        for (uint64_t i = 0; !aError && curved && i < n; i++)
+            iPointType.push_back(TPointType(ReadEnum(aError,uint8_t(TPointType::Cubic))));
+        aPath.ReservePoints(size_t(std::min<uint64_t>(n,0x10000)));
+        for (uint64_t i = 0; !aError && i < n; i++)
+            {
+            int64_t x = iPrevPoint.iX + iInput.ReadInt(aError);
+            int64_t y = aError ? 0 : iPrevPoint.iY + iInput.ReadInt(aError);
+            if (!aError && (x < INT32_MIN || x > INT32_MAX || y < INT32_MIN || y > INT32_MAX))
+                aError = KErrorCorrupt;
+            if (aError)
+                break;
+            iPrevPoint = TPoint(int32_t(x),int32_t(y));
+            aPath.AppendPointEvenIfSame(TOutlinePoint(iPrevPoint,curved ? iPointType[size_t(i)] : TPointType::OnCurve));
+            }
+        }
+
+    void ReadPathToJunction(TResult& aError,CPathToJunction& aPath)
+        {
+        aPath.iStartRoadType = TRoadType(ReadUint32(aError));
+        aPath.iEndRoadType = TRoadType(ReadUint32(aError));
+        aPath.iDistance = ReadDouble(aError);
+        ReadPath(aError,aPath.iPath);
+        }
+
+    void ReadSegment(TResult& aError,CRouteSegment& aSegment)
+        {
+        TTurn& t = aSegment.iTurn;
+        uint8_t flags = aError ? 0 : iInput.ReadUint8(aError);
+        aSegment.iRestricted = (flags & RouteBinary::KRestrictedFlag) != 0;
+        t.iContinue = (flags & RouteBinary::KContinueFlag) != 0;
+        t.iIsFork = (flags & RouteBinary::KForkFlag) != 0;
+        t.iTurnOff = (flags & RouteBinary::KTurnOffFlag) != 0;
+        aSegment.iPath.SetClosed((flags & RouteBinary::KClosedFlag) != 0);
+
+        aSegment.iRoadType = TRoadType(ReadUint32(aError));
+        aSegment.iMaxSpeed = ReadDouble(aError);
+        ReadString(aError,aSegment.iName);
+        ReadString(aError,aSegment.iRef);
+        aSegment.iDistance = ReadDouble(aError);
+        aSegment.iTime = ReadDouble(aError);
+        aSegment.iTurnTime = ReadDouble(aError);
+        aSegment.iSection = ReadInt32(aError);
+        t.iTurnType = TTurnType(ReadEnum(aError,uint8_t(TTurnType::BearLeft)));
+        t.iRoundaboutState = TRoundaboutState(ReadEnum(aError,uint8_t(TRoundaboutState::Exit)));
+        t.iTurnAngle = ReadDouble(aError);
+        t.iInDirection = ReadDouble(aError);
+        t.iOutDirection = ReadDouble(aError);
+        t.iExitNumber = ReadInt32(aError);
+        t.iChoices = ReadInt32(aError);
+        t.iLeftAlternatives = ReadInt32(aError);
+        t.iRightAlternatives = ReadInt32(aError);
+        ReadString(aError,t.iJunctionName);
+        ReadString(aError,t.iJunctionRef);
+        ReadPath(aError,aSegment.iPath);
+        }
+
+    void ReadProfile(TResult& aError,TRouteProfile& aProfile)
+        {
+        TVehicleType& v = aProfile.iVehicleType;
+        v.iAccessFlags = ReadUint32(aError);
+        for (double* d : { &v.iWeight,&v.iAxleLoad,&v.iDoubleAxleLoad,&v.iTripleAxleLoad,&v.iHeight,&v.iWidth,&v.iLength })
+            *d = ReadDouble(aError);
+        v.iHazMat = ReadEnum(aError,1) != 0;
+        for (size_t i = 0; i < KArcRoadTypeCount; i++)
+            {
+            aProfile.iSpeed[i] = ReadDouble(aError);
+            aProfile.iBonus[i] = ReadDouble(aError);
+            aProfile.iRestrictionOverride[i] = ReadUint32(aError);
+            }
+        for (int32_t* n : { &aProfile.iTurnTime,&aProfile.iUTurnTime,&aProfile.iCrossTrafficTurnTime,&aProfile.iTrafficLightTime })
+            *n = ReadInt32(aError);
+        aProfile.iShortest = ReadEnum(aError,1) != 0;
+        aProfile.iTollPenalty = ReadDouble(aError);
+        for (size_t i = 0; i < KArcGradientCount; i++)
+            {
+            aProfile.iGradientSpeed[i] = ReadDouble(aError);
+            aProfile.iGradientBonus[i] = ReadDouble(aError);
+            }
+        aProfile.iGradientFlags = ReadUint32(aError);
+        }
+
+    TDataInputStream iInput;
+    bool iHeaderRead = false;
+    std::vector<CString> iString;
+    std::vector<TPointType> iPointType;
+    TRouteProfile iProfile;
+    bool iProfileRead = false;
+    TPoint iPrevPoint;
+    };
+
+}
+
+#endif
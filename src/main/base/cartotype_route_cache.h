@@ -0,0 +1,210 @@
+/*
+cartotype_route_cache.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_ROUTE_CACHE_H__
+#define CARTOTYPE_ROUTE_CACHE_H__
+
+#include <cartotype_route_binary.h>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace CartoType
+{
+
+/** A route point snapped to the routing graph: an arc and a position along it. */
+class TSnappedRoutePoint
+    {
+    public:
+    /** The equality operator. */
+    bool operator==(const TSnappedRoutePoint& aOther) const { return iArc == aOther.iArc && iPosition == aOther.iPosition; }
+    /** The less-than operator. */
+    bool operator<(const TSnappedRoutePoint& aOther) const { return iArc < aOther.iArc || (iArc == aOther.iArc && iPosition < aOther.iPosition); }
+
+    /** The arc index in the routing graph. */
+    uint32_t iArc = 0;
+    /** The position along the arc, as a fraction of its length. */
+    double iPosition = 0;
+    };
+
+/** The key used to look up routes in a route cache. */
+class TRouteCacheKey
+    {
+    private:
+    auto Tuple() const { return std::forward_as_tuple(iProfileHash,iGraphVersion,iRoutePoint); }
+
+    public:
+    /** The equality operator. */
+    bool operator==(const TRouteCacheKey& aOther) const { return Tuple() == aOther.Tuple(); }
+    /** The less-than operator. */
+    bool operator<(const TRouteCacheKey& aOther) const { return Tuple() < aOther.Tuple(); }
+
+    /** The snapped start, waypoints and end, in order. */
+    std::vector<TSnappedRoutePoint> iRoutePoint;
+    /** The hash of the route profile, as returned by TRouteProfile::Hash. */
+    uint64_t iProfileHash = 0;
+    /** The version of the routing graph, as returned by CRouteCache::GraphVersion. */
+    uint64_t iGraphVersion = 0;
+    };
+
+/**
+A least-recently-used cache of routes, used to avoid recalculating routes between
+frequently used pairs of points.
+
+Routes are stored in the compact binary format written by CRouteBinaryWriter, which is
+typically more than ten times smaller than a CRoute object, so that many routes can be kept.
+The cost is that each cache hit decodes the route, which is much faster than recalculating it.
+The cache is not told about changes to the routing graph. Its owner must call Invalidate after any call that changes the graph,
+including CFramework::AddTrafficInfo, AddPolygonSpeedLimit, AddLineSpeedLimit, AddClosedLineSpeedLimit, AddForbiddenArea,
+DeleteTrafficInfo, ClearTrafficInfo and EnableTrafficInfo, and after loading or unloading maps or navigation data.
+A route is returned only for a profile equal to the one it was created with, so changing the profile does not need Invalidate,
+but the owner must call it if the same profile gives different routes: for example, after a map is loaded.
+The cache can be used from more than one thread at once.
+*/
+class CRouteCache
+    {
+    public:
+    /** The default maximum number of routes stored. */
+    static constexpr size_t KDefaultMaxRouteCount = 256;
+
+    /** Creates a cache holding up to aMaxRouteCount routes. */
+    explicit CRouteCache(size_t aMaxRouteCount = KDefaultMaxRouteCount):
+        iMaxRouteCount(aMaxRouteCount)
+        {
+        }
+    CRouteCache(const CRouteCache&) = delete;
+    CRouteCache& operator=(const CRouteCache&) = delete;
+
+    /**
+    Returns the version of the routing graph, which must be used in route cache keys.
+    It is incremented by Invalidate.
+    */
+    uint64_t GraphVersion() const
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        return iGraphVersion;
+        }
+
+    /**
+    Finds a route created using aKey and aProfile, returning null if there is none.
+    The profile is compared in full, so that routes are never returned for a different profile with the same hash.
+    */
+    std::unique_ptr<CRoute> Find(const TRouteCacheKey& aKey,const TRouteProfile& aProfile)
+        {
+        std::shared_ptr<const std::vector<uint8_t>> data;
+            {
+            std::lock_guard<std::mutex> lock(iMutex);
+            auto iter = iIndex.find(aKey);
+            if (iter == iIndex.end() || aKey.iGraphVersion != iGraphVersion || iter->second->iProfile != aProfile)
+                {
+                iMisses++;
+                return nullptr;
+                }
+            iList.splice(iList.begin(),iList,iter->second);
+            iHits++;
+            data = iter->second->iData;
+            }
+
+        // Decode the route without holding the lock.
+        TMemoryInputStream input(data->data(),data->size());
+        CRouteBinaryReader reader(input);
+        TResult error;
+        std::unique_ptr<CRoute> route = reader.Read(error);
+        if (error)
+            return nullptr;
+        return route;
+        }
+
+    /** Adds a route to the cache, discarding the least recently used route if the cache is full. */
+    TResult Insert(const TRouteCacheKey& aKey,const TRouteProfile& aProfile,const CRoute& aRoute)
+        {
+        // Encode the route without holding the lock.
+        CMemoryOutputStream output;
+        TResult error = CRouteBinaryWriter(output).Write(aRoute);
+        if (error)
+            return error;
+        auto data = std::make_shared<const std::vector<uint8_t>>(output.RemoveData());
+
+        std::lock_guard<std::mutex> lock(iMutex);
+        if (!iMaxRouteCount || aKey.iGraphVersion != iGraphVersion)
+            return KErrorNone;
+        auto iter = iIndex.find(aKey);
+        if (iter != iIndex.end())
+            {
+            iBytes -= iter->second->iData->size();
+            iter->second->iProfile = aProfile;
+            iter->second->iData = data;
+            iBytes += data->size();
+            iList.splice(iList.begin(),iList,iter->second);
+            return KErrorNone;
+            }
+        iList.push_front(TEntry { aKey,aProfile,data });
+        iIndex[aKey] = iList.begin();
+        iBytes += data->size();
+        Trim();
+        return KErrorNone;
+        }
+
+    /** Discards all routes and increments the graph version. This must be called whenever the routing graph changes. */
+    void Invalidate()
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        iList.clear();
+        iIndex.clear();
+        iBytes = 0;
+        iGraphVersion++;
+        }
+
+    /** Sets the maximum number of routes stored, discarding routes if necessary. A value of zero disables the cache. */
+    void SetMaxRouteCount(size_t aMaxRouteCount)
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        iMaxRouteCount = aMaxRouteCount;
+        Trim();
+        }
+    /** Returns the number of routes stored. */
+    size_t RouteCount() const { std::lock_guard<std::mutex> lock(iMutex); return iList.size(); }
+    /** Returns the number of bytes used by the encoded routes. */
+    size_t EncodedBytes() const { std::lock_guard<std::mutex> lock(iMutex); return iBytes; }
+    /** Returns the number of times Find found a route. */
+    size_t Hits() const { std::lock_guard<std::mutex> lock(iMutex); return iHits; }
+    /** Returns the number of times Find failed to find a route. */
+    size_t Misses() const { std::lock_guard<std::mutex> lock(iMutex); return iMisses; }
+
+    private:
+    class TEntry
+        {
+        public:
+        TRouteCacheKey iKey;
+        TRouteProfile iProfile;
+        std::shared_ptr<const std::vector<uint8_t>> iData;
+        };
+
+    void Trim()
+        {
+        while (iList.size() > iMaxRouteCount)
+            {
+            iIndex.erase(iList.back().iKey);
+            iBytes -= iList.back().iData->size();
+            iList.pop_back();
+            }
+        }
+
+    mutable std::mutex iMutex;
+    std::list<TEntry> iList;
+    std::map<TRouteCacheKey,std::list<TEntry>::iterator> iIndex;
+    size_t iMaxRouteCount;
+    size_t iBytes = 0;
+    uint64_t iGraphVersion = 0;
+    size_t iHits = 0;
+    size_t iMisses = 0;
+    };
+
+}
+
+#endif
@@ -0,0 +1,428 @@
+/*
+cartotype_route_index.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_ROUTE_INDEX_H__
+#define CARTOTYPE_ROUTE_INDEX_H__
+
+#include <cartotype_base.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+namespace CartoType
+{
+
+/** A point on a route found using CRouteIndex. */
+class TRouteIndexPoint
+    {
+    public:
+    /** The index of the route segment, or -1 if the route is empty. */
+    int32_t iSegmentIndex = -1;
+    /** The index of the line within the segment's path: line N goes from point N to point N + 1. */
+    int32_t iLineIndex = 0;
+    /** The point, in map coordinates. */
+    TPointFP iPoint;
+    /** For nearest-point queries, the distance from the query point to iPoint in map units. */
+    double iDistanceToRoute = 0;
+    /** The distance of the point along the route in metres. */
+    double iDistanceAlongRoute = 0;
+    /** The distance of the point within its segment in metres. */
+    double iDistanceAlongSegment = 0;
+    /** The estimated time of the point along the route in seconds. */
+    double iTimeAlongRoute = 0;
+    /** The estimated time of the point within its segment in seconds. */
+    double iTimeAlongSegment = 0;
+    };
+
+/**
+An index of the segments of a route, used to find points on the route quickly, without scanning all its segments,
+when a route has thousands of segments.
+
+Cumulative distances and times are stored for each segment and each line, so that points at given distances or times are found
+by binary search. The lines of the route are grouped, in route order, into a hierarchy of bounding boxes, so that the nearest point
+to a given point is found by examining only the lines near it. Because the hierarchy follows route order, a search can be restricted
+to the part of the route from a given section onward.
+
+The index is immutable and may be used by more than one thread at once. Use CRouteIndexCache to create indexes when they are first needed
+and share them between the users of a route.
+
+CRoute::GetNearestSegment, CRoute::GetPointAtDistance and CRoute::GetPointAtTime, which are used by the navigator, do not use this index;
+it is used only by code that calls it directly.
+*/
+class CRouteIndex
+    {
+    public:
+    /**
+    Creates an index for the route segments in aSegment, which is an array of pointers to CRouteSegment objects,
+    or of any other objects with the members iPath, iDistance, iTime, iTurnTime and iSection.
+    */
+    template<class segment_array_t> explicit CRouteIndex(const segment_array_t& aSegment)
+        {
+        const size_t n = aSegment.size();
+        iDistanceBefore.resize(n + 1);
+        iTimeBefore.resize(n + 1);
+        iTurnTime.resize(n);
+        iSection.resize(n);
+        iFirstLine.resize(n + 1);
+        double total_length = 0;
+        for (size_t s = 0; s < n; s++)
+            {
+            const auto& segment = *aSegment[s];
+            iDistanceBefore[s + 1] = iDistanceBefore[s] + segment.iDistance;
+            iTimeBefore[s + 1] = iTimeBefore[s] + segment.iTime;
+            iTurnTime[s] = segment.iTurnTime;
+            iSection[s] = segment.iSection;
+            iFirstLine[s] = uint32_t(iLine.size());
+            double length = 0;
+            const auto& path = segment.iPath;
+            for (size_t i = 1; i < path.Points(); i++)
+                {
+                TLine line;
+                line.iStart = path.Point(i - 1);
+                line.iEnd = path.Point(i);
+                line.iSegment = uint32_t(s);
+                line.iLineIndex = uint32_t(i - 1);
+                line.iLengthBefore = length;
+                iLine.push_back(line);
+                length += std::hypot(double(line.iEnd.iX) - line.iStart.iX,double(line.iEnd.iY) - line.iStart.iY);
+                }
+            iPathLength.push_back(length);
+            total_length += length;
+            }
+        iFirstLine[n] = uint32_t(iLine.size());
+        iMapUnitsPerMeter = iDistanceBefore[n] > 0 ? total_length / iDistanceBefore[n] : 1;
+
+        // Build the box hierarchy bottom-up: level 0 has a box for each group of KLeafSize lines, and each higher level a box for each pair of boxes.
+        std::vector<TBox> level;
+        for (size_t i = 0; i < iLine.size(); i += KLeafSize)
+            {
+            TBox box;
+            for (size_t j = i; j < std::min(iLine.size(),i + KLeafSize); j++)
+                {
+                box.Add(iLine[j].iStart);
+                box.Add(iLine[j].iEnd);
+                }
+            box.iEndDistance = LineEndDistance(std::min(iLine.size(),i + KLeafSize) - 1);
+            level.push_back(box);
+            }
+        while (!level.empty())
+            {
+            iLevel.push_back(level);
+            if (level.size() == 1)
+                break;
+            std::vector<TBox> parent((level.size() + 1) / 2);
+            for (size_t i = 0; i < level.size(); i++)
+                parent[i / 2].Add(level[i]);
+            level.swap(parent);
+            }
+        }
+
+    /** Returns the number of segments. */
+    size_t SegmentCount() const { return iTurnTime.size(); }
+    /** Returns the number of lines. */
+    size_t LineCount() const { return iLine.size(); }
+    /** Returns the distance of the route in metres. */
+    double Distance() const { return iDistanceBefore.back(); }
+    /** Returns the estimated time of the route in seconds. */
+    double Time() const { return iTimeBefore.back(); }
+
+    /**
+    Finds the nearest point on the route to aPoint, in map coordinates, and returns false if the route has no lines.
+
+    If aSection is zero or greater, only lines in that section or later sections are considered.
+    If aPreviousDistanceAlongRoute is greater than zero, points before that distance along the route are penalized by the distance they are behind it,
+    so that positions further along the route are preferred where the route doubles back on itself.
+    */
+    bool FindNearest(const TPointFP& aPoint,int32_t aSection,double aPreviousDistanceAlongRoute,TRouteIndexPoint& aResult) const
+        {
+        aResult = TRouteIndexPoint();
+        if (iLine.empty())
+            return false;
+        size_t first_line = 0;
+        if (aSection >= 0)
+            {
+            size_t first_segment = std::lower_bound(iSection.begin(),iSection.end(),aSection) - iSection.begin();
+            first_line = iFirstLine[first_segment];
+            if (first_line == iLine.size())
+                return false;
+            }
+
+        // Search the hierarchy depth first, visiting nearer boxes first and skipping boxes that cannot contain a better line.
+        double best_cost = std::numeric_limits<double>::infinity();
+        size_t best_line = 0;
+        double best_t = 0;
+        double best_distance = 0;
+        struct TStackItem { size_t iLevel; size_t iIndex; double iCost; };
+        TStackItem stack[2 * 64];
+        size_t depth = 0;
+        stack[depth++] = { iLevel.size() - 1,0,0 };
+        while (depth)
+            {
+            TStackItem item = stack[--depth];
+            if (item.iCost >= best_cost)
+                continue;
+            if (item.iLevel == 0)
+                {
+                size_t end = std::min(iLine.size(),(item.iIndex + 1) * KLeafSize);
+                for (size_t i = std::max(first_line,item.iIndex * KLeafSize); i < end; i++)
+                    {
+                    const TLine& line = iLine[i];
+                    double dx = double(line.iEnd.iX) - line.iStart.iX;
+                    double dy = double(line.iEnd.iY) - line.iStart.iY;
+                    double length_squared = dx * dx + dy * dy;
+                    double t = length_squared > 0 ? ((aPoint.iX - line.iStart.iX) * dx + (aPoint.iY - line.iStart.iY) * dy) / length_squared : 0;
+                    t = std::max(0.0,std::min(1.0,t));
+                    double distance = std::hypot(line.iStart.iX + t * dx - aPoint.iX,line.iStart.iY + t * dy - aPoint.iY);
+                    double cost = distance + BehindPenalty(DistanceAlongRoute(i,t),aPreviousDistanceAlongRoute);
+                    if (cost < best_cost)
+                        {
+                        best_cost = cost;
+                        best_line = i;
+                        best_t = t;
+                        best_distance = distance;
+                        }
+                    }
+                continue;
+                }
+
+            // Push the children, the nearer one last so that it is visited first.
+            size_t child_level = item.iLevel - 1;
+            size_t child_leaf_lines = KLeafSize << child_level;
+            TStackItem child[2];
+            size_t child_count = 0;
+            for (size_t c = item.iIndex * 2; c < std::min(iLevel[child_level].size(),item.iIndex * 2 + 2); c++)
+                {
+                if ((c + 1) * child_leaf_lines <= first_line)
+                    continue;
+                const TBox& box = iLevel[child_level][c];
+                child[child_count++] = { child_level,c,box.Distance(aPoint) + BehindPenalty(box.iEndDistance,aPreviousDistanceAlongRoute) };
+                }
+            if (child_count == 2 && child[0].iCost < child[1].iCost)
+                std::swap(child[0],child[1]);
+            for (size_t c = 0; c < child_count; c++)
+                if (child[c].iCost < best_cost)
+                    stack[depth++] = child[c];
+            }
+
+        SetResult(best_line,best_t,aResult);
+        aResult.iDistanceToRoute = best_distance;
+        return true;
+        }
+
+    /** Finds the point aDistance metres along the route, which is clamped to the length of the route. Returns false if the route has no lines. */
+    bool PointAtDistance(double aDistance,TRouteIndexPoint& aResult) const
+        {
+        aResult = TRouteIndexPoint();
+        if (iLine.empty())
+            return false;
+        aDistance = std::max(0.0,std::min(Distance(),aDistance));
+        size_t s = SegmentAt(iDistanceBefore,aDistance);
+        double segment_distance = iDistanceBefore[s + 1] - iDistanceBefore[s];
+        double fraction = segment_distance > 0 ? (aDistance - iDistanceBefore[s]) / segment_distance : 0;
+        SetResultInSegment(s,fraction,aResult);
+        return true;
+        }
+
+    /**
+    Finds the point reached aTime seconds along the route, which is clamped to the time of the route. Returns false if the route has no lines.
+    The time of each segment is assumed to consist of the time to navigate the junction at its start, followed by travel at a constant speed.
+    */
+    bool PointAtTime(double aTime,TRouteIndexPoint& aResult) const
+        {
+        aResult = TRouteIndexPoint();
+        if (iLine.empty())
+            return false;
+        aTime = std::max(0.0,std::min(Time(),aTime));
+        size_t s = SegmentAt(iTimeBefore,aTime);
+        double travel_time = iTimeBefore[s + 1] - iTimeBefore[s] - iTurnTime[s];
+        double fraction = travel_time > 0 ? std::max(0.0,aTime - iTimeBefore[s] - iTurnTime[s]) / travel_time : 0;
+        SetResultInSegment(s,std::min(1.0,fraction),aResult);
+        return true;
+        }
+
+    private:
+    static constexpr size_t KLeafSize = 16;
+
+    class TLine
+        {
+        public:
+        TPoint iStart;
+        TPoint iEnd;
+        uint32_t iSegment = 0;
+        uint32_t iLineIndex = 0;
+        double iLengthBefore = 0;   // the length of the segment's path before this line, in map units
+        };
+
+    class TBox
+        {
+        public:
+        void Add(const TPoint& aPoint)
+            {
+            iMinX = std::min(iMinX,double(aPoint.iX)); iMinY = std::min(iMinY,double(aPoint.iY));
+            iMaxX = std::max(iMaxX,double(aPoint.iX)); iMaxY = std::max(iMaxY,double(aPoint.iY));
+            }
+        void Add(const TBox& aBox)
+            {
+            iMinX = std::min(iMinX,aBox.iMinX); iMinY = std::min(iMinY,aBox.iMinY);
+            iMaxX = std::max(iMaxX,aBox.iMaxX); iMaxY = std::max(iMaxY,aBox.iMaxY);
+            iEndDistance = std::max(iEndDistance,aBox.iEndDistance);
+            }
+        double Distance(const TPointFP& aPoint) const
+            {
+            double dx = std::max({ 0.0,iMinX - aPoint.iX,aPoint.iX - iMaxX });
+            double dy = std::max({ 0.0,iMinY - aPoint.iY,aPoint.iY - iMaxY });
+            return std::sqrt(dx * dx + dy * dy);
+            }
+
+        double iMinX = std::numeric_limits<double>::infinity();
+        double iMinY = std::numeric_limits<double>::infinity();
+        double iMaxX = -std::numeric_limits<double>::infinity();
+        double iMaxY = -std::numeric_limits<double>::infinity();
+        double iEndDistance = 0;    // the distance along the route, in metres, of the end of the last line in the box
+        };
+
+    /** Returns the index of the segment containing aValue, given cumulative values for each segment. */
+    static size_t SegmentAt(const std::vector<double>& aBefore,double aValue)
+        {
+        size_t s = std::upper_bound(aBefore.begin(),aBefore.end(),aValue) - aBefore.begin();
+        return std::min(s ? s - 1 : 0,aBefore.size() - 2);
+        }
+    /** Returns the penalty, in map units, for a point aDistance metres along the route if the previous position was aPrevious metres along the route. */
+    double BehindPenalty(double aDistance,double aPrevious) const
+        {
+        return aPrevious > 0 && aDistance < aPrevious ? (aPrevious - aDistance) * iMapUnitsPerMeter : 0;
+        }
+    /** Returns the fraction of the segment's path before a point a fraction aT along a line. */
+    double SegmentFraction(size_t aLine,double aT) const
+        {
+        const TLine& line = iLine[aLine];
+        double length = iPathLength[line.iSegment];
+        if (length <= 0)
+            return 0;
+        double line_length = std::hypot(double(line.iEnd.iX) - line.iStart.iX,double(line.iEnd.iY) - line.iStart.iY);
+        return std::min(1.0,(line.iLengthBefore + aT * line_length) / length);
+        }
+    double DistanceAlongRoute(size_t aLine,double aT) const
+        {
+        size_t s = iLine[aLine].iSegment;
+        return iDistanceBefore[s] + SegmentFraction(aLine,aT) * (iDistanceBefore[s + 1] - iDistanceBefore[s]);
+        }
+    double LineEndDistance(size_t aLine) const { return DistanceAlongRoute(aLine,1); }
+
+    void SetResult(size_t aLine,double aT,TRouteIndexPoint& aResult) const
+        {
+        const TLine& line = iLine[aLine];
+        size_t s = line.iSegment;
+        double fraction = SegmentFraction(aLine,aT);
+        aResult.iSegmentIndex = int32_t(s);
+        aResult.iLineIndex = int32_t(line.iLineIndex);
+        aResult.iPoint = TPointFP(line.iStart.iX + aT * (double(line.iEnd.iX) - line.iStart.iX),line.iStart.iY + aT * (double(line.iEnd.iY) - line.iStart.iY));
+        aResult.iDistanceAlongSegment = fraction * (iDistanceBefore[s + 1] - iDistanceBefore[s]);
+        aResult.iDistanceAlongRoute = iDistanceBefore[s] + aResult.iDistanceAlongSegment;
+        aResult.iTimeAlongSegment = iTurnTime[s] + fraction * (iTimeBefore[s + 1] - iTimeBefore[s] - iTurnTime[s]);
+        aResult.iTimeAlongRoute = iTimeBefore[s] + aResult.iTimeAlongSegment;
+        }
+
+    /** Sets the result to the point a fraction aFraction along the path of segment aSegment, or its first point if it has no lines. */
+    void SetResultInSegment(size_t aSegment,double aFraction,TRouteIndexPoint& aResult) const
+        {
+        // Segments with no lines are represented by the start of the next line, or the end of the previous one.
+        size_t first = iFirstLine[aSegment], end = iFirstLine[aSegment + 1];
+        if (first == end)
+            {
+            if (first < iLine.size())
+                SetResult(first,0,aResult);
+            else
+                SetResult(first - 1,1,aResult);
+            return;
+            }
+        double target = aFraction * iPathLength[aSegment];
+        auto p = std::upper_bound(iLine.begin() + first,iLine.begin() + end,target,[](double aValue,const TLine& aLine) { return aValue < aLine.iLengthBefore; });
+        size_t i = size_t(p - iLine.begin()) - 1;
+        const TLine& line = iLine[i];
+        double line_length = std::hypot(double(line.iEnd.iX) - line.iStart.iX,double(line.iEnd.iY) - line.iStart.iY);
+        double t = line_length > 0 ? std::min(1.0,(target - line.iLengthBefore) / line_length) : 0;
+        SetResult(i,t,aResult);
+        }
+
+    std::vector<double> iDistanceBefore;
+    std::vector<double> iTimeBefore;
+    std::vector<double> iTurnTime;
+    std::vector<int32_t> iSection;
+    std::vector<uint32_t> iFirstLine;
+    std::vector<double> iPathLength;
+    std::vector<TLine> iLine;
+    std::vector<std::vector<TBox>> iLevel;
+    double iMapUnitsPerMeter = 1;
+    };
+
+/**
+A thread-safe table of route indexes, so that an index is created only once however many times a route is searched.
+
+Routes are identified by their shared pointers, not their addresses. An entry holds a weak pointer to its route,
+so a route created at the address of a deleted route is never given the deleted route's index, and the
+entries of deleted routes are removed when new indexes are added. An index is not updated if its route is changed:
+call Discard after changing the segments of a route that is still in use.
+*/
+class CRouteIndexCache
+    {
+    public:
+    /**
+    Returns the index for aRoute, creating it if necessary. The route is a CRoute, or any other object
+    with a member iRouteSegment that can be used to create a CRouteIndex.
+    */
+    template<class route_t> std::shared_ptr<const CRouteIndex> Index(const std::shared_ptr<const route_t>& aRoute)
+        {
+        std::weak_ptr<const void> key(aRoute);
+            {
+            std::shared_lock<std::shared_mutex> lock(iMutex);
+            auto p = iIndex.find(key);
+            if (p != iIndex.end())
+                return p->second;
+            }
+
+        // Create the index without holding the lock.
+        auto index = std::make_shared<const CRouteIndex>(aRoute->iRouteSegment);
+        std::unique_lock<std::shared_mutex> lock(iMutex);
+        for (auto p = iIndex.begin(); p != iIndex.end(); )
+            {
+            if (p->first.expired())
+                p = iIndex.erase(p);
+            else
+                ++p;
+            }
+        auto p = iIndex.emplace(key,index).first;
+        return p->second;
+        }
+
+    /** Discards the index for aRoute, if any. This must be done if the segments of the route are changed. */
+    template<class route_t> void Discard(const std::shared_ptr<const route_t>& aRoute)
+        {
+        std::unique_lock<std::shared_mutex> lock(iMutex);
+        iIndex.erase(std::weak_ptr<const void>(aRoute));
+        }
+
+    /** Discards all the indexes. */
+    void Clear()
+        {
+        std::unique_lock<std::shared_mutex> lock(iMutex);
+        iIndex.clear();
+        }
+
+    private:
+    std::shared_mutex iMutex;
+    std::map<std::weak_ptr<const void>,std::shared_ptr<const CRouteIndex>,std::owner_less<std::weak_ptr<const void>>> iIndex;
+    };
+
+}
+
+#endif
@@ -0,0 +1,144 @@
+/*
+cartotype_route_matrix.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_ROUTE_MATRIX_H__
+#define CARTOTYPE_ROUTE_MATRIX_H__
+
+#include <cartotype_base.h>
+
+#include <limits>
+#include <queue>
+#include <vector>
+
+namespace CartoType
+{
+
+/**
+A matrix of travel times and distances from a set of origins to a set of destinations,
+as created by CFramework::CreateRouteMatrix.
+*/
+class CRouteMatrix
+    {
+    public:
+    /** The time and distance stored for a destination that cannot be reached from an origin. */
+    static constexpr double KUnreachable = std::numeric_limits<double>::infinity();
+
+    /** Creates an empty matrix. */
+    CRouteMatrix() = default;
+    /** Creates a matrix with a given number of origins and destinations, with all destinations unreachable. */
+    CRouteMatrix(size_t aOriginCount,size_t aDestinationCount):
+        iOriginCount(aOriginCount),
+        iDestinationCount(aDestinationCount),
+        iTime(aOriginCount * aDestinationCount,KUnreachable),
+        iDistance(aOriginCount * aDestinationCount,KUnreachable)
+        {
+        }
+
+    /** Returns the number of origins. */
+    size_t OriginCount() const { return iOriginCount; }
+    /** Returns the number of destinations. */
+    size_t DestinationCount() const { return iDestinationCount; }
+    /** Returns the estimated travel time in seconds from an origin to a destination, or KUnreachable. */
+    double Time(size_t aOrigin,size_t aDestination) const { return iTime[aOrigin * iDestinationCount + aDestination]; }
+    /** Returns the distance in metres from an origin to a destination along the fastest route, or KUnreachable. */
+    double Distance(size_t aOrigin,size_t aDestination) const { return iDistance[aOrigin * iDestinationCount + aDestination]; }
+    /** Returns true if a destination can be reached from an origin. */
+    bool Reachable(size_t aOrigin,size_t aDestination) const { return Time(aOrigin,aDestination) != KUnreachable; }
+    /** Sets the time and distance from an origin to a destination. */
+    void Set(size_t aOrigin,size_t aDestination,double aTime,double aDistance)
+        {
+        size_t i = aOrigin * iDestinationCount + aDestination;
+        iTime[i] = aTime;
+        iDistance[i] = aDistance;
+        }
+
+    private:
+    size_t iOriginCount = 0;
+    size_t iDestinationCount = 0;
+    std::vector<double> iTime;
+    std::vector<double> iDistance;
+    };
+
+namespace Router
+    {
+    /**
+    A place where a search starts or ends: a node in the routing graph, with the time and distance
+    needed to get between it and the point the user supplied. A point snapped to the middle of an arc is normally
+    represented by two endpoints, one for each end of the arc.
+    */
+    class TMatrixEndpoint
+        {
+        public:
+        /** The node. */
+        uint32_t iNode = 0;
+        /** The time in seconds between the user's point and the node. */
+        double iTime = 0;
+        /** The distance in metres between the user's point and the node. */
+        double iDistance = 0;
+        };
+
+    /** The state of a single-source search, which can be reused for further searches on the same graph without allocating memory again. */
+    class CMatrixSearchState
+        {
+        public:
+        /** Prepares the state for a new search on a graph with aNodeCount nodes. */
+        void Reset(size_t aNodeCount)
+            {
+            if (iTime.size() != aNodeCount)
+                {
+                iTime.assign(aNodeCount,CRouteMatrix::KUnreachable);
+                iDistance.assign(aNodeCount,0);
+                iTouched.clear();
+                }
+            for (auto n : iTouched)
+                iTime[n] = CRouteMatrix::KUnreachable;
+            iTouched.clear();
+            iQueue = TQueue();
+            }
+        /** Adds a node to the queue if aTime is better than its current time, returning true if the node was added. */
+        bool Relax(uint32_t aNode,double aTime,double aDistance)
+            {
+            if (aTime >= iTime[aNode])
+                return false;
+            if (iTime[aNode] == CRouteMatrix::KUnreachable)
+                iTouched.push_back(aNode);
+            iTime[aNode] = aTime;
+            iDistance[aNode] = aDistance;
+            iQueue.push(TQueueItem(aTime,aNode));
+            return true;
+            }
+        /** Removes the nearest unsettled node from the queue, returning false if the queue is empty. */
+        bool Pop(uint32_t& aNode)
+            {
+            while (!iQueue.empty())
+                {
+                TQueueItem item = iQueue.top();
+                iQueue.pop();
+                if (item.first == iTime[item.second])
+                    {
+                    aNode = item.second;
+                    return true;
+                    }
+                }
+            return false;
+            }
+
+        /** The best known time to each node. */
+        std::vector<double> iTime;
+        /** The distance along the best known route to each node. */
+        std::vector<double> iDistance;
+
+        private:
+        using TQueueItem = std::pair<double,uint32_t>;
+        using TQueue = std::priority_queue<TQueueItem,std::vector<TQueueItem>,std::greater<TQueueItem>>;
+        std::vector<uint32_t> iTouched;
+        TQueue iQueue;
+        };
+    }
+
+}
+
+#endif
@@ -0,0 +1,272 @@
+/*
+cartotype_spatial_index.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_SPATIAL_INDEX_H__
+#define CARTOTYPE_SPATIAL_INDEX_H__
+
+#include <cartotype_base.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace CartoType
+{
+
+/**
+A static spatial index over a set of axis-aligned rectangles, used to find
+the rectangles intersecting a given rectangle or point.
+
+The index is a packed R-tree created using sort-tile-recursive loading, so it cannot be changed
+after it has been created, but it is compact and fast to search. Rectangles are treated as closed, so that
+rectangles which just touch intersect, and degenerate rectangles representing single points can be indexed.
+The index is immutable once created and may be searched by more than one thread at once.
+*/
+class CSpatialIndex
+    {
+    public:
+    /** Creates an empty index. */
+    CSpatialIndex() = default;
+    /**
+    Creates an index for the rectangles in aBox, which are identified by their positions in the vector.
+    aNodeSize is the number of children of each node, and is clamped to the range 2...32.
+    */
+    explicit CSpatialIndex(const std::vector<TRectFP>& aBox,size_t aNodeSize = 16):
+        iNodeSize(std::max(size_t(2),std::min(size_t(32),aNodeSize)))
+        {
+        size_t n = aBox.size();
+        if (!n)
+            return;
+
+        // Sort the rectangles into vertical slices by x, then by y within each slice.
+        iIndex.resize(n);
+        for (size_t i = 0; i < n; i++)
+            iIndex[i] = uint32_t(i);
+        auto center_x = [&aBox](uint32_t aI) { return aBox[aI].iTopLeft.iX + aBox[aI].iBottomRight.iX; };
+        auto center_y = [&aBox](uint32_t aI) { return aBox[aI].iTopLeft.iY + aBox[aI].iBottomRight.iY; };
+        std::sort(iIndex.begin(),iIndex.end(),[&](uint32_t aP,uint32_t aQ) { return center_x(aP) < center_x(aQ); });
+        size_t leaf_count = (n + iNodeSize - 1) / iNodeSize;
+        size_t slice_size = iNodeSize * size_t(std::ceil(std::sqrt(double(leaf_count))));
+        for (size_t i = 0; i < n; i += slice_size)
+            std::sort(iIndex.begin() + i,iIndex.begin() + std::min(n,i + slice_size),[&](uint32_t aP,uint32_t aQ) { return center_y(aP) < center_y(aQ); });
+
+        // Store the rectangles, then create each level of nodes from the one below.
+        iBox.reserve(n + n / (iNodeSize - 1) + 1);
+        for (auto i : iIndex)
+            iBox.push_back(aBox[i]);
+        iLevelStart.push_back(0);
+        size_t level_start = 0;
+        size_t level_size = n;
+        while (level_size > 1)
+            {
+            size_t new_level_start = iBox.size();
+            for (size_t i = 0; i < level_size; i += iNodeSize)
+                {
+                TRectFP box = iBox[level_start + i];
+                for (size_t j = i + 1; j < std::min(level_size,i + iNodeSize); j++)
+                    {
+                    const TRectFP& b = iBox[level_start + j];
+                    box.iTopLeft.iX = std::min(box.iTopLeft.iX,b.iTopLeft.iX);
+                    box.iTopLeft.iY = std::min(box.iTopLeft.iY,b.iTopLeft.iY);
+                    box.iBottomRight.iX = std::max(box.iBottomRight.iX,b.iBottomRight.iX);
+                    box.iBottomRight.iY = std::max(box.iBottomRight.iY,b.iBottomRight.iY);
+                    }
+                iBox.push_back(box);
+                }
+            iLevelStart.push_back(new_level_start);
+            level_start = new_level_start;
+            level_size = iBox.size() - new_level_start;
+            }
+        iLevelStart.push_back(iBox.size());
+        }
+
+    /** Returns the number of rectangles in the index. */
+    size_t Count() const { return iIndex.size(); }
+    /** Returns the bounds of all the rectangles in the index. Returns an empty rectangle if the index is empty. */
+    TRectFP Bounds() const { return iBox.empty() ? TRectFP() : iBox.back(); }
+
+    /**
+    Calls aFunction(aIndex) for each rectangle intersecting aRect, where aIndex is the position of the rectangle
+    in the vector passed to the constructor. If aFunction returns false the search stops.
+    Returns false if the search was stopped, true otherwise.
+    */
+    template<class F> bool Search(const TRectFP& aRect,F aFunction) const
+        {
+        if (iBox.empty())
+            return true;
+        size_t stack[256][2]; // enough for 2^32 rectangles using the largest node size
+        size_t depth = 0;
+        stack[depth][0] = iLevelStart.size() - 2;
+        stack[depth++][1] = 0;
+        while (depth)
+            {
+            depth--;
+            size_t level = stack[depth][0];
+            size_t node = stack[depth][1];
+            const TRectFP& box = iBox[iLevelStart[level] + node];
+            if (box.iTopLeft.iX > aRect.iBottomRight.iX || box.iBottomRight.iX < aRect.iTopLeft.iX ||
+                box.iTopLeft.iY > aRect.iBottomRight.iY || box.iBottomRight.iY < aRect.iTopLeft.iY)
+                continue;
+            if (level == 0)
+                {
+                if (!aFunction(size_t(iIndex[node])))
+                    return false;
+                continue;
+                }
+            size_t first = node * iNodeSize;
+            size_t last = std::min(first + iNodeSize,iLevelStart[level] - iLevelStart[level - 1]);
+            for (size_t child = last; child > first; child--)
+                {
+                stack[depth][0] = level - 1;
+                stack[depth++][1] = child - 1;
+                }
+            }
+        return true;
+        }
+
+    /** Calls aFunction(aIndex) for each rectangle containing aPoint; see Search(const TRectFP&,F). */
+    template<class F> bool Search(const TPointFP& aPoint,F aFunction) const
+        {
+        return Search(TRectFP(aPoint.iX,aPoint.iY,aPoint.iX,aPoint.iY),aFunction);
+        }
+
+    /** Returns the indexes of all the rectangles intersecting aRect, in index order. */
+    std::vector<size_t> Find(const TRectFP& aRect) const
+        {
+        std::vector<size_t> result;
+        Search(aRect,[&result](size_t aIndex) { result.push_back(aIndex); return true; });
+        std::sort(result.begin(),result.end());
+        return result;
+        }
+
+    private:
+    size_t iNodeSize = 16;
+    std::vector<TRectFP> iBox;          // the rectangles in sorted order, then each level of nodes, ending with the root
+    std::vector<uint32_t> iIndex;       // the original index of each rectangle in sorted order
+    std::vector<size_t> iLevelStart;    // the start of each level in iBox, followed by the size of iBox
+    };
+
+/**
+An index of the extents of a set of maps, in the order they were loaded. It finds the maps intersecting an area of interest,
+so that code drawing or searching several maps need consider only those, and the earlier and later maps overlapping a given map,
+which are the only ones affected when that map is loaded or unloaded.
+
+The spatial index is rebuilt when a map is added or removed. That is cheap for the numbers of maps normally loaded,
+and allows the index to be searched by more than one thread at once between changes.
+*/
+class CMapExtentIndex
+    {
+    public:
+    /** Adds a map, which is placed after all the maps already added. If a map with the same handle exists it is replaced. */
+    void Add(uint32_t aHandle,const TRectFP& aExtent)
+        {
+        RemoveEntry(aHandle);
+        iEntry.push_back(TEntry { aHandle,aExtent });
+        Rebuild();
+        }
+    /** Removes a map. Returns false if there was no map with that handle. */
+    bool Remove(uint32_t aHandle)
+        {
+        if (!RemoveEntry(aHandle))
+            return false;
+        Rebuild();
+        return true;
+        }
+    /** Removes all maps. */
+    void Clear()
+        {
+        iEntry.clear();
+        iIndex = CSpatialIndex();
+        }
+
+    /** Returns the number of maps. */
+    size_t Count() const { return iEntry.size(); }
+    /** Returns the bounds of all the maps. Returns an empty rectangle if there are no maps. */
+    TRectFP Bounds() const { return iIndex.Bounds(); }
+    /** Gets the extent of a map. Returns false if there is no map with that handle. */
+    bool Extent(uint32_t aHandle,TRectFP& aExtent) const
+        {
+        for (const auto& e : iEntry)
+            if (e.iHandle == aHandle)
+                {
+                aExtent = e.iExtent;
+                return true;
+                }
+        return false;
+        }
+
+    /** Gets the handles of the maps whose extents intersect aRect, in the order in which they were added. */
+    void Find(std::vector<uint32_t>& aHandles,const TRectFP& aRect) const
+        {
+        aHandles.clear();
+        for (auto i : iIndex.Find(aRect))
+            aHandles.push_back(iEntry[i].iHandle);
+        }
+
+    /**
+    Gets the handles of the maps added before aHandle whose extents intersect its extent, in the order in which they were added.
+    These are the maps which may be partly covered by aHandle, and whose overlap paths change when it is added or removed.
+    Call this before removing a map.
+    */
+    void FindCoveredMaps(std::vector<uint32_t>& aHandles,uint32_t aHandle) const
+        {
+        FindOverlaps(aHandles,aHandle,true);
+        }
+
+    /**
+    Gets the handles of the maps added after aHandle whose extents intersect its extent, in the order in which they were added.
+    These are the maps which may partly cover aHandle, and which determine its overlap path.
+    */
+    void FindCoveringMaps(std::vector<uint32_t>& aHandles,uint32_t aHandle) const
+        {
+        FindOverlaps(aHandles,aHandle,false);
+        }
+
+    private:
+    class TEntry
+        {
+        public:
+        uint32_t iHandle;
+        TRectFP iExtent;
+        };
+
+    bool RemoveEntry(uint32_t aHandle)
+        {
+        auto p = std::find_if(iEntry.begin(),iEntry.end(),[aHandle](const TEntry& aEntry) { return aEntry.iHandle == aHandle; });
+        if (p == iEntry.end())
+            return false;
+        iEntry.erase(p);
+        return true;
+        }
+
+    void Rebuild()
+        {
+        std::vector<TRectFP> extent;
+        extent.reserve(iEntry.size());
+        for (const auto& e : iEntry)
+            extent.push_back(e.iExtent);
+        iIndex = CSpatialIndex(extent,8);
+        }
+
+    void FindOverlaps(std::vector<uint32_t>& aHandles,uint32_t aHandle,bool aBefore) const
+        {
+        aHandles.clear();
+        size_t position = 0;
+        while (position < iEntry.size() && iEntry[position].iHandle != aHandle)
+            position++;
+        if (position == iEntry.size())
+            return;
+        for (auto i : iIndex.Find(iEntry[position].iExtent))
+            if (aBefore ? i < position : i > position)
+                aHandles.push_back(iEntry[i].iHandle);
+        }
+
+    std::vector<TEntry> iEntry;     // in the order the maps were added
+    CSpatialIndex iIndex;           // the extents, identified by their positions in iEntry
+    };
+
+}
+
+#endif
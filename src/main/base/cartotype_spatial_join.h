@@ -0,0 +1,102 @@
+/*
+cartotype_spatial_join.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_SPATIAL_JOIN_H__
+#define CARTOTYPE_SPATIAL_JOIN_H__
+
+#include <cartotype_spatial_index.h>
+#include <cartotype_parallel.h>
+#include <vector>
+
+namespace CartoType
+{
+
+/** An array of arrays of indexes, returned by spatial joins: element N gives the indexes of the objects matching item N. */
+using CJoinIndexArray = std::vector<std::vector<uint32_t>>;
+
+/**
+Finds the polygons containing each of a set of points, or the points contained by each of a set of polygons.
+This is the core of CFramework::FindPolygonsContainingPoints and CFramework::FindPointsInPolygons,
+and can be used directly on points and polygons which have already been loaded.
+
+aPolygonBounds gives the bounds of each polygon, and aContains(aPolygonIndex,aPoint) must return true if polygon
+number aPolygonIndex contains aPoint. It is called from more than one thread at once, and should normally
+use a containment index, for example by calling CPolygonContainmentIndexArray::Contains.
+
+A temporary spatial index is created for whichever of the points and polygons are fewer in number, and the other set
+is tested against it in parallel, using up to aThreadCount threads, or DefaultThreadCount() if aThreadCount is zero.
+
+If aByPoint is true, returns an array giving the indexes of the polygons containing each point,
+otherwise an array giving the indexes of the points contained in each polygon. Indexes are in ascending order.
+*/
+template<class F> CJoinIndexArray JoinPointsAndPolygons(const std::vector<TPointFP>& aPoint,const std::vector<TRectFP>& aPolygonBounds,F aContains,bool aByPoint,size_t aThreadCount = 0)
+    {
+    size_t point_count = aPoint.size();
+    size_t polygon_count = aPolygonBounds.size();
+    CJoinIndexArray result(aByPoint ? point_count : polygon_count);
+    if (!point_count || !polygon_count)
+        return result;
+
+    // Test the larger set against an index of the smaller set, giving the matches for each member of the larger set.
+    bool index_points = point_count < polygon_count;
+    CJoinIndexArray match(index_points ? polygon_count : point_count);
+    if (index_points)
+        {
+        std::vector<TRectFP> box(point_count);
+        for (size_t i = 0; i < point_count; i++)
+            box[i] = TRectFP(aPoint[i].iX,aPoint[i].iY,aPoint[i].iX,aPoint[i].iY);
+        CSpatialIndex index(box);
+        ParallelFor(polygon_count,[&](size_t aBegin,size_t aEnd)
+            {
+            for (size_t i = aBegin; i < aEnd; i++)
+                {
+                index.Search(aPolygonBounds[i],[&](size_t aPointIndex)
+                    {
+                    if (aContains(i,aPoint[aPointIndex]))
+                        match[i].push_back(uint32_t(aPointIndex));
+                    return true;
+                    });
+                std::sort(match[i].begin(),match[i].end());
+                }
+            },aThreadCount);
+        }
+    else
+        {
+        CSpatialIndex index(aPolygonBounds);
+        ParallelFor(point_count,[&](size_t aBegin,size_t aEnd)
+            {
+            for (size_t i = aBegin; i < aEnd; i++)
+                {
+                index.Search(aPoint[i],[&](size_t aPolygonIndex)
+                    {
+                    if (aContains(aPolygonIndex,aPoint[i]))
+                        match[i].push_back(uint32_t(aPolygonIndex));
+                    return true;
+                    });
+                std::sort(match[i].begin(),match[i].end());
+                }
+            },aThreadCount);
+        }
+
+    if (index_points != aByPoint)
+        return match;
+
+    // Transpose the matches; iterating in order keeps the indexes sorted.
+    std::vector<uint32_t> count(result.size());
+    for (const auto& m : match)
+        for (auto j : m)
+            count[j]++;
+    for (size_t i = 0; i < result.size(); i++)
+        result[i].reserve(count[i]);
+    for (size_t i = 0; i < match.size(); i++)
+        for (auto j : match[i])
+            result[j].push_back(uint32_t(i));
+    return result;
+    }
+
+}
+
+#endif
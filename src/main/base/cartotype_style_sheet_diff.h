@@ -0,0 +1,432 @@
+/*
+cartotype_style_sheet_diff.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_STYLE_SHEET_DIFF_H__
+#define CARTOTYPE_STYLE_SHEET_DIFF_H__
+
+#include <cartotype_style_sheet_data.h>
+#include <cartotype_xml_import.h>
+
+#include <algorithm>
+#include <ctype.h>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace CartoType
+{
+
+/** The differences between two versions of a style sheet, used to decide how much of the compiled style needs to be rebuilt. */
+class CStyleSheetChange
+    {
+    public:
+    /** Returns true if nothing has changed. */
+    bool Empty() const { return !iFullReload && !iLayerOrderChanged && iChangedLayers.empty() && iChangedDefs.empty(); }
+
+    /**
+    True if something affecting the whole style sheet has changed, such as the attributes of the root element,
+    a definition without an identifier, or the number of style sheets; everything must be recompiled and all caches cleared.
+    */
+    bool iFullReload = false;
+    /** True if the order of the layers, or the elements enclosing them, has changed, so that the drawing order must be rebuilt. */
+    bool iLayerOrderChanged = false;
+    /** The names of layers whose rules must be recompiled, including layers which were added or deleted, and layers using changed definitions. */
+    std::set<std::string> iChangedLayers;
+    /** The identifiers of changed, added or deleted definitions, such as macros and icons; cached icons with these identifiers are no longer valid. */
+    std::set<std::string> iChangedDefs;
+    };
+
+/**
+A summary of a style sheet, or a stack of style sheets, recording a hash of the rules of each layer and each definition,
+and what each one depends on. Comparing the summaries of two versions of a style sheet gives the layers that must be
+recompiled, so that a small edit to a large style sheet does not require everything to be recompiled and all caches cleared.
+
+A layer depends on a definition if an attribute value in the layer, or in the elements enclosing it, is the identifier
+of the definition, or if an attribute value or text refers to it in the form '#id', 'url(#id)' or 'ref=id'.
+A layer depends on a variable if the name of the variable is used in an expression in the layer or the elements enclosing it.
+These rules may find dependencies that do not exist, for example when a color such as '#FFFFFF' has the same name as
+a definition, which causes only unnecessary recompilation. They do not find references made in any other way, such as identifiers
+built by expressions; a style sheet using those should be reloaded completely after any change.
+*/
+class CStyleSheetSummary
+    {
+    public:
+    /** Creates a summary of a stack of style sheets. */
+    static std::unique_ptr<CStyleSheetSummary> New(TResult& aError,const CStyleSheetDataArray& aStyleSheetDataArray)
+        {
+        std::unique_ptr<CStyleSheetSummary> s(new CStyleSheetSummary);
+        aError = KErrorNone;
+        for (size_t i = 0; !aError && i < aStyleSheetDataArray.size(); i++)
+            {
+            TMemoryInputStream input = aStyleSheetDataArray[i].Stream();
+            aError = s->Add(input);
+            }
+        if (aError)
+            s.reset();
+        return s;
+        }
+
+    CStyleSheetSummary() = default;
+
+    /** Adds a style sheet to the summary. Style sheets must be added in the order in which they are stacked. */
+    TResult Add(MInputStream& aInput)
+        {
+        iStyleSheetCount++;
+        THandler handler(*this);
+        CXmlStreamParser parser(handler);
+        return parser.Parse(aInput);
+        }
+
+    /** Returns the changes needed to go from this style sheet to aNew. */
+    CStyleSheetChange Compare(const CStyleSheetSummary& aNew) const
+        {
+        CStyleSheetChange change;
+        change.iFullReload = iStyleSheetCount != aNew.iStyleSheetCount || iGlobalHash != aNew.iGlobalHash;
+        change.iLayerOrderChanged = iOrder != aNew.iOrder;
+        ChangedItems(iDef,aNew.iDef,change.iChangedDefs);
+
+        // Definitions using changed definitions, such as macros using other macros, have also changed.
+        for (bool more = true; more; )
+            {
+            more = false;
+            for (const auto* d : { &iDef,&aNew.iDef })
+                for (const auto& p : *d)
+                    if (!change.iChangedDefs.count(p.first) && Uses(p.second,change.iChangedDefs))
+                        {
+                        change.iChangedDefs.insert(p.first);
+                        more = true;
+                        }
+            }
+
+        ChangedItems(iLayer,aNew.iLayer,change.iChangedLayers);
+        for (const auto* l : { &iLayer,&aNew.iLayer })
+            for (const auto& p : *l)
+                if (Uses(p.second,change.iChangedDefs))
+                    change.iChangedLayers.insert(p.first);
+        return change;
+        }
+
+    /** Returns the names of the layers that may depend on a style sheet variable, and must be recompiled if it changes. */
+    std::set<std::string> LayersUsingVariable(const std::string& aVariableName) const
+        {
+        std::set<std::string> layers;
+        std::set<std::string> defs;
+        for (const auto& p : iDef)
+            if (p.second.iVariable.count(aVariableName))
+                defs.insert(p.first);
+        for (const auto& p : iLayer)
+            if (p.second.iVariable.count(aVariableName) || Uses(p.second,defs))
+                layers.insert(p.first);
+        return layers;
+        }
+
+    /** Returns the number of style sheets in the summary. */
+    size_t StyleSheetCount() const { return iStyleSheetCount; }
+    /** Returns the number of distinct layer names. */
+    size_t LayerCount() const { return iLayer.size(); }
+
+    private:
+    /** Information about a layer or a definition. */
+    class TItem
+        {
+        public:
+        /** A hash of the elements, attributes and text, including those of enclosing elements. */
+        uint64_t iHash = KHashStart;
+        /** All the attribute values, and the identifiers referred to by attribute values and text, which include the identifiers of any definitions used. */
+        std::set<std::string> iValue;
+        /** All the names used in expressions, which include any variables used. */
+        std::set<std::string> iVariable;
+        };
+
+    static constexpr uint64_t KHashStart = 14695981039346656037ULL;
+
+    static void Hash(uint64_t& aHash,const std::string& aText)
+        {
+        // FNV-1a, with a terminating zero byte so that adjacent strings cannot run together.
+        for (char c : aText)
+            {
+            aHash ^= uint8_t(c);
+            aHash *= 1099511628211ULL;
+            }
+        aHash *= 1099511628211ULL;
+        }
+
+    static bool Uses(const TItem& aItem,const std::set<std::string>& aDefs)
+        {
+        for (const auto& d : aDefs)
+            if (aItem.iValue.count(d))
+                return true;
+        return false;
+        }
+
+    static void ChangedItems(const std::map<std::string,TItem>& aOld,const std::map<std::string,TItem>& aNew,std::set<std::string>& aChanged)
+        {
+        for (const auto& p : aOld)
+            {
+            auto q = aNew.find(p.first);
+            if (q == aNew.end() || q->second.iHash != p.second.iHash)
+                aChanged.insert(p.first);
+            }
+        for (const auto& p : aNew)
+            if (!aOld.count(p.first))
+                aChanged.insert(p.first);
+        }
+
+    static bool IsIdChar(char aChar) { return isalnum(uint8_t(aChar)) || aChar == '-' || aChar == '_' || aChar == '.' || aChar == ':'; }
+
+    /** Adds the identifiers referred to in some text in the forms '#id', 'url(#id)' and 'ref=id', where the identifier may be quoted. */
+    static void AddReferences(std::set<std::string>& aValues,const std::string& aText)
+        {
+        const size_t n = aText.size();
+        size_t i = 0;
+        while (i < n)
+            {
+            size_t start = std::string::npos;
+            if (aText[i] == '#')
+                start = i + 1;
+            else if (aText.compare(i,4,"ref=") == 0 && (i == 0 || !IsIdChar(aText[i - 1])))
+                {
+                start = i + 4;
+                if (start < n && (aText[start] == '\'' || aText[start] == '"'))
+                    start++;
+                }
+            if (start == std::string::npos)
+                {
+                i++;
+                continue;
+                }
+            size_t end = start;
+            while (end < n && IsIdChar(aText[end]))
+                end++;
+            if (end > start)
+                aValues.insert(aText.substr(start,end - start));
+            i = std::max(end,i + 1);
+            }
+        }
+
+    /** Adds the names in an expression, ignoring quoted strings, numbers and operators. */
+    static void AddExpressionNames(std::set<std::string>& aNames,const std::string& aExpression)
+        {
+        size_t i = 0;
+        const size_t n = aExpression.size();
+        while (i < n)
+            {
+            char c = aExpression[i];
+            if (c == '"' || c == '\'')
+                {
+                size_t end = aExpression.find(c,i + 1);
+                i = end == std::string::npos ? n : end + 1;
+                }
+            else if (isalpha(uint8_t(c)) || c == '_')
+                {
+                size_t start = i;
+                while (i < n && (isalnum(uint8_t(aExpression[i])) || aExpression[i] == '_' || aExpression[i] == ':'))
+                    i++;
+                aNames.insert(aExpression.substr(start,i - start));
+                }
+            else if (isdigit(uint8_t(c)))
+                {
+                while (i < n && isalnum(uint8_t(aExpression[i])))
+                    i++;
+                }
+            else
+                i++;
+            }
+        }
+
+    /** An XML handler which records the layers and definitions of one style sheet. */
+    class THandler: public MXmlHandler
+        {
+        public:
+        explicit THandler(CStyleSheetSummary& aSummary): iSummary(aSummary) { }
+
+        TResult StartElement(const std::string& aName,const CXmlAttributeArray& aAttributes) override
+            {
+            const size_t depth = iStack.size();
+            iStack.emplace_back();
+            TFrame& frame = iStack.back();
+
+            if (depth == 0)
+                {
+                // The root element: its attributes affect everything.
+                frame.iKind = TKind::Root;
+                HashElement(iSummary.iGlobalHash,aName,aAttributes);
+                return KErrorNone;
+                }
+
+            const TFrame& parent = iStack[depth - 1];
+            if (parent.iKind == TKind::Item)
+                {
+                frame.iKind = TKind::Item;
+                AddToItem(aName,aAttributes);
+                return KErrorNone;
+                }
+            if (parent.iKind == TKind::Global)
+                {
+                frame.iKind = TKind::Global;
+                HashElement(iSummary.iGlobalHash,aName,aAttributes);
+                return KErrorNone;
+                }
+
+            if (aName == "defs")
+                {
+                frame.iKind = TKind::Defs;
+                return KErrorNone;
+                }
+
+            const std::string* id = Attribute(aAttributes,parent.iKind == TKind::Defs ? "id" : "name");
+            if (parent.iKind == TKind::Defs)
+                {
+                if (id)
+                    BeginItem(frame,iSummary.iDef,*id,aName,aAttributes);
+                else
+                    {
+                    // Definitions without identifiers, such as fonts, may affect everything.
+                    frame.iKind = TKind::Global;
+                    HashElement(iSummary.iGlobalHash,aName,aAttributes);
+                    }
+                return KErrorNone;
+                }
+
+            if (aName == "layer" && id)
+                {
+                BeginItem(frame,iSummary.iLayer,*id,aName,aAttributes);
+                iSummary.iOrder.push_back("layer " + *id);
+                return KErrorNone;
+                }
+
+            // Other elements outside layers, such as 'scale', 'if' and 'labelLayer', are part of the context of the layers they enclose, and of the layer order.
+            frame.iKind = TKind::Context;
+            std::string entry = aName;
+            for (const auto& a : aAttributes)
+                entry += " " + a.first + "=" + a.second;
+            frame.iContext = entry;
+            iSummary.iOrder.push_back(entry);
+            return KErrorNone;
+            }
+
+        TResult EndElement(const std::string& aName) override
+            {
+            TFrame& frame = iStack.back();
+            if (frame.iKind == TKind::Item)
+                {
+                Hash(iItemHash,"/" + aName);
+                if (frame.iItem)
+                    {
+                    // The end of the item: combine its hash with the hashes of any earlier items of the same name.
+                    Hash(frame.iItem->iHash,std::to_string(iItemHash));
+                    iItem = nullptr;
+                    }
+                }
+            else if (frame.iKind == TKind::Context)
+                iSummary.iOrder.push_back("/" + aName);
+            else if (frame.iKind == TKind::Global)
+                Hash(iSummary.iGlobalHash,"/" + aName);
+            iStack.pop_back();
+            return KErrorNone;
+            }
+
+        TResult Text(const char* aText,size_t aLength) override
+            {
+            if (iStack.empty())
+                return KErrorNone;
+            size_t start = 0;
+            while (start < aLength && isspace(uint8_t(aText[start])))
+                start++;
+            size_t end = aLength;
+            while (end > start && isspace(uint8_t(aText[end - 1])))
+                end--;
+            if (start == end)
+                return KErrorNone;
+            std::string text(aText + start,end - start);
+            switch (iStack.back().iKind)
+                {
+                case TKind::Item:
+                    Hash(iItemHash,text);
+                    if (iItem)
+                        AddReferences(iItem->iValue,text);
+                    break;
+                case TKind::Context: iSummary.iOrder.push_back("text " + text); break;
+                default: Hash(iSummary.iGlobalHash,text); break;
+                }
+            return KErrorNone;
+            }
+
+        private:
+        enum class TKind { Root, Defs, Context, Item, Global };
+
+        class TFrame
+            {
+            public:
+            TKind iKind = TKind::Context;
+            TItem* iItem = nullptr;
+            std::string iContext;
+            };
+
+        static const std::string* Attribute(const CXmlAttributeArray& aAttributes,const char* aName)
+            {
+            for (const auto& a : aAttributes)
+                if (a.first == aName)
+                    return &a.second;
+            return nullptr;
+            }
+
+        static void HashElement(uint64_t& aHash,const std::string& aName,const CXmlAttributeArray& aAttributes)
+            {
+            Hash(aHash,aName);
+            for (const auto& a : aAttributes)
+                {
+                Hash(aHash,a.first);
+                Hash(aHash,a.second);
+                }
+            }
+
+        void BeginItem(TFrame& aFrame,std::map<std::string,TItem>& aMap,const std::string& aId,const std::string& aName,const CXmlAttributeArray& aAttributes)
+            {
+            aFrame.iKind = TKind::Item;
+            aFrame.iItem = iItem = &aMap[aId];
+            iItemHash = KHashStart;
+
+            // The enclosing elements are part of the item.
+            for (size_t i = 0; i + 1 < iStack.size(); i++)
+                if (iStack[i].iKind == TKind::Context)
+                    {
+                    Hash(iItemHash,iStack[i].iContext);
+                    AddExpressionNames(iItem->iVariable,iStack[i].iContext);
+                    }
+            AddToItem(aName,aAttributes);
+            }
+
+        void AddToItem(const std::string& aName,const CXmlAttributeArray& aAttributes)
+            {
+            HashElement(iItemHash,aName,aAttributes);
+            for (const auto& a : aAttributes)
+                {
+                iItem->iValue.insert(a.second);
+                AddReferences(iItem->iValue,a.second);
+                if (a.first == "exp")
+                    AddExpressionNames(iItem->iVariable,a.second);
+                }
+            }
+
+        CStyleSheetSummary& iSummary;
+        std::vector<TFrame> iStack;
+        TItem* iItem = nullptr;
+        uint64_t iItemHash = KHashStart;
+        };
+
+    size_t iStyleSheetCount = 0;
+    uint64_t iGlobalHash = KHashStart;
+    std::vector<std::string> iOrder;
+    std::map<std::string,TItem> iLayer;
+    std::map<std::string,TItem> iDef;
+    };
+
+}
+
+#endif
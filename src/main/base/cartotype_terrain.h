@@ -0,0 +1,420 @@
+/*
+cartotype_terrain.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_TERRAIN_H__
+#define CARTOTYPE_TERRAIN_H__
+
+#include <cartotype_map_object.h>
+#include <cartotype_bitmap.h>
+#include <cartotype_spatial_index.h>
+#include <cartotype_parallel.h>
+
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace CartoType
+{
+
+/** The value returned by terrain height functions for points where the height is unknown. */
+constexpr int32_t KUnknownHeight = INT16_MIN;
+
+/**
+A terrain tile decoded from a terrain map object into heights in metres, held as native floating-point
+values so that many points can be sampled from it quickly. Unknown heights are held as NaN.
+*/
+class CTerrainTile
+    {
+    public:
+    /**
+    Creates a terrain tile from an array map object containing terrain heights.
+    The object must have a bitmap of type A16, containing big-endian signed 16-bit metre values,
+    in which INT16_MIN means unknown, or of type A8, containing heights in feet encoded as
+    described in CMapObject::GetHeight.
+    */
+    static std::shared_ptr<CTerrainTile> New(TResult& aError,const CMapObject& aMapObject)
+        {
+        aError = KErrorNone;
+        const TBitmap* bitmap = aMapObject.Bitmap();
+        const TTransformFP* transform = aMapObject.BitmapTransform();
+        if (!bitmap || !transform || bitmap->Width() <= 0 || bitmap->Height() <= 0 ||
+            (bitmap->Type() != TBitmapType::A16 && bitmap->Type() != TBitmapType::A8))
+            {
+            aError = KErrorInvalidArgument;
+            return nullptr;
+            }
+
+        std::shared_ptr<CTerrainTile> tile(new CTerrainTile);
+        tile->iWidth = bitmap->Width();
+        tile->iHeight = bitmap->Height();
+        TTransformFP inverse { *transform };
+        aError = inverse.Invert();
+        if (aError)
+            return nullptr;
+        tile->iA = inverse.A(); tile->iB = inverse.B(); tile->iC = inverse.C();
+        tile->iD = inverse.D(); tile->iTx = inverse.Tx(); tile->iTy = inverse.Ty();
+        TRectFP bounds(0,0,tile->iWidth,tile->iHeight);
+        transform->Transform(bounds);
+        tile->iBounds = bounds;
+
+        tile->iValue.resize(size_t(tile->iWidth) * tile->iHeight);
+        float* dest = tile->iValue.data();
+        const float unknown = std::numeric_limits<float>::quiet_NaN();
+        for (int32_t y = 0; y < tile->iHeight; y++)
+            {
+            const uint8_t* row = bitmap->Data() + size_t(y) * bitmap->RowBytes();
+            if (bitmap->Type() == TBitmapType::A16)
+                {
+                for (int32_t x = 0; x < tile->iWidth; x++)
+                    {
+                    int16_t v = ReadBigEndian((const int16_t*)(row + x * 2));
+                    *dest++ = v == INT16_MIN ? unknown : float(v);
+                    }
+                }
+            else
+                {
+                for (int32_t x = 0; x < tile->iWidth; x++)
+                    {
+                    int32_t v = row[x];
+                    if (v == 0)
+                        *dest++ = unknown;
+                    else
+                        *dest++ = float((v <= 195 ? (v - 15) * 100 : 18000 + (v - 195) * 200) * 0.3048);
+                    }
+                }
+            }
+        return tile;
+        }
+
+    /** Returns the bounds of the tile in map coordinates. */
+    const TRectFP& Bounds() const { return iBounds; }
+    /** Returns the number of bytes used by the decoded heights. */
+    size_t DataBytes() const { return iValue.size() * sizeof(float); }
+
+    /**
+    Gets the four samples surrounding the point (aX,aY), in map coordinates, and the fractional position of the point
+    between them, clamping the point to the tile. The samples are returned in the order top left, top right,
+    bottom left, bottom right.
+    */
+    void GetSamples(double aX,double aY,float* aSample,float& aXFraction,float& aYFraction) const
+        {
+        double x = iA * aX + iC * aY + iTx;
+        double y = iB * aX + iD * aY + iTy;
+        x = std::max(0.0,std::min(x,double(iWidth - 1)));
+        y = std::max(0.0,std::min(y,double(iHeight - 1)));
+        int32_t x0 = int32_t(x);
+        int32_t y0 = int32_t(y);
+        int32_t dx = x0 < iWidth - 1 ? 1 : 0;
+        int32_t dy = y0 < iHeight - 1 ? iWidth : 0;
+        const float* p = iValue.data() + size_t(y0) * iWidth + x0;
+        aSample[0] = p[0];
+        aSample[1] = p[dx];
+        aSample[2] = p[dy];
+        aSample[3] = p[dy + dx];
+        aXFraction = float(x - x0);
+        aYFraction = float(y - y0);
+        }
+
+    private:
+    CTerrainTile() = default;
+
+    TRectFP iBounds;
+    int32_t iWidth = 0;
+    int32_t iHeight = 0;
+    double iA = 1, iB = 0, iC = 0, iD = 1, iTx = 0, iTy = 0; // the transform from map coordinates to sample coordinates
+    std::vector<float> iValue;
+    };
+
+/**
+Samples terrain heights for many points at once, caching decoded terrain tiles between calls.
+
+Tiles are obtained by calling a loader function supplied by the caller, which is normally
+a function finding terrain objects in the loaded maps. The loader is called without the sampler's lock held,
+so that cached tiles can be used while others are loading, and it may be called by more than one thread at once.
+Heights are interpolated bilinearly, ignoring unknown samples, in blocks of points laid out as separate arrays,
+so that the compiler can vectorize the interpolation. Large batches are split across threads.
+
+The sampler can be used from more than one thread at once.
+*/
+class CTerrainHeightSampler
+    {
+    public:
+    /**
+    A function to find the terrain objects intersecting a rectangle in map coordinates.
+    It appends the objects to aObjectArray.
+    */
+    using TLoader = std::function<TResult(const TRectFP& aBounds,CMapObjectArray& aObjectArray)>;
+
+    /** The default maximum number of bytes of decoded terrain data to keep in the cache. */
+    static constexpr size_t KDefaultCacheBytes = 64 * 1024 * 1024;
+    /** The number of points interpolated at once by the inner loop. */
+    static constexpr size_t KBlockSize = 256;
+
+    /** Creates a terrain sampler using aLoader to find terrain objects, and keeping up to aMaxCacheBytes of decoded tiles. */
+    explicit CTerrainHeightSampler(TLoader aLoader,size_t aMaxCacheBytes = KDefaultCacheBytes):
+        iLoader(aLoader),
+        iMaxCacheBytes(aMaxCacheBytes)
+        {
+        }
+    CTerrainHeightSampler(const CTerrainHeightSampler&) = delete;
+    CTerrainHeightSampler& operator=(const CTerrainHeightSampler&) = delete;
+
+    /**
+    Gets the terrain heights in metres of aCount points whose map coordinates are in aX and aY,
+    putting them in aHeight. Unknown heights are set to KUnknownHeight.
+    Uses up to aThreadCount threads, or DefaultThreadCount() if aThreadCount is zero.
+    */
+    TResult GetHeights(const double* aX,const double* aY,int32_t* aHeight,size_t aCount,size_t aThreadCount = 0)
+        {
+        if (!aCount)
+            return KErrorNone;
+
+        // Find the tiles, loading any that are needed, then take a snapshot of the cache so that loads in other threads don't affect this one.
+        std::vector<std::shared_ptr<CTerrainTile>> tile;
+        std::shared_ptr<CSpatialIndex> index;
+        TResult error = LoadTiles(aX,aY,aCount,tile,index);
+        if (error)
+            return error;
+
+        ParallelFor((aCount + KBlockSize - 1) / KBlockSize,[&](size_t aBegin,size_t aEnd)
+            {
+            for (size_t block = aBegin; block < aEnd; block++)
+                {
+                size_t start = block * KBlockSize;
+                SampleBlock(tile,*index,aX + start,aY + start,aHeight + start,std::min(KBlockSize,aCount - start));
+                }
+            },aThreadCount);
+        return KErrorNone;
+        }
+
+    /** Discards all cached tiles. This must be called when maps are loaded or unloaded. */
+    void Clear()
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        iCache.clear();
+        iCacheBytes = 0;
+        iIndex.reset();
+        iGeneration++;
+        }
+    /** Sets the maximum number of bytes of decoded terrain data to keep in the cache. */
+    void SetMaxCacheBytes(size_t aMaxCacheBytes)
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        iMaxCacheBytes = aMaxCacheBytes;
+        Trim();
+        }
+
+    private:
+    class TCacheEntry
+        {
+        public:
+        std::shared_ptr<CTerrainTile> iTile;
+        uint64_t iLastUse = 0;
+        };
+
+    TResult LoadTiles(const double* aX,const double* aY,size_t aCount,std::vector<std::shared_ptr<CTerrainTile>>& aTile,std::shared_ptr<CSpatialIndex>& aIndex)
+        {
+        // Find the cached tiles containing the points, and the bounds of the points not covered by them.
+        std::vector<bool> used;
+        TRectFP uncovered;
+        std::vector<std::shared_ptr<CTerrainTile>> held;
+        uint64_t generation = 0;
+            {
+            std::lock_guard<std::mutex> lock(iMutex);
+            iUseCount++;
+            if (!iIndex)
+                UpdateIndex();
+            if (!FindTiles(aX,aY,aCount,used,&uncovered))
+                {
+                GetUsedTiles(used,aTile,aIndex);
+                return KErrorNone;
+                }
+            for (size_t i = 0; i < iTileOrder.size(); i++)
+                if (used[i])
+                    held.push_back(iCache[iTileOrder[i]].iTile);
+            generation = iGeneration;
+            }
+
+        // Load and decode the missing tiles without holding the lock, so that other threads can use the cache meanwhile.
+        CMapObjectArray object_array;
+        TResult error = iLoader(uncovered,object_array);
+        if (error)
+            return error;
+        for (const auto& object : object_array)
+            {
+            TResult decode_error = KErrorNone;
+            auto tile = CTerrainTile::New(decode_error,*object);
+            if (!decode_error)
+                held.push_back(tile);
+            }
+
+        std::lock_guard<std::mutex> lock(iMutex);
+        if (generation != iGeneration)
+            {
+            // The cache was cleared while the tiles were loading, so use them for this call only.
+            std::vector<TRectFP> bounds;
+            for (const auto& tile : held)
+                bounds.push_back(tile->Bounds());
+            aTile = held;
+            aIndex = std::make_shared<CSpatialIndex>(bounds);
+            return KErrorNone;
+            }
+
+        // Add the new tiles, and any held tiles which were discarded by another thread. If another thread has loaded the same tile, its copy is kept.
+        iUseCount++;
+        for (const auto& tile : held)
+            {
+            if (iCache.count(tile->Bounds()))
+                continue;
+            iCacheBytes += tile->DataBytes();
+            iCache[tile->Bounds()].iTile = tile;
+            iIndex.reset();
+            }
+        if (!iIndex)
+            UpdateIndex();
+        FindTiles(aX,aY,aCount,used,nullptr);
+        GetUsedTiles(used,aTile,aIndex);
+        return KErrorNone;
+        }
+
+    /**
+    Returns the tiles marked in aUsed, and the current index, marking the tiles as used so that other tiles
+    are discarded first; then discards tiles if the cache is too large. Must be called with the mutex held.
+    */
+    void GetUsedTiles(const std::vector<bool>& aUsed,std::vector<std::shared_ptr<CTerrainTile>>& aTile,std::shared_ptr<CSpatialIndex>& aIndex)
+        {
+        aTile.assign(iTileOrder.size(),nullptr);
+        for (size_t i = 0; i < iTileOrder.size(); i++)
+            {
+            if (aUsed[i])
+                {
+                auto& entry = iCache[iTileOrder[i]];
+                entry.iLastUse = iUseCount;
+                aTile[i] = entry.iTile;
+                }
+            }
+        aIndex = iIndex;
+        Trim();
+        }
+
+    /**
+    Marks the tiles containing the points in aUsed, which is indexed in the same order as iTileOrder.
+    If aUncovered is not null, sets it to the bounds of the points not contained in any tile, and returns true if there are any.
+    */
+    bool FindTiles(const double* aX,const double* aY,size_t aCount,std::vector<bool>& aUsed,TRectFP* aUncovered) const
+        {
+        aUsed.assign(iTileOrder.size(),false);
+        bool have_uncovered = false;
+        for (size_t i = 0; i < aCount; i++)
+            {
+            TPointFP p(aX[i],aY[i]);
+            bool found = false;
+            iIndex->Search(p,[&](size_t aTileIndex) { aUsed[aTileIndex] = true; found = true; return false; });
+            if (!found && aUncovered)
+                {
+                if (!have_uncovered)
+                    *aUncovered = TRectFP(p.iX,p.iY,p.iX,p.iY);
+                else
+                    aUncovered->Combine(p);
+                have_uncovered = true;
+                }
+            }
+        return have_uncovered;
+        }
+
+    void UpdateIndex()
+        {
+        iTileOrder.clear();
+        std::vector<TRectFP> bounds;
+        for (const auto& entry : iCache)
+            {
+            iTileOrder.push_back(entry.first);
+            bounds.push_back(entry.first);
+            }
+        iIndex = std::make_shared<CSpatialIndex>(bounds);
+        }
+
+    void Trim()
+        {
+        // Discard least recently used tiles, but never those used by the current call.
+        while (iCacheBytes > iMaxCacheBytes)
+            {
+            auto oldest = iCache.end();
+            for (auto iter = iCache.begin(); iter != iCache.end(); ++iter)
+                if (iter->second.iLastUse < iUseCount && (oldest == iCache.end() || iter->second.iLastUse < oldest->second.iLastUse))
+                    oldest = iter;
+            if (oldest == iCache.end())
+                break;
+            iCacheBytes -= oldest->second.iTile->DataBytes();
+            iCache.erase(oldest);
+            iIndex.reset();
+            }
+        }
+
+    static void SampleBlock(const std::vector<std::shared_ptr<CTerrainTile>>& aTile,const CSpatialIndex& aIndex,
+                            const double* aX,const double* aY,int32_t* aHeight,size_t aCount)
+        {
+        // Gather the samples, which needs the tile lookup, into separate arrays.
+        float s0[KBlockSize], s1[KBlockSize], s2[KBlockSize], s3[KBlockSize], fx[KBlockSize], fy[KBlockSize];
+        const float unknown = std::numeric_limits<float>::quiet_NaN();
+        for (size_t i = 0; i < aCount; i++)
+            {
+            const CTerrainTile* tile = nullptr;
+            aIndex.Search(TPointFP(aX[i],aY[i]),[&](size_t aTileIndex) { tile = aTile[aTileIndex].get(); return false; });
+            if (tile)
+                {
+                float sample[4];
+                tile->GetSamples(aX[i],aY[i],sample,fx[i],fy[i]);
+                s0[i] = sample[0]; s1[i] = sample[1]; s2[i] = sample[2]; s3[i] = sample[3];
+                }
+            else
+                {
+                s0[i] = s1[i] = s2[i] = s3[i] = unknown;
+                fx[i] = fy[i] = 0;
+                }
+            }
+
+        // Interpolate, giving no weight to unknown samples. This loop has no branches and can be vectorized.
+        float result[KBlockSize];
+        for (size_t i = 0; i < aCount; i++)
+            {
+            float w0 = (1 - fx[i]) * (1 - fy[i]);
+            float w1 = fx[i] * (1 - fy[i]);
+            float w2 = (1 - fx[i]) * fy[i];
+            float w3 = fx[i] * fy[i];
+            w0 = s0[i] == s0[i] ? w0 : 0;
+            w1 = s1[i] == s1[i] ? w1 : 0;
+            w2 = s2[i] == s2[i] ? w2 : 0;
+            w3 = s3[i] == s3[i] ? w3 : 0;
+            float v0 = w0 > 0 ? s0[i] : 0;
+            float v1 = w1 > 0 ? s1[i] : 0;
+            float v2 = w2 > 0 ? s2[i] : 0;
+            float v3 = w3 > 0 ? s3[i] : 0;
+            float weight = w0 + w1 + w2 + w3;
+            float value = (w0 * v0 + w1 * v1 + w2 * v2 + w3 * v3) / (weight > 0 ? weight : 1);
+            result[i] = weight > 0 ? value : float(KUnknownHeight);
+            }
+        for (size_t i = 0; i < aCount; i++)
+            aHeight[i] = int32_t(std::lround(result[i]));
+        }
+
+    TLoader iLoader;
+    std::mutex iMutex;
+    std::map<TRectFP,TCacheEntry> iCache;
+    std::vector<TRectFP> iTileOrder;
+    std::shared_ptr<CSpatialIndex> iIndex;
+    size_t iCacheBytes = 0;
+    size_t iMaxCacheBytes = KDefaultCacheBytes;
+    uint64_t iUseCount = 0;
+    uint64_t iGeneration = 0;
+    };
+
+}
+
+#endif
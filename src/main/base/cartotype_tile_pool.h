@@ -0,0 +1,403 @@
+/*
+cartotype_tile_pool.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_TILE_POOL_H__
+#define CARTOTYPE_TILE_POOL_H__
+
+#include <cartotype_base.h>
+#include <cartotype_stream.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace CartoType
+{
+
+/** Identifies a map tile by its zoom level and its x and y coordinates at that zoom level. */
+class TTileKey
+    {
+    public:
+    /** The equality operator. */
+    bool operator==(const TTileKey& aOther) const { return iZoom == aOther.iZoom && iX == aOther.iX && iY == aOther.iY; }
+    /** The inequality operator. */
+    bool operator!=(const TTileKey& aOther) const { return !(*this == aOther); }
+
+    /** The zoom level. */
+    int32_t iZoom = 0;
+    /** The x coordinate of the tile. */
+    int32_t iX = 0;
+    /** The y coordinate of the tile. */
+    int32_t iY = 0;
+    };
+
+/** A hash function for tile keys. */
+class TTileKeyHash
+    {
+    public:
+    /** Returns the hash value of a tile key. */
+    size_t operator()(const TTileKey& aKey) const
+        {
+        uint64_t h = (uint64_t(uint32_t(aKey.iX)) << 32 | uint32_t(aKey.iY)) * 0x9E3779B97F4A7C15ULL;
+        return size_t(h ^ (h >> 29) ^ uint64_t(uint32_t(aKey.iZoom)) * 0xBF58476D1CE4E5B9ULL);
+        }
+    };
+
+/**
+An index of the tiles that exist in a tiled map data set, used to find tiles and the extent of the data
+without probing the file system.
+
+The index can be stored as text, one tile per line, giving the zoom level and the x and y coordinates
+separated by spaces. Blank lines and lines starting with # are ignored.
+*/
+class CTileIndex
+    {
+    public:
+    /**
+    Adds a tile to the index. Tiles are appended, so that adding many tiles takes linear time:
+    call Sort after adding tiles and before using the index.
+    */
+    void Add(int32_t aZoom,int32_t aX,int32_t aY)
+        {
+        iLevel[aZoom].push_back(Key(aX,aY));
+        }
+
+    /** Sorts the tiles and removes duplicates. This must be called after tiles are added using Add. Read calls it automatically. */
+    void Sort()
+        {
+        for (auto& level : iLevel)
+            {
+            std::sort(level.second.begin(),level.second.end());
+            level.second.erase(std::unique(level.second.begin(),level.second.end()),level.second.end());
+            }
+        }
+
+    /** Returns true if the index contains a tile. */
+    bool Contains(int32_t aZoom,int32_t aX,int32_t aY) const
+        {
+        auto p = iLevel.find(aZoom);
+        return p != iLevel.end() && std::binary_search(p->second.begin(),p->second.end(),Key(aX,aY));
+        }
+
+    /**
+    Gets the range of tiles at a zoom level as a rectangle in tile coordinates, with exclusive right and bottom edges.
+    Returns false if there are no tiles at that zoom level.
+    */
+    bool Extent(int32_t aZoom,TRect& aExtent) const
+        {
+        auto p = iLevel.find(aZoom);
+        if (p == iLevel.end() || p->second.empty())
+            return false;
+        const std::vector<uint64_t>& level = p->second;
+        int32_t min_x = INT32_MAX,max_x = INT32_MIN;
+        for (auto k : level)
+            {
+            min_x = std::min(min_x,X(k));
+            max_x = std::max(max_x,X(k));
+            }
+        aExtent = TRect(min_x,Y(level.front()),max_x + 1,Y(level.back()) + 1);
+        return true;
+        }
+
+    /** Appends the tiles at a zoom level in aRange, in tile coordinates with exclusive right and bottom edges, to aTiles. */
+    void Tiles(std::vector<TTileKey>& aTiles,int32_t aZoom,const TRect& aRange) const
+        {
+        auto p = iLevel.find(aZoom);
+        if (p == iLevel.end())
+            return;
+        const std::vector<uint64_t>& level = p->second;
+        for (int32_t y = aRange.Top(); y < aRange.Bottom(); y++)
+            {
+            auto q = std::lower_bound(level.begin(),level.end(),Key(aRange.Left(),y));
+            for (; q != level.end() && Y(*q) == y && X(*q) < aRange.Right(); ++q)
+                aTiles.push_back(TTileKey { aZoom,X(*q),y });
+            }
+        }
+
+    /** Returns the zoom levels for which there are tiles, in ascending order. */
+    std::vector<int32_t> ZoomLevels() const
+        {
+        std::vector<int32_t> z;
+        for (const auto& p : iLevel)
+            if (!p.second.empty())
+                z.push_back(p.first);
+        return z;
+        }
+
+    /** Returns the total number of tiles. */
+    size_t TileCount() const
+        {
+        size_t n = 0;
+        for (const auto& p : iLevel)
+            n += p.second.size();
+        return n;
+        }
+
+    /** Reads tiles in text form from a stream, adding them to the index. */
+    TResult Read(MInputStream& aInputStream)
+        {
+        std::string line;
+        bool end = false;
+        TResult error = KErrorNone;
+        while (!end)
+            {
+            const uint8_t* p = nullptr;
+            size_t length = 0;
+            error = aInputStream.EndOfStream() ? TResult(KErrorEndOfData) : aInputStream.Read(p,length);
+            if (error == KErrorEndOfData || (!error && !length))
+                {
+                end = true;
+                length = 0;
+                error = KErrorNone;
+                }
+            else if (error)
+                break;
+            for (size_t i = 0; i <= length; i++)
+                {
+                if (i < length && p[i] != '\n')
+                    {
+                    line += char(p[i]);
+                    continue;
+                    }
+                if (i == length && !end)
+                    break;
+                error = ReadLine(line);
+                line.clear();
+                if (error)
+                    break;
+                }
+            if (error)
+                break;
+            }
+
+        // Sort the levels even if there was an error, so that the tiles already read can be used.
+        Sort();
+        return error;
+        }
+
+    /** Writes the index in text form to a stream. */
+    TResult Write(MOutputStream& aOutputStream) const
+        {
+        TResult error = KErrorNone;
+        for (const auto& level : iLevel)
+            for (auto k : level.second)
+                {
+                char buffer[48];
+                snprintf(buffer,sizeof(buffer),"%d %d %d\n",int(level.first),int(X(k)),int(Y(k)));
+                error = aOutputStream.WriteString(buffer);
+                if (error)
+                    return error;
+                }
+        return error;
+        }
+
+    private:
+    // Keys are ordered by y, then x, so that the tiles in a row of a range are contiguous.
+    static uint64_t Key(int32_t aX,int32_t aY) { return uint64_t(uint32_t(aY) ^ 0x80000000) << 32 | (uint32_t(aX) ^ 0x80000000); }
+    static int32_t X(uint64_t aKey) { return int32_t(uint32_t(aKey) ^ 0x80000000); }
+    static int32_t Y(uint64_t aKey) { return int32_t(uint32_t(aKey >> 32) ^ 0x80000000); }
+
+    /** Adds the tile in a line, without sorting; Read sorts the levels when all lines have been read. */
+    TResult ReadLine(const std::string& aLine)
+        {
+        size_t start = aLine.find_first_not_of(" \t\r");
+        if (start == std::string::npos || aLine[start] == '#')
+            return KErrorNone;
+        int zoom = 0,x = 0,y = 0;
+        char extra = 0;
+        if (sscanf(aLine.c_str() + start,"%d %d %d %c",&zoom,&x,&y,&extra) != 3)
+            return KErrorCorrupt;
+        iLevel[zoom].push_back(Key(x,y));
+        return KErrorNone;
+        }
+
+    std::map<int32_t,std::vector<uint64_t>> iLevel;
+    };
+
+/** Parameters for a CTilePool, giving the limits on open tiles, and optionally an index of the tiles that exist. */
+class TTilePoolParam
+    {
+    public:
+    /**
+    The maximum number of tiles kept open at once (default = 64). When it is exceeded, the least recently used tiles
+    are closed, and opened again if they are needed. If it is zero there is no limit.
+    */
+    size_t iMaxOpenTiles = 64;
+    /**
+    The maximum memory in bytes used by open tiles, including their file buffers and text indexes (default = 256Mb).
+    When it is exceeded, the least recently used tiles are closed. If it is zero there is no limit.
+    */
+    size_t iMaxTileMemoryInBytes = 256 * 1024 * 1024;
+    /**
+    An optional index of the tiles that exist. If it is supplied, only tiles in the index are opened,
+    so that the file system is not searched for tiles.
+    */
+    std::shared_ptr<const CTileIndex> iTileIndex;
+    };
+
+/**
+A pool of open tile databases, or other objects representing tiles, which limits the number of tiles open at once
+and the memory they use. Tiles are opened when they are first needed, and the least recently used tiles are closed
+when either limit is exceeded; a tile which has been closed is opened again transparently when it is next needed.
+Tiles in use, because a pointer returned by Get is still held, are not closed.
+
+If a tile index is supplied, tiles not in it are not opened. Tiles which could not be found are remembered,
+so that the file system is not probed for them again. The pool is thread-safe.
+*/
+template<class T> class CTilePool
+    {
+    public:
+    /** A function to open a tile, setting aMemoryUsed to an estimate of the memory used by the open tile, including file buffers and indexes. */
+    using TOpenFunction = std::function<std::shared_ptr<T>(TResult& aError,const TTileKey& aKey,size_t& aMemoryUsed)>;
+
+    /**
+    Creates a pool using aOpen to open tiles, keeping at most aMaxOpenCount tiles open, using at most aMaxMemory bytes.
+    If either limit is zero it is not applied. If aIndex is non-null, only tiles in it are opened.
+    */
+    CTilePool(TOpenFunction aOpen,size_t aMaxOpenCount,size_t aMaxMemory,std::shared_ptr<const CTileIndex> aIndex = nullptr):
+        iOpen(aOpen),
+        iMaxOpenCount(aMaxOpenCount),
+        iMaxMemory(aMaxMemory),
+        iIndex(aIndex)
+        {
+        }
+    /** Creates a pool using aOpen to open tiles, with the limits and the optional tile index in aParam. */
+    CTilePool(TOpenFunction aOpen,const TTilePoolParam& aParam):
+        CTilePool(aOpen,aParam.iMaxOpenTiles,aParam.iMaxTileMemoryInBytes,aParam.iTileIndex)
+        {
+        }
+    CTilePool(const CTilePool&) = delete;
+    CTilePool& operator=(const CTilePool&) = delete;
+
+    /** Returns a tile, opening it if necessary. Returns null and sets aError to KErrorNotFound if the tile does not exist. */
+    std::shared_ptr<T> Get(TResult& aError,const TTileKey& aKey)
+        {
+        aError = KErrorNone;
+            {
+            std::lock_guard<std::mutex> lock(iMutex);
+            auto p = iMap.find(aKey);
+            if (p != iMap.end())
+                {
+                iList.splice(iList.begin(),iList,p->second);
+                return p->second->iTile;
+                }
+            if ((iIndex && !iIndex->Contains(aKey.iZoom,aKey.iX,aKey.iY)) || iMissing.count(aKey))
+                {
+                aError = KErrorNotFound;
+                return nullptr;
+                }
+            }
+
+        // Open the tile without holding the lock, so that other tiles can be used meanwhile.
+        size_t memory = 0;
+        std::shared_ptr<T> tile = iOpen(aError,aKey,memory);
+        if (!aError && !tile)
+            aError = KErrorNotFound;
+
+        std::lock_guard<std::mutex> lock(iMutex);
+        if (aError)
+            {
+            if (aError == KErrorNotFound)
+                iMissing.insert(aKey);
+            return nullptr;
+            }
+        auto p = iMap.find(aKey);
+        if (p != iMap.end()) // another thread opened the tile first
+            {
+            iList.splice(iList.begin(),iList,p->second);
+            return p->second->iTile;
+            }
+        iList.push_front(TEntry { aKey,tile,memory });
+        iMap[aKey] = iList.begin();
+        iMemory += memory;
+        iOpenedCount++;
+        CloseUnused();
+        return tile;
+        }
+
+    /** Closes a tile if it is open and not in use: for example, because its file has changed. */
+    void Close(const TTileKey& aKey)
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        iMissing.erase(aKey);
+        auto p = iMap.find(aKey);
+        if (p != iMap.end() && p->second->iTile.use_count() == 1)
+            Erase(p->second);
+        }
+    /** Closes all tiles not in use and forgets which tiles could not be found. */
+    void Clear()
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        iMissing.clear();
+        for (auto p = iList.begin(); p != iList.end(); )
+            {
+            auto q = p++;
+            if (q->iTile.use_count() == 1)
+                Erase(q);
+            }
+        }
+
+    /** Returns the number of open tiles. */
+    size_t OpenCount() const { std::lock_guard<std::mutex> lock(iMutex); return iList.size(); }
+    /** Returns the estimated memory in bytes used by the open tiles. */
+    size_t MemoryUsed() const { std::lock_guard<std::mutex> lock(iMutex); return iMemory; }
+    /** Returns the number of times a tile has been opened, including reopening tiles that were closed. */
+    uint64_t OpenedCount() const { std::lock_guard<std::mutex> lock(iMutex); return iOpenedCount; }
+
+    private:
+    class TEntry
+        {
+        public:
+        TTileKey iKey;
+        std::shared_ptr<T> iTile;
+        size_t iMemory;
+        };
+
+    bool OverLimit() const
+        {
+        return (iMaxOpenCount && iList.size() > iMaxOpenCount) || (iMaxMemory && iMemory > iMaxMemory);
+        }
+
+    /** Closes the least recently used tiles that are not in use until the limits are met. */
+    void CloseUnused()
+        {
+        for (auto p = iList.end(); OverLimit() && p != iList.begin(); )
+            {
+            --p;
+            if (p->iTile.use_count() == 1)
+                p = Erase(p);
+            }
+        }
+
+    typename std::list<TEntry>::iterator Erase(typename std::list<TEntry>::iterator aEntry)
+        {
+        iMemory -= aEntry->iMemory;
+        iMap.erase(aEntry->iKey);
+        return iList.erase(aEntry);
+        }
+
+    TOpenFunction iOpen;
+    size_t iMaxOpenCount;
+    size_t iMaxMemory;
+    std::shared_ptr<const CTileIndex> iIndex;
+    mutable std::mutex iMutex;
+    std::list<TEntry> iList;
+    std::unordered_map<TTileKey,typename std::list<TEntry>::iterator,TTileKeyHash> iMap;
+    std::unordered_set<TTileKey,TTileKeyHash> iMissing;
+    size_t iMemory = 0;
+    uint64_t iOpenedCount = 0;
+    };
+
+}
+
+#endif
@@ -0,0 +1,305 @@
+/*
+cartotype_track_recorder.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_TRACK_RECORDER_H__
+#define CARTOTYPE_TRACK_RECORDER_H__
+
+#include <cartotype_geometry.h>
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <vector>
+
+namespace CartoType
+{
+
+/** A type for a sequence of track points. */
+using CTrackGeometry = CGeneralGeometry<TTrackPoint>;
+
+/** Parameters controlling how a track is recorded and displayed. */
+class TTrackParam
+    {
+    public:
+    /**
+    The maximum distance in metres between a recorded position and the simplified track.
+    If it is greater than zero, positions lying close enough to a straight line are not stored.
+    If it is zero, all positions are stored.
+    */
+    double iMaxErrorInMeters = 0;
+    /** If non-zero, the maximum number of points stored; when it is exceeded, the oldest points are discarded. */
+    size_t iMaxPointCount = 0;
+    /** The number of points in each of the map objects used to display the track. */
+    size_t iDisplayChunkSize = 256;
+    };
+
+/**
+A track recorder, which stores a track, optionally simplifying it as positions are added and limiting its size.
+
+Simplification uses a sliding window: a position replaces the previous one if every position received since the
+last stored point lies within TTrackParam::iMaxErrorInMeters of the straight line to it. Otherwise the previous
+position is stored permanently and becomes the start of a new window. The most recent position is
+always stored, so the track always ends at the current position.
+
+Points are identified by indexes counted from the start of recording, so that the indexes of stored points
+do not change when older points are discarded.
+*/
+class CTrackRecorder
+    {
+    public:
+    /** The maximum number of positions in the simplification window; this bounds the time taken to add a position. */
+    static constexpr size_t KMaxWindowSize = 256;
+
+    /** Creates an empty track recorder with the specified parameters. */
+    explicit CTrackRecorder(const TTrackParam& aParam = TTrackParam()) { SetParam(aParam); }
+
+    /** Sets the parameters, discarding the oldest points if the maximum point count is reduced. */
+    void SetParam(const TTrackParam& aParam)
+        {
+        iParam = aParam;
+        if (iParam.iMaxPointCount && iParam.iMaxPointCount < 2)
+            iParam.iMaxPointCount = 2;
+        if (!iParam.iDisplayChunkSize)
+            iParam.iDisplayChunkSize = 1;
+        iWindow.clear();
+        DiscardOldPoints();
+        }
+    /** Returns the parameters. */
+    const TTrackParam& Param() const { return iParam; }
+
+    /** Deletes all the points and starts a new track. */
+    void Clear()
+        {
+        iFirstIndex += iPoint.size();
+        iPoint.clear();
+        iWindow.clear();
+        iNewSegment = true;
+        iLength = 0;
+        iPositionCount = 0;
+        }
+    /** Starts a new segment: the next point is not joined to the previous one. */
+    void BeginSegment()
+        {
+        iNewSegment = true;
+        iWindow.clear();
+        }
+
+    /** Adds a position to the track. */
+    void Append(const TTrackPoint& aPoint)
+        {
+        iPositionCount++;
+        if (iNewSegment || iPoint.empty())
+            {
+            iPoint.push_back(TEntry { aPoint,true });
+            iNewSegment = false;
+            iWindow.clear();
+            DiscardOldPoints();
+            return;
+            }
+
+        const TTrackPoint& prev = iPoint.back().iPoint;
+        iLength += GreatCircleDistanceInMeters(prev.iX,prev.iY,aPoint.iX,aPoint.iY);
+
+        if (iParam.iMaxErrorInMeters <= 0)
+            {
+            iPoint.push_back(TEntry { aPoint,false });
+            DiscardOldPoints();
+            return;
+            }
+
+        // If the window is non-empty the last stored point is provisional and can be replaced.
+        if (!iWindow.empty() && iWindow.size() < KMaxWindowSize && WindowFits(aPoint))
+            iPoint.back().iPoint = aPoint;
+        else
+            {
+            iWindow.clear();
+            iPoint.push_back(TEntry { aPoint,false });
+            DiscardOldPoints();
+            }
+        iWindow.push_back(aPoint);
+        }
+
+    /** Returns true if the track has no points. */
+    bool Empty() const { return iPoint.empty(); }
+    /** Returns the number of stored points. */
+    size_t PointCount() const { return iPoint.size(); }
+    /** Returns the number of positions added since the track was started, including those not stored. */
+    uint64_t PositionCount() const { return iPositionCount; }
+    /** Returns the length in metres of the track as recorded, including positions not stored or discarded. */
+    double LengthInMeters() const { return iLength; }
+    /** Returns the index of the first stored point. */
+    uint64_t FirstIndex() const { return iFirstIndex; }
+    /** Returns the index after the last stored point. */
+    uint64_t EndIndex() const { return iFirstIndex + iPoint.size(); }
+    /** Returns the index after the last point that will not be changed by adding more positions. */
+    uint64_t StableEndIndex() const { return iWindow.empty() ? EndIndex() : EndIndex() - 1; }
+    /** Returns a stored point, given its index. */
+    const TTrackPoint& Point(uint64_t aIndex) const { return iPoint[size_t(aIndex - iFirstIndex)].iPoint; }
+    /** Returns true if a stored point, given its index, starts a segment. */
+    bool SegmentStart(uint64_t aIndex) const { return iPoint[size_t(aIndex - iFirstIndex)].iSegmentStart; }
+
+    /** Returns the stored points with indexes in the range aStart...aEnd - 1 as a geometry object, with one contour per segment. */
+    CTrackGeometry Geometry(uint64_t aStart,uint64_t aEnd) const
+        {
+        CTrackGeometry g(TCoordType::Degree);
+        aStart = std::max(aStart,FirstIndex());
+        aEnd = std::min(aEnd,EndIndex());
+        for (uint64_t i = aStart; i < aEnd; i++)
+            {
+            const TEntry& e = iPoint[size_t(i - iFirstIndex)];
+            if (e.iSegmentStart)
+                g.BeginContour();
+            g.AppendPoint(e.iPoint);
+            }
+        return g;
+        }
+    /** Returns all the stored points as a geometry object, with one contour per segment. */
+    CTrackGeometry Geometry() const { return Geometry(FirstIndex(),EndIndex()); }
+
+    private:
+    class TEntry
+        {
+        public:
+        TTrackPoint iPoint;
+        bool iSegmentStart;
+        };
+
+    /** Returns true if all the positions in the window are close enough to the line from the last permanent point to aPoint. */
+    bool WindowFits(const TTrackPoint& aPoint) const
+        {
+        // Use a local flat projection in metres centred on the start of the line.
+        const TTrackPoint& start = iPoint[iPoint.size() - 2].iPoint;
+        const double k = KDegreesToRadiansDouble * KEquatorialRadiusInMetres;
+        const double kx = k * cos(start.iY * KDegreesToRadiansDouble);
+        const double dx = (aPoint.iX - start.iX) * kx;
+        const double dy = (aPoint.iY - start.iY) * k;
+        const double length_squared = dx * dx + dy * dy;
+        const double max_squared = iParam.iMaxErrorInMeters * iParam.iMaxErrorInMeters;
+        for (const auto& p : iWindow)
+            {
+            double px = (p.iX - start.iX) * kx;
+            double py = (p.iY - start.iY) * k;
+            double t = length_squared > 0 ? std::clamp((px * dx + py * dy) / length_squared,0.0,1.0) : 0;
+            double ex = px - t * dx;
+            double ey = py - t * dy;
+            if (ex * ex + ey * ey > max_squared)
+                return false;
+            }
+        return true;
+        }
+
+    void DiscardOldPoints()
+        {
+        if (!iParam.iMaxPointCount)
+            return;
+        while (iPoint.size() > iParam.iMaxPointCount)
+            {
+            iPoint.pop_front();
+            iFirstIndex++;
+            // The new first point starts the remaining part of its segment.
+            if (!iPoint.empty())
+                iPoint.front().iSegmentStart = true;
+            }
+        }
+
+    TTrackParam iParam;
+    std::deque<TEntry> iPoint;
+    std::vector<TTrackPoint> iWindow;
+    uint64_t iFirstIndex = 0;
+    uint64_t iPositionCount = 0;
+    double iLength = 0;
+    bool iNewSegment = true;
+    };
+
+/**
+Maintains the map objects used to display a track recorded by a CTrackRecorder, updating them incrementally.
+The track is divided into chunks of TTrackParam::iDisplayChunkSize points; each chunk is displayed by a separate
+map object which is created once, when all its points are stable, and deleted when all its points have been discarded.
+Only the object for the final, incomplete chunk is replaced when a position is added, so the cost of an update does not
+depend on the length of the track.
+*/
+class CTrackDisplay
+    {
+    public:
+    /** A function to insert a map object, replacing the object with the identifier aId if it is non-zero, and setting aId to the identifier of the new object. */
+    using TInsertFunction = std::function<TResult(const CTrackGeometry& aGeometry,uint64_t& aId)>;
+    /** A function to delete a map object. */
+    using TDeleteFunction = std::function<void(uint64_t aId)>;
+
+    /** Updates the map objects to match aTrack. */
+    TResult Update(const CTrackRecorder& aTrack,TInsertFunction aInsert,TDeleteFunction aDelete)
+        {
+        // Delete chunks whose points have all been discarded; the overlapping point at the end of a chunk belongs to the next chunk.
+        while (!iChunk.empty() && iChunk.front().iEnd <= aTrack.FirstIndex())
+            {
+            aDelete(iChunk.front().iId);
+            iChunk.pop_front();
+            }
+        if (iLiveStart < aTrack.FirstIndex())
+            iLiveStart = aTrack.FirstIndex();
+
+        // Make complete chunks permanent, reusing the object used for the final chunk.
+        const uint64_t chunk_size = aTrack.Param().iDisplayChunkSize;
+        TResult error = KErrorNone;
+        while (!error && aTrack.StableEndIndex() > iLiveStart + chunk_size)
+            {
+            uint64_t end = iLiveStart + chunk_size;
+            uint64_t geometry_end = aTrack.SegmentStart(end) ? end : end + 1;
+            error = aInsert(aTrack.Geometry(iLiveStart,geometry_end),iLiveId);
+            if (!error)
+                {
+                iChunk.push_back(TChunk { end,iLiveId });
+                iLiveId = 0;
+                iLiveStart = end;
+                }
+            }
+
+        // Replace the object for the final chunk.
+        if (!error)
+            {
+            if (aTrack.EndIndex() > iLiveStart)
+                error = aInsert(aTrack.Geometry(iLiveStart,aTrack.EndIndex()),iLiveId);
+            else if (iLiveId)
+                {
+                aDelete(iLiveId);
+                iLiveId = 0;
+                }
+            }
+        return error;
+        }
+
+    /** Deletes all the map objects. If aTrack is non-null, displaying resumes from its current end. */
+    void Clear(TDeleteFunction aDelete,const CTrackRecorder* aTrack = nullptr)
+        {
+        for (const auto& c : iChunk)
+            aDelete(c.iId);
+        iChunk.clear();
+        if (iLiveId)
+            aDelete(iLiveId);
+        iLiveId = 0;
+        iLiveStart = aTrack ? aTrack->FirstIndex() : 0;
+        }
+
+    /** Returns the number of map objects used to display the track. */
+    size_t ObjectCount() const { return iChunk.size() + (iLiveId ? 1 : 0); }
+
+    private:
+    class TChunk
+        {
+        public:
+        uint64_t iEnd;
+        uint64_t iId;
+        };
+
+    std::deque<TChunk> iChunk;
+    uint64_t iLiveStart = 0;
+    uint64_t iLiveId = 0;
+    };
+
+}
+
+#endif
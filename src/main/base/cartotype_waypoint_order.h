@@ -0,0 +1,200 @@
+/*
+cartotype_waypoint_order.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_WAYPOINT_ORDER_H__
+#define CARTOTYPE_WAYPOINT_ORDER_H__
+
+#include <cartotype_route_matrix.h>
+#include <cartotype_parallel.h>
+
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <vector>
+
+namespace CartoType
+{
+
+namespace Router
+    {
+    /**
+    Improves the order of waypoints in aOrder, treated as a path from aOrder.front() to aOrder.back(), using 2-opt and Or-opt moves
+    until no move reduces the cost. aCost(aFrom,aTo) gives the cost of travelling between two waypoints, which need not be symmetric.
+    Positions before aFirst and after aLast are not moved.
+    */
+    template<class cost_t> void ImproveWaypointOrder(std::vector<uint32_t>& aOrder,size_t aFirst,size_t aLast,cost_t aCost)
+        {
+        const size_t n = aOrder.size();
+        if (aLast >= n || aFirst >= aLast)
+            return;
+        const double KMinGain = 1e-9;
+        const auto& o = aOrder;
+        // The cost between positions, where a position outside the path costs nothing.
+        auto c = [&](size_t aFrom,size_t aTo) { return aFrom >= n || aTo >= n ? 0 : aCost(o[aFrom],o[aTo]); };
+
+        bool improved = true;
+        while (improved)
+            {
+            improved = false;
+
+            // 2-opt: reverse the section from i to j. Costs along the section are summed in both directions because they may differ.
+            for (size_t i = aFirst; i < aLast; i++)
+                {
+                double forward = 0, reverse = 0;
+                for (size_t j = i + 1; j <= aLast; j++)
+                    {
+                    forward += c(j - 1,j);
+                    reverse += c(j,j - 1);
+                    size_t prev = i - 1, next = j + 1; // prev wraps round to SIZE_MAX if i is zero
+                    double delta = c(prev,j) + c(i,next) + reverse - c(prev,i) - c(j,next) - forward;
+                    if (delta < -KMinGain)
+                        {
+                        std::reverse(aOrder.begin() + i,aOrder.begin() + j + 1);
+                        improved = true;
+                        forward = reverse = 0;
+                        for (size_t k = i + 1; k <= j; k++)
+                            {
+                            forward += c(k - 1,k);
+                            reverse += c(k,k - 1);
+                            }
+                        }
+                    }
+                }
+
+            // Or-opt: move a section of up to three waypoints to another place in the path.
+            for (size_t length = 1; length <= 3; length++)
+                {
+                for (size_t i = aFirst; i + length - 1 <= aLast; i++)
+                    {
+                    size_t end = i + length - 1;
+                    double removal_gain = c(i - 1,i) + c(end,end + 1) - c(i - 1,end + 1);
+                    if (removal_gain <= KMinGain)
+                        continue;
+                    for (size_t q = aFirst; q <= aLast + 1; q++)
+                        {
+                        if (q >= i && q <= end + 1)
+                            continue;
+                        double insertion_cost = c(q - 1,i) + c(end,q) - c(q - 1,q);
+                        if (insertion_cost - removal_gain < -KMinGain)
+                            {
+                            if (q < i)
+                                std::rotate(aOrder.begin() + q,aOrder.begin() + i,aOrder.begin() + end + 1);
+                            else
+                                std::rotate(aOrder.begin() + i,aOrder.begin() + end + 1,aOrder.begin() + q);
+                            improved = true;
+                            break;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+    /**
+    Finds a good order in which to visit the waypoints in aMatrix, which must have the same waypoints as origins and destinations,
+    using only the travel times in the matrix. If aStartFixed is true the route starts at waypoint 0; if aEndFixed is true it ends at the last waypoint.
+
+    The first iteration improves the nearest-neighbour order by local search. Each further iteration perturbs the best order from the first
+    iteration and improves it again. Iterations are run in parallel using up to aThreadCount threads, and are independently seeded,
+    so the result does not depend on the number of threads. Puts the order in aOrder and returns its total time in seconds.
+    */
+    inline double OptimizeWaypointOrder(const CRouteMatrix& aMatrix,bool aStartFixed,bool aEndFixed,size_t aIterations,std::vector<uint32_t>& aOrder,size_t aThreadCount = 0)
+        {
+        const size_t n = aMatrix.OriginCount();
+        aOrder.resize(n);
+        for (uint32_t i = 0; i < n; i++)
+            aOrder[i] = i;
+        if (n < 3 || aMatrix.DestinationCount() != n)
+            return 0;
+
+        // Unreachable pairs are given a large finite cost so that differences between costs remain meaningful.
+        const double KUnreachableCost = 1e12;
+        auto cost = [&aMatrix,KUnreachableCost](uint32_t aFrom,uint32_t aTo)
+            {
+            double t = aMatrix.Time(aFrom,aTo);
+            return t == CRouteMatrix::KUnreachable ? KUnreachableCost : t;
+            };
+        auto path_cost = [&cost](const std::vector<uint32_t>& aPath)
+            {
+            double total = 0;
+            for (size_t i = 1; i < aPath.size(); i++)
+                total += cost(aPath[i - 1],aPath[i]);
+            return total;
+            };
+        const size_t first = aStartFixed ? 1 : 0;
+        const size_t last = aEndFixed ? n - 2 : n - 1;
+
+        // Nearest-neighbour order, starting at the first waypoint, and keeping the last waypoint at the end if it is fixed.
+        std::vector<bool> used(n);
+        used[0] = true;
+        if (aEndFixed)
+            used[n - 1] = true;
+        for (size_t i = 1; i <= last; i++)
+            {
+            uint32_t best = 0;
+            double best_cost = 0;
+            for (uint32_t j = 0; j < n; j++)
+                if (!used[j] && (!best || cost(aOrder[i - 1],j) < best_cost))
+                    {
+                    best = j;
+                    best_cost = cost(aOrder[i - 1],j);
+                    }
+            aOrder[i] = best;
+            used[best] = true;
+            }
+        ImproveWaypointOrder(aOrder,first,last,cost);
+        double best_cost = path_cost(aOrder);
+        if (aIterations <= 1 || last - first < 3)
+            return best_cost;
+
+        const std::vector<uint32_t> start_order = aOrder;
+        size_t best_iteration = 0;
+        std::mutex mutex;
+        ParallelFor(aIterations - 1,[&](size_t aBegin,size_t aEnd)
+            {
+            std::vector<uint32_t> order;
+            for (size_t iteration = aBegin + 1; iteration <= aEnd; iteration++)
+                {
+                // Perturb the order with a double-bridge move, which 2-opt and Or-opt cannot easily undo, or a random reversal if the path is short.
+                // The random number engine is used directly, not through a distribution, so that results are the same on all platforms.
+                std::mt19937 engine { uint32_t(iteration) };
+                order = start_order;
+                size_t count = last - first + 1;
+                if (count >= 8)
+                    {
+                    size_t cut[3];
+                    for (auto& p : cut)
+                        p = 1 + engine() % (count - 1);
+                    std::sort(cut,cut + 3);
+                    if (cut[0] == cut[1] || cut[1] == cut[2])
+                        continue;
+                    auto b = order.begin() + first;
+                    std::rotate(b + cut[0],b + cut[1],b + cut[2]);
+                    }
+                else
+                    {
+                    size_t i = engine() % count, j = engine() % count;
+                    std::reverse(order.begin() + first + std::min(i,j),order.begin() + first + std::max(i,j) + 1);
+                    }
+                ImproveWaypointOrder(order,first,last,cost);
+                double c = path_cost(order);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if (c < best_cost || (c == best_cost && iteration < best_iteration))
+                    {
+                    best_cost = c;
+                    best_iteration = iteration;
+                    aOrder = order;
+                    }
+                }
+            },aThreadCount,1);
+        return best_cost;
+        }
+    }
+
+}
+
+#endif
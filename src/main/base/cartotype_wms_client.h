@@ -0,0 +1,530 @@
+/*
+cartotype_wms_client.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_WMS_CLIENT_H__
+#define CARTOTYPE_WMS_CLIENT_H__
+
+#include <cartotype_bitmap.h>
+#include <cartotype_internet.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace CartoType
+{
+
+/** Parameters for a CWebMapServiceTileLoader. */
+class TWebMapServiceClientParam
+    {
+    public:
+    /** The maximum number of requests made at once, each using its own internet session. */
+    size_t iConnectionCount = 4;
+    /** The width and height of the tiles requested from the server, in pixels. */
+    int32_t iTileSizeInPixels = 256;
+    /** The number of tiles around the visible area which are fetched in advance, so that they are ready when the map is panned. */
+    int32_t iPrefetchBorder = 1;
+    /** The maximum total size in bytes of the decoded tiles kept in memory. */
+    size_t iCacheSizeInBytes = 64 * 1024 * 1024;
+    /** The time in milliseconds after which a tile which could not be fetched is requested again. */
+    int32_t iRetryIntervalInMilliseconds = 30000;
+    /** The maximum number of lower-resolution levels searched for a tile to use while the right one is loading. */
+    int32_t iMaxFallbackLevels = 4;
+    };
+
+/**
+Fetches images from a web map service as tiles, so that they can be loaded concurrently, cached and reused.
+
+The area to be drawn is divided into tiles on a fixed grid, at a resolution which is a power of two in the
+coordinate reference system of the web map service, and not lower than the resolution required.
+Tiles are fetched by a pool of worker threads, each with its own internet session, so that a slow server does not stop the
+map being drawn: Draw composites the tiles that have already arrived, using scaled-up lower-resolution tiles where
+the right ones are not yet available, and requests the rest. Tiles next to the visible area, and at the next lower
+resolution, are then fetched in advance. Requests for tiles no longer needed, after the map has been panned or zoomed,
+are abandoned before they are sent.
+
+Decoded tiles are kept in memory, limited by size, with the least recently used tiles discarded first.
+*/
+class CWebMapServiceTileLoader
+    {
+    public:
+    /** A function to decode the image data fetched from the server. */
+    using TDecodeFunction = std::function<std::unique_ptr<CBitmap>(TResult& aError,MInputStream& aInputStream)>;
+    /** A function called from a worker thread when a tile has arrived, so that the map can be drawn again. */
+    using TTileArrivedFunction = std::function<void()>;
+
+    /**
+    Creates a tile loader which uses aInternetAccessor to create its internet sessions.
+
+    aUrl is the start of the request URL, including all parameters except BBOX, WIDTH and HEIGHT, which are added, followed by aUrlSuffix.
+    If aDecode is null, CBitmap::New is used to decode images.
+    */
+    static std::unique_ptr<CWebMapServiceTileLoader> New(TResult& aError,MInternetAccessor& aInternetAccessor,const std::string& aUrl,const std::string& aUrlSuffix,
+                                                         const TWebMapServiceClientParam& aParam = TWebMapServiceClientParam(),
+                                                         TTileArrivedFunction aTileArrived = nullptr,TDecodeFunction aDecode = nullptr)
+        {
+        aError = KErrorNone;
+        if (aParam.iConnectionCount == 0 || aParam.iTileSizeInPixels <= 0)
+            {
+            aError = KErrorInvalidArgument;
+            return nullptr;
+            }
+        std::vector<std::unique_ptr<CInternetSession>> session;
+        for (size_t i = 0; !aError && i < aParam.iConnectionCount; i++)
+            {
+            session.emplace_back(aInternetAccessor.NewSession(aError));
+            if (!aError && !session.back())
+                aError = KErrorInternetIo;
+            }
+        if (aError)
+            return nullptr;
+
+        std::unique_ptr<CWebMapServiceTileLoader> loader(new CWebMapServiceTileLoader(aUrl,aUrlSuffix,aParam,aTileArrived,aDecode));
+        for (auto& s : session)
+            loader->iThread.emplace_back(&CWebMapServiceTileLoader::Work,loader.get(),std::shared_ptr<CInternetSession>(std::move(s)));
+        return loader;
+        }
+
+    /** Stops the worker threads, waiting for any requests being made to finish. */
+    ~CWebMapServiceTileLoader()
+        {
+            {
+            std::lock_guard<std::mutex> lock(iMutex);
+            iStopping = true;
+            iQueue.clear();
+            }
+        iWorkAvailable.notify_all();
+        for (auto& t : iThread)
+            t.join();
+        }
+    CWebMapServiceTileLoader(const CWebMapServiceTileLoader&) = delete;
+    CWebMapServiceTileLoader& operator=(const CWebMapServiceTileLoader&) = delete;
+
+    /**
+    Draws the tiles covering aBounds, in the coordinate reference system of the web map service, into aBitmap, which must be of type RGBA32.
+    The top row of the bitmap is at aBounds.Bottom(), the maximum Y coordinate. Pixels for which no tile is available are not changed.
+    Tiles which are not available are requested, followed by the tiles to be fetched in advance.
+
+    If aComplete is non-null, it is set to true if all the tiles were available at the right resolution,
+    or false if the map should be drawn again after more tiles have arrived.
+    */
+    TResult Draw(TBitmap& aBitmap,const TRectFP& aBounds,bool* aComplete = nullptr)
+        {
+        if (aComplete)
+            *aComplete = false;
+        if (aBitmap.Type() != TBitmapType::RGBA32)
+            return KErrorUnimplemented;
+        if (aBounds.IsEmpty() || aBitmap.Width() <= 0 || aBitmap.Height() <= 0)
+            return KErrorInvalidArgument;
+
+        TView view(aBitmap,aBounds);
+        const int32_t level = Level(view.iResolutionX);
+        std::vector<TTileKey> visible,wanted;
+        Tiles(visible,aBounds,level,0);
+
+        // Find the tiles while holding the lock, but draw them after releasing it, so that worker threads are not held up.
+        std::vector<TDrawItem> draw_item;
+        bool complete = true;
+        std::unique_lock<std::mutex> lock(iMutex);
+        const auto now = std::chrono::steady_clock::now();
+        for (const auto& key : visible)
+            {
+            const TRectFP tile_bounds = TileBounds(key);
+            std::shared_ptr<const CBitmap> tile = FindInCache(key);
+            TRectFP source_bounds = tile_bounds;
+            if (!tile)
+                {
+                complete = false;
+                if (Wanted(key,now))
+                    wanted.push_back(key);
+                TTileKey parent = key;
+                for (int32_t i = 0; !tile && i < iParam.iMaxFallbackLevels; i++)
+                    {
+                    parent = Parent(parent);
+                    tile = FindInCache(parent);
+                    }
+                source_bounds = TileBounds(parent);
+                }
+            if (tile)
+                draw_item.push_back(TDrawItem { tile,source_bounds,tile_bounds });
+            }
+
+        // Request the tiles at the next lower resolution, then the ones round the edge of the visible area, in advance.
+        std::vector<TTileKey> prefetch;
+        Tiles(prefetch,aBounds,level + 1,0);
+        if (iParam.iPrefetchBorder > 0)
+            Tiles(prefetch,aBounds,level,iParam.iPrefetchBorder);
+        for (const auto& key : prefetch)
+            {
+            if (Wanted(key,now) && !iCacheIndex.count(key) && std::find(wanted.begin(),wanted.end(),key) == wanted.end())
+                wanted.push_back(key);
+            }
+
+        // Replace the queue: requests no longer wanted are abandoned.
+        iQueue = std::move(wanted);
+        std::reverse(iQueue.begin(),iQueue.end());
+        lock.unlock();
+        iWorkAvailable.notify_all();
+
+        for (const auto& item : draw_item)
+            view.DrawTile(*item.iTile,item.iSourceBounds,item.iTileBounds);
+        if (aComplete)
+            *aComplete = complete;
+        return KErrorNone;
+        }
+
+    /** Abandons all requests which have not yet been sent. */
+    void Cancel()
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        iQueue.clear();
+        }
+    /** Deletes all the cached tiles and forgets which tiles could not be fetched. Tiles being fetched when the cache is cleared are discarded when they arrive. */
+    void ClearCache()
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        iCache.clear();
+        iCacheIndex.clear();
+        iCacheSize = 0;
+        iFailed.clear();
+        iGeneration++;
+        }
+    /** Returns the number of tiles waiting to be requested or being requested. */
+    size_t PendingCount() const
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        return iQueue.size() + iInFlight.size();
+        }
+    /** Returns the number of cached tiles. */
+    size_t CachedTileCount() const
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        return iCache.size();
+        }
+    /** Returns the URL used to request a tile with the given bounds. */
+    std::string TileUrl(const TRectFP& aBounds) const
+        {
+        char buffer[160];
+        snprintf(buffer,sizeof(buffer),"BBOX=%.17g,%.17g,%.17g,%.17g&WIDTH=%d&HEIGHT=%d",aBounds.Left(),aBounds.Top(),aBounds.Right(),aBounds.Bottom(),
+                 int(iParam.iTileSizeInPixels),int(iParam.iTileSizeInPixels));
+        std::string url = iUrl;
+        if (url.find('?') == std::string::npos)
+            url += '?';
+        else if (url.back() != '?' && url.back() != '&')
+            url += '&';
+        url += buffer;
+        url += iUrlSuffix;
+        return url;
+        }
+
+    private:
+    /** A tile: its resolution is 2 to the power of iLevel, and its position is given in tiles from the origin. */
+    class TTileKey
+        {
+        public:
+        bool operator==(const TTileKey& aOther) const { return iLevel == aOther.iLevel && iX == aOther.iX && iY == aOther.iY; }
+        int32_t iLevel;
+        int64_t iX;
+        int64_t iY;
+        };
+
+    class THash
+        {
+        public:
+        size_t operator()(const TTileKey& aKey) const
+            {
+            uint64_t h = uint64_t(aKey.iX) * 0x9E3779B97F4A7C15ULL;
+            h ^= uint64_t(aKey.iY) + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+            h ^= uint64_t(uint32_t(aKey.iLevel)) + (h << 6) + (h >> 2);
+            return size_t(h);
+            }
+        };
+
+    class TCacheEntry
+        {
+        public:
+        TTileKey iKey;
+        std::shared_ptr<const CBitmap> iBitmap;
+        };
+
+    /** A tile to be drawn, and the area it covers, which is larger than the area to be drawn if it is a lower-resolution tile. */
+    class TDrawItem
+        {
+        public:
+        std::shared_ptr<const CBitmap> iTile;
+        TRectFP iSourceBounds;
+        TRectFP iTileBounds;
+        };
+
+    /** The destination bitmap and the area it covers. */
+    class TView
+        {
+        public:
+        TView(TBitmap& aBitmap,const TRectFP& aBounds):
+            iBitmap(aBitmap),
+            iBounds(aBounds),
+            iResolutionX(aBounds.Width() / aBitmap.Width()),
+            iResolutionY(aBounds.Height() / aBitmap.Height())
+            {
+            }
+
+        /** Draws the part of aTile, which covers aTileBounds, lying in aClip, using bilinear interpolation. */
+        void DrawTile(const CBitmap& aTile,const TRectFP& aTileBounds,const TRectFP& aClip)
+            {
+            // Pixels are drawn if their centres are in aClip, so that adjacent tiles neither overlap nor leave gaps.
+            const int32_t x0 = std::max(0,int32_t(std::ceil((aClip.Left() - iBounds.Left()) / iResolutionX - 0.5)));
+            const int32_t x1 = std::min(iBitmap.Width(),int32_t(std::ceil((aClip.Right() - iBounds.Left()) / iResolutionX - 0.5)));
+            const int32_t y0 = std::max(0,int32_t(std::ceil((iBounds.Bottom() - aClip.Bottom()) / iResolutionY - 0.5)));
+            const int32_t y1 = std::min(iBitmap.Height(),int32_t(std::ceil((iBounds.Bottom() - aClip.Top()) / iResolutionY - 0.5)));
+            if (x0 >= x1 || y0 >= y1 || aTile.Width() <= 0 || aTile.Height() <= 0)
+                return;
+
+            const double scale_x = aTile.Width() / aTileBounds.Width() * iResolutionX;
+            const double scale_y = aTile.Height() / aTileBounds.Height() * iResolutionY;
+            const double offset_x = (iBounds.Left() - aTileBounds.Left()) / iResolutionX * scale_x - 0.5;
+            const double offset_y = (aTileBounds.Bottom() - iBounds.Bottom()) / iResolutionY * scale_y - 0.5;
+            const int32_t max_x = aTile.Width() - 1;
+            const int32_t max_y = aTile.Height() - 1;
+
+            std::vector<int32_t> sx0(x1 - x0),sx1(x1 - x0),fx(x1 - x0);
+            for (int32_t x = x0; x < x1; x++)
+                {
+                double s = (x + 0.5) * scale_x + offset_x;
+                double f = std::floor(s);
+                sx0[x - x0] = std::clamp(int32_t(f),0,max_x);
+                sx1[x - x0] = std::clamp(int32_t(f) + 1,0,max_x);
+                fx[x - x0] = int32_t((s - f) * 256);
+                }
+            for (int32_t y = y0; y < y1; y++)
+                {
+                double s = (y + 0.5) * scale_y + offset_y;
+                double f = std::floor(s);
+                const uint32_t* row0 = reinterpret_cast<const uint32_t*>(aTile.Data() + std::clamp(int32_t(f),0,max_y) * aTile.RowBytes());
+                const uint32_t* row1 = reinterpret_cast<const uint32_t*>(aTile.Data() + std::clamp(int32_t(f) + 1,0,max_y) * aTile.RowBytes());
+                const uint32_t fy = uint32_t((s - f) * 256);
+                uint32_t* dest = reinterpret_cast<uint32_t*>(iBitmap.Data() + y * iBitmap.RowBytes());
+                for (int32_t x = x0; x < x1; x++)
+                    {
+                    const size_t i = x - x0;
+                    dest[x] = Interpolate(row0[sx0[i]],row0[sx1[i]],row1[sx0[i]],row1[sx1[i]],fx[i],fy);
+                    }
+                }
+            }
+
+        static uint32_t Interpolate(uint32_t aTopLeft,uint32_t aTopRight,uint32_t aBottomLeft,uint32_t aBottomRight,uint32_t aFx,uint32_t aFy)
+            {
+            uint32_t result = 0;
+            for (int shift = 0; shift < 32; shift += 8)
+                {
+                uint32_t top = ((aTopLeft >> shift) & 0xFF) * (256 - aFx) + ((aTopRight >> shift) & 0xFF) * aFx;
+                uint32_t bottom = ((aBottomLeft >> shift) & 0xFF) * (256 - aFx) + ((aBottomRight >> shift) & 0xFF) * aFx;
+                result |= ((top * (256 - aFy) + bottom * aFy + 32768) >> 16) << shift;
+                }
+            return result;
+            }
+
+        TBitmap& iBitmap;
+        TRectFP iBounds;
+        double iResolutionX;
+        double iResolutionY;
+        };
+
+    CWebMapServiceTileLoader(const std::string& aUrl,const std::string& aUrlSuffix,const TWebMapServiceClientParam& aParam,TTileArrivedFunction aTileArrived,TDecodeFunction aDecode):
+        iUrl(aUrl),
+        iUrlSuffix(aUrlSuffix),
+        iParam(aParam),
+        iTileArrived(aTileArrived),
+        iDecode(aDecode)
+        {
+        if (!iDecode)
+            iDecode = [](TResult& aError,MInputStream& aInputStream) { return CBitmap::New(aError,aInputStream); };
+        }
+
+    /** Returns the level of the tiles to use for a resolution: the highest level with a resolution not lower than aResolution. */
+    static int32_t Level(double aResolution)
+        {
+        return int32_t(std::floor(std::log2(aResolution)));
+        }
+    double TileSize(int32_t aLevel) const { return std::ldexp(double(iParam.iTileSizeInPixels),aLevel); }
+    TRectFP TileBounds(const TTileKey& aKey) const
+        {
+        const double size = TileSize(aKey.iLevel);
+        return TRectFP(aKey.iX * size,aKey.iY * size,(aKey.iX + 1) * size,(aKey.iY + 1) * size);
+        }
+    static TTileKey Parent(const TTileKey& aKey)
+        {
+        return TTileKey { aKey.iLevel + 1,aKey.iX >> 1,aKey.iY >> 1 };
+        }
+
+    /**
+    Appends the tiles at aLevel covering aBounds, ordered by distance from the centre. If aBorder is non-zero,
+    appends the tiles in a border aBorder tiles wide round those tiles instead.
+    */
+    void Tiles(std::vector<TTileKey>& aTiles,const TRectFP& aBounds,int32_t aLevel,int32_t aBorder) const
+        {
+        const double size = TileSize(aLevel);
+        const int64_t x0 = int64_t(std::floor(aBounds.Left() / size));
+        const int64_t x1 = int64_t(std::ceil(aBounds.Right() / size)) - 1;
+        const int64_t y0 = int64_t(std::floor(aBounds.Top() / size));
+        const int64_t y1 = int64_t(std::ceil(aBounds.Bottom() / size)) - 1;
+        const double cx = (x0 + x1) / 2.0;
+        const double cy = (y0 + y1) / 2.0;
+        const size_t start = aTiles.size();
+        for (int64_t y = y0 - aBorder; y <= y1 + aBorder; y++)
+            for (int64_t x = x0 - aBorder; x <= x1 + aBorder; x++)
+                {
+                bool inside = x >= x0 && x <= x1 && y >= y0 && y <= y1;
+                if (inside != (aBorder > 0))
+                    aTiles.push_back(TTileKey { aLevel,x,y });
+                }
+        std::stable_sort(aTiles.begin() + start,aTiles.end(),[cx,cy](const TTileKey& aA,const TTileKey& aB)
+            {
+            return (aA.iX - cx) * (aA.iX - cx) + (aA.iY - cy) * (aA.iY - cy) < (aB.iX - cx) * (aB.iX - cx) + (aB.iY - cy) * (aB.iY - cy);
+            });
+        }
+
+    /** Returns true if a tile should be requested: that is, if it is not being requested, and has not failed recently. */
+    bool Wanted(const TTileKey& aKey,std::chrono::steady_clock::time_point aNow)
+        {
+        if (iInFlight.count(aKey))
+            return false;
+        auto f = iFailed.find(aKey);
+        if (f == iFailed.end())
+            return true;
+        if (aNow - f->second < std::chrono::milliseconds(iParam.iRetryIntervalInMilliseconds))
+            return false;
+        iFailed.erase(f);
+        return true;
+        }
+
+    std::shared_ptr<const CBitmap> FindInCache(const TTileKey& aKey)
+        {
+        auto c = iCacheIndex.find(aKey);
+        if (c == iCacheIndex.end())
+            return nullptr;
+        iCache.splice(iCache.begin(),iCache,c->second);
+        return c->second->iBitmap;
+        }
+
+    void AddToCache(const TTileKey& aKey,std::shared_ptr<const CBitmap> aBitmap)
+        {
+        if (iCacheIndex.count(aKey))
+            return;
+        iCache.push_front(TCacheEntry { aKey,aBitmap });
+        iCacheIndex[aKey] = iCache.begin();
+        iCacheSize += aBitmap->DataBytes();
+        while (iCacheSize > iParam.iCacheSizeInBytes && iCache.size() > 1)
+            {
+            iCacheSize -= iCache.back().iBitmap->DataBytes();
+            iCacheIndex.erase(iCache.back().iKey);
+            iCache.pop_back();
+            }
+        }
+
+    /** Fetches and decodes a tile, converting it to RGBA32 if necessary. */
+    std::unique_ptr<CBitmap> Fetch(TResult& aError,CInternetSession& aSession,const TTileKey& aKey)
+        {
+        std::string url = TileUrl(TileBounds(aKey));
+        std::vector<uint16_t> text(url.begin(),url.end());
+        text.push_back(0);
+        aError = KErrorNone;
+        std::unique_ptr<CInternetData> data(aSession.GetData(aError,TText(text.data())));
+        if (!aError && !data)
+            aError = KErrorInternetIo;
+        if (aError)
+            return nullptr;
+        std::unique_ptr<CBitmap> bitmap = iDecode(aError,data->Data());
+        if (!aError && !bitmap)
+            aError = KErrorUnknownDataFormat;
+        if (aError)
+            return nullptr;
+        if (bitmap->Type() != TBitmapType::RGBA32)
+            {
+            auto color_function = bitmap->ColorFunction();
+            auto rgba = std::make_unique<CBitmap>(TBitmapType::RGBA32,bitmap->Width(),bitmap->Height());
+            for (int32_t y = 0; y < bitmap->Height(); y++)
+                {
+                uint32_t* dest = reinterpret_cast<uint32_t*>(rgba->Data() + y * rgba->RowBytes());
+                for (int32_t x = 0; x < bitmap->Width(); x++)
+                    {
+                    TColor c = color_function(*bitmap,x,y);
+                    c.PremultiplyAlpha();
+                    dest[x] = c.iValue;
+                    }
+                }
+            bitmap = std::move(rgba);
+            }
+        return bitmap;
+        }
+
+    void Work(std::shared_ptr<CInternetSession> aSession)
+        {
+        for (;;)
+            {
+            TTileKey key;
+            uint64_t generation = 0;
+                {
+                std::unique_lock<std::mutex> lock(iMutex);
+                iWorkAvailable.wait(lock,[this] { return iStopping || !iQueue.empty(); });
+                if (iStopping)
+                    return;
+                key = iQueue.back();
+                iQueue.pop_back();
+                iInFlight.insert(key);
+                generation = iGeneration;
+                }
+
+            TResult error = KErrorNone;
+            std::unique_ptr<CBitmap> bitmap = Fetch(error,*aSession,key);
+
+                {
+                std::lock_guard<std::mutex> lock(iMutex);
+                iInFlight.erase(key);
+
+                // Discard the result if the cache was cleared while the tile was being fetched, because it may be out of date.
+                if (generation != iGeneration)
+                    continue;
+                if (error)
+                    iFailed[key] = std::chrono::steady_clock::now();
+                else
+                    AddToCache(key,std::move(bitmap));
+                }
+            if (!error && iTileArrived)
+                iTileArrived();
+            }
+        }
+
+    std::string iUrl;
+    std::string iUrlSuffix;
+    TWebMapServiceClientParam iParam;
+    TTileArrivedFunction iTileArrived;
+    TDecodeFunction iDecode;
+    mutable std::mutex iMutex;
+    std::condition_variable iWorkAvailable;
+    bool iStopping = false;
+    std::vector<std::thread> iThread;
+    std::vector<TTileKey> iQueue;       // in reverse order of priority, so that the next tile is at the back
+    std::unordered_set<TTileKey,THash> iInFlight;
+    std::unordered_map<TTileKey,std::chrono::steady_clock::time_point,THash> iFailed;
+    std::list<TCacheEntry> iCache;
+    std::unordered_map<TTileKey,std::list<TCacheEntry>::iterator,THash> iCacheIndex;
+    size_t iCacheSize = 0;
+    uint64_t iGeneration = 0;   // incremented by ClearCache, so that tiles fetched before the cache was cleared are not added to it
+    };
+
+}
+
+#endif
@@ -0,0 +1,465 @@
+/*
+cartotype_wms_server.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_WMS_SERVER_H__
+#define CARTOTYPE_WMS_SERVER_H__
+
+#include <cartotype_framework.h>
+#include <cartotype_parallel.h>
+
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <future>
+#include <list>
+#include <map>
+#include <unordered_map>
+
+namespace CartoType
+{
+
+/** An interface for objects that draw maps in answer to web map service GetMap requests. Each object is used by one thread at a time. */
+class MWebMapServiceRenderer
+    {
+    public:
+    virtual ~MWebMapServiceRenderer() { }
+    /** Handles a GetMap request, putting the encoded image in aData. */
+    virtual TResult GetMap(const char* aWebMapServiceRequest,std::vector<uint8_t>& aData) = 0;
+    };
+
+/** A web map service renderer using a framework. */
+class CFrameworkWebMapServiceRenderer: public MWebMapServiceRenderer
+    {
+    public:
+    /** Creates a renderer using a framework, which is owned by the renderer. */
+    explicit CFrameworkWebMapServiceRenderer(std::unique_ptr<CFramework> aFramework): iFramework(std::move(aFramework)) { }
+    TResult GetMap(const char* aWebMapServiceRequest,std::vector<uint8_t>& aData) override
+        {
+        return iFramework->WebMapServiceGetMap(aWebMapServiceRequest,aData);
+        }
+
+    private:
+    std::unique_ptr<CFramework> iFramework;
+    };
+
+/** Parameters for a CWebMapServiceServer. */
+class TWebMapServiceServerParam
+    {
+    public:
+    /** The number of worker threads, each with its own renderer. If it is zero, DefaultThreadCount() is used. */
+    size_t iThreadCount = 0;
+    /**
+    The maximum number of distinct requests waiting to be drawn. When it is reached, new requests which cannot be
+    answered from the cache or joined to a request already waiting or being drawn are rejected immediately with
+    the error KErrorOverflow, so that the server does not accept more work than it can do.
+    */
+    size_t iMaxQueueLength = 64;
+    /**
+    The maximum time in milliseconds a request may wait before drawing starts. Requests waiting longer are not drawn,
+    because the client has probably given up, and fail with the error KErrorCancel. If it is zero, there is no limit.
+    */
+    int32_t iMaxQueueTimeInMilliseconds = 10000;
+    /** The maximum total size in bytes of the cached responses. If it is zero, responses are not cached. */
+    size_t iCacheSizeInBytes = 64 * 1024 * 1024;
+    };
+
+/** Statistics about the requests handled by a CWebMapServiceServer. */
+class TWebMapServiceServerStatistics
+    {
+    public:
+    /** The number of requests received. */
+    uint64_t iRequestCount = 0;
+    /** The number of requests answered from the cache. */
+    uint64_t iCacheHitCount = 0;
+    /** The number of requests joined to an identical request already waiting or being drawn. */
+    uint64_t iCoalescedCount = 0;
+    /** The number of maps drawn. */
+    uint64_t iDrawCount = 0;
+    /** The number of requests rejected because the queue was full. */
+    uint64_t iRejectedCount = 0;
+    /** The number of requests abandoned because they waited too long. */
+    uint64_t iExpiredCount = 0;
+    };
+
+/** The response to a web map service request. The data is shared between all requests answered by the same drawing operation. */
+class CWebMapServiceResponse
+    {
+    public:
+    /** The error code: KErrorNone if the request succeeded. */
+    TResult iError = KErrorNone;
+    /** The encoded image, or null if there was an error. */
+    std::shared_ptr<const std::vector<uint8_t>> iData;
+    };
+
+/**
+A web map service request handler which serves GetMap requests concurrently.
+
+Requests are drawn by a pool of worker threads, each with its own renderer, normally a copy of a framework,
+so that requests do not have to wait for each other. Identical requests, after normalization by NormalizeRequest,
+are drawn only once: a request identical to one already waiting or being drawn gets the same response,
+and recent responses are kept in a cache limited by size. Under overload, requests are rejected rather than queued
+indefinitely: see TWebMapServiceServerParam.
+
+The handler does no network input or output: requests are passed to it as strings and the responses
+are returned as data, so it can be used behind any HTTP server, or tested without one.
+*/
+class CWebMapServiceServer
+    {
+    public:
+    /** A function to create a renderer for a worker thread. */
+    using TRendererFactory = std::function<std::unique_ptr<MWebMapServiceRenderer>(TResult& aError)>;
+
+    /** Creates a handler with renderers created by aFactory, one per worker thread. */
+    static std::unique_ptr<CWebMapServiceServer> New(TResult& aError,TRendererFactory aFactory,const TWebMapServiceServerParam& aParam = TWebMapServiceServerParam())
+        {
+        std::unique_ptr<CWebMapServiceServer> server(new CWebMapServiceServer(aParam));
+        const size_t thread_count = aParam.iThreadCount ? aParam.iThreadCount : DefaultThreadCount();
+        std::vector<std::unique_ptr<MWebMapServiceRenderer>> renderer;
+        aError = KErrorNone;
+        for (size_t i = 0; !aError && i < thread_count; i++)
+            {
+            renderer.push_back(aFactory(aError));
+            if (!aError && !renderer.back())
+                aError = KErrorNoMemory;
+            }
+        if (aError)
+            return nullptr;
+        for (auto& r : renderer)
+            server->iThread.emplace_back(&CWebMapServiceServer::Work,server.get(),std::shared_ptr<MWebMapServiceRenderer>(std::move(r)));
+        return server;
+        }
+
+    /** Creates a handler using copies of aFramework, one per worker thread. aFramework is not used after this function returns. */
+    static std::unique_ptr<CWebMapServiceServer> New(TResult& aError,const CFramework& aFramework,const TWebMapServiceServerParam& aParam = TWebMapServiceServerParam())
+        {
+        auto factory = [&aFramework](TResult& aError) -> std::unique_ptr<MWebMapServiceRenderer>
+            {
+            auto f = aFramework.Copy(aError);
+            if (aError)
+                return nullptr;
+            return std::make_unique<CFrameworkWebMapServiceRenderer>(std::move(f));
+            };
+        return New(aError,factory,aParam);
+        }
+
+    /** Stops the worker threads. Requests still waiting fail with the error KErrorCancel. */
+    ~CWebMapServiceServer()
+        {
+        std::deque<std::shared_ptr<CJob>> abandoned;
+            {
+            std::lock_guard<std::mutex> lock(iMutex);
+            iStopping = true;
+            abandoned.swap(iQueue);
+            }
+        iWorkAvailable.notify_all();
+        for (auto& t : iThread)
+            t.join();
+        for (auto& job : abandoned)
+            Finish(*job,CWebMapServiceResponse { KErrorCancel,nullptr });
+        }
+    CWebMapServiceServer(const CWebMapServiceServer&) = delete;
+    CWebMapServiceServer& operator=(const CWebMapServiceServer&) = delete;
+
+    /**
+    Starts handling a request, which is the query part of a web map service URL, with or without a leading '?'.
+    Returns a future giving the response. Responses from the cache, and rejections, are available immediately.
+    */
+    std::shared_future<CWebMapServiceResponse> Request(const std::string& aWebMapServiceRequest)
+        {
+        std::string key = NormalizeRequest(aWebMapServiceRequest);
+        std::unique_lock<std::mutex> lock(iMutex);
+        iStatistics.iRequestCount++;
+
+        if (iParam.iCacheSizeInBytes)
+            {
+            auto c = iCacheIndex.find(key);
+            if (c != iCacheIndex.end())
+                {
+                iStatistics.iCacheHitCount++;
+                iCache.splice(iCache.begin(),iCache,c->second);
+                return ReadyResponse(CWebMapServiceResponse { KErrorNone,c->second->iData });
+                }
+            }
+
+        // Requests made after the cache was cleared must not share a job started before that, which may use old data.
+        auto p = iInFlight.find(key);
+        if (p != iInFlight.end() && p->second->iGeneration == iGeneration)
+            {
+            iStatistics.iCoalescedCount++;
+            return p->second->iFuture;
+            }
+
+        if (iStopping || iQueue.size() >= iParam.iMaxQueueLength)
+            {
+            iStatistics.iRejectedCount++;
+            return ReadyResponse(CWebMapServiceResponse { iStopping ? KErrorCancel : KErrorOverflow,nullptr });
+            }
+
+        auto job = std::make_shared<CJob>();
+        job->iKey = key;
+        job->iRequest = aWebMapServiceRequest;
+        job->iFuture = job->iPromise.get_future().share();
+        job->iQueueTime = std::chrono::steady_clock::now();
+        job->iGeneration = iGeneration;
+        iInFlight[key] = job;
+        iQueue.push_back(job);
+        lock.unlock();
+        iWorkAvailable.notify_one();
+        return job->iFuture;
+        }
+
+    /** Handles a request synchronously, putting the encoded image in aData. */
+    TResult GetMap(const std::string& aWebMapServiceRequest,std::vector<uint8_t>& aData)
+        {
+        CWebMapServiceResponse r = Request(aWebMapServiceRequest).get();
+        if (!r.iError)
+            aData = *r.iData;
+        return r.iError;
+        }
+
+    /** Deletes all cached responses: for example, after the map data or style sheet used by the renderers has changed. */
+    void ClearCache()
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        iCache.clear();
+        iCacheIndex.clear();
+        iCacheSize = 0;
+        iGeneration++;
+        }
+
+    /** Returns statistics about the requests handled so far. */
+    TWebMapServiceServerStatistics Statistics() const
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        return iStatistics;
+        }
+
+    /** Returns the number of worker threads. */
+    size_t ThreadCount() const { return iThread.size(); }
+
+    /**
+    Returns a normalized form of a web map service request, used to identify identical requests.
+    Parameter names, which are case-insensitive, are converted to upper case, and the parameters are sorted by name.
+    Values are URL-decoded; the values of SERVICE, REQUEST, FORMAT and EXCEPTIONS, which are case-insensitive, are converted
+    to lower case, and numbers in BBOX, WIDTH and HEIGHT are written in a standard form.
+    */
+    static std::string NormalizeRequest(const std::string& aWebMapServiceRequest)
+        {
+        std::map<std::string,std::string> param;
+        size_t pos = 0;
+        if (!aWebMapServiceRequest.empty() && aWebMapServiceRequest[0] == '?')
+            pos = 1;
+        while (pos < aWebMapServiceRequest.size())
+            {
+            size_t end = aWebMapServiceRequest.find('&',pos);
+            if (end == std::string::npos)
+                end = aWebMapServiceRequest.size();
+            size_t eq = aWebMapServiceRequest.find('=',pos);
+            if (eq > end)
+                eq = end;
+            std::string name = UrlDecode(aWebMapServiceRequest.substr(pos,eq - pos));
+            std::string value = eq < end ? UrlDecode(aWebMapServiceRequest.substr(eq + 1,end - eq - 1)) : std::string();
+            for (auto& c : name)
+                c = char(toupper((unsigned char)c));
+            if (!name.empty())
+                {
+                if (name == "SERVICE" || name == "REQUEST" || name == "FORMAT" || name == "EXCEPTIONS")
+                    {
+                    for (auto& c : value)
+                        c = char(tolower((unsigned char)c));
+                    }
+                else if (name == "BBOX" || name == "WIDTH" || name == "HEIGHT")
+                    value = NormalizeNumbers(value);
+                param[name] = value;
+                }
+            pos = end + 1;
+            }
+
+        std::string key;
+        for (const auto& p : param)
+            {
+            if (!key.empty())
+                key += '&';
+            key += p.first;
+            key += '=';
+            key += p.second;
+            }
+        return key;
+        }
+
+    private:
+    class CJob
+        {
+        public:
+        std::string iKey;
+        std::string iRequest;
+        std::promise<CWebMapServiceResponse> iPromise;
+        std::shared_future<CWebMapServiceResponse> iFuture;
+        std::chrono::steady_clock::time_point iQueueTime;
+        uint64_t iGeneration = 0;
+        };
+
+    class TCacheEntry
+        {
+        public:
+        std::string iKey;
+        std::shared_ptr<const std::vector<uint8_t>> iData;
+        };
+
+    explicit CWebMapServiceServer(const TWebMapServiceServerParam& aParam):
+        iParam(aParam)
+        {
+        }
+
+    static std::shared_future<CWebMapServiceResponse> ReadyResponse(const CWebMapServiceResponse& aResponse)
+        {
+        std::promise<CWebMapServiceResponse> promise;
+        promise.set_value(aResponse);
+        return promise.get_future().share();
+        }
+
+    static std::string UrlDecode(const std::string& aText)
+        {
+        std::string s;
+        for (size_t i = 0; i < aText.size(); i++)
+            {
+            if (aText[i] == '+')
+                s += ' ';
+            else if (aText[i] == '%' && i + 2 < aText.size() && isxdigit((unsigned char)aText[i + 1]) && isxdigit((unsigned char)aText[i + 2]))
+                {
+                s += char(strtol(aText.substr(i + 1,2).c_str(),nullptr,16));
+                i += 2;
+                }
+            else
+                s += aText[i];
+            }
+        return s;
+        }
+
+    /** Writes each comma-separated number in a standard form, so that, for example, '10', '10.0' and '1e1' are the same. */
+    static std::string NormalizeNumbers(const std::string& aText)
+        {
+        std::string s;
+        size_t pos = 0;
+        for (;;)
+            {
+            size_t end = aText.find(',',pos);
+            if (end == std::string::npos)
+                end = aText.size();
+            std::string item = aText.substr(pos,end - pos);
+            char* item_end = nullptr;
+            double value = strtod(item.c_str(),&item_end);
+            if (!item.empty() && item_end && *item_end == 0)
+                {
+                char buffer[32];
+                snprintf(buffer,sizeof(buffer),"%.17g",value == 0 ? 0.0 : value);
+                item = buffer;
+                }
+            s += item;
+            if (end == aText.size())
+                break;
+            s += ',';
+            pos = end + 1;
+            }
+        return s;
+        }
+
+    void Work(std::shared_ptr<MWebMapServiceRenderer> aRenderer)
+        {
+        for (;;)
+            {
+            std::shared_ptr<CJob> job;
+            uint64_t generation = 0;
+                {
+                std::unique_lock<std::mutex> lock(iMutex);
+                iWorkAvailable.wait(lock,[this] { return iStopping || !iQueue.empty(); });
+                if (iStopping)
+                    return;
+                job = iQueue.front();
+                iQueue.pop_front();
+                generation = iGeneration;
+                if (iParam.iMaxQueueTimeInMilliseconds > 0 &&
+                    std::chrono::steady_clock::now() - job->iQueueTime > std::chrono::milliseconds(iParam.iMaxQueueTimeInMilliseconds))
+                    {
+                    iStatistics.iExpiredCount++;
+                    auto p = iInFlight.find(job->iKey);
+                    if (p != iInFlight.end() && p->second == job)
+                        iInFlight.erase(p);
+                    lock.unlock();
+                    job->iPromise.set_value(CWebMapServiceResponse { KErrorCancel,nullptr });
+                    continue;
+                    }
+                iStatistics.iDrawCount++;
+                }
+
+            auto data = std::make_shared<std::vector<uint8_t>>();
+            TResult error = aRenderer->GetMap(job->iRequest.c_str(),*data);
+            CWebMapServiceResponse response { error,nullptr };
+            if (!error)
+                {
+                response.iData = data;
+                // Don't cache responses drawn before the cache was cleared: they may use old data.
+                std::lock_guard<std::mutex> lock(iMutex);
+                if (generation == iGeneration)
+                    AddToCache(job->iKey,response.iData);
+                }
+            Finish(*job,response);
+            }
+        }
+
+    void Finish(CJob& aJob,const CWebMapServiceResponse& aResponse)
+        {
+            {
+            std::lock_guard<std::mutex> lock(iMutex);
+            auto p = iInFlight.find(aJob.iKey);
+            if (p != iInFlight.end() && p->second.get() == &aJob)
+                iInFlight.erase(p);
+            }
+        aJob.iPromise.set_value(aResponse);
+        }
+
+    void AddToCache(const std::string& aKey,std::shared_ptr<const std::vector<uint8_t>> aData)
+        {
+        if (aData->size() > iParam.iCacheSizeInBytes)
+            return;
+        auto c = iCacheIndex.find(aKey);
+        if (c != iCacheIndex.end())
+            {
+            iCacheSize -= c->second->iData->size();
+            iCache.erase(c->second);
+            iCacheIndex.erase(c);
+            }
+        iCache.push_front(TCacheEntry { aKey,aData });
+        iCacheIndex[aKey] = iCache.begin();
+        iCacheSize += aData->size();
+        while (iCacheSize > iParam.iCacheSizeInBytes)
+            {
+            iCacheSize -= iCache.back().iData->size();
+            iCacheIndex.erase(iCache.back().iKey);
+            iCache.pop_back();
+            }
+        }
+
+    TWebMapServiceServerParam iParam;
+    mutable std::mutex iMutex;
+    std::condition_variable iWorkAvailable;
+    bool iStopping = false;
+    std::vector<std::thread> iThread;
+    std::deque<std::shared_ptr<CJob>> iQueue;
+    std::unordered_map<std::string,std::shared_ptr<CJob>> iInFlight;
+    std::list<TCacheEntry> iCache;
+    std::unordered_map<std::string,std::list<TCacheEntry>::iterator> iCacheIndex;
+    size_t iCacheSize = 0;
+    uint64_t iGeneration = 0;
+    TWebMapServiceServerStatistics iStatistics;
+    };
+
+}
+
+#endif
@@ -0,0 +1,704 @@
+/*
+cartotype_xml_import.h
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#ifndef CARTOTYPE_XML_IMPORT_H__
+#define CARTOTYPE_XML_IMPORT_H__
+
+#include <cartotype_geometry.h>
+#include <cartotype_stream.h>
+
+#include <algorithm>
+#include <functional>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+namespace CartoType
+{
+
+/** An array of XML attributes as name-value pairs, with entities decoded. */
+using CXmlAttributeArray = std::vector<std::pair<std::string,std::string>>;
+
+/** An interface to receive the contents of an XML document as it is parsed. All text is UTF-8. */
+class MXmlHandler
+    {
+    public:
+    virtual ~MXmlHandler() { }
+    /** Handles the start of an element. */
+    virtual TResult StartElement(const std::string& aName,const CXmlAttributeArray& aAttributes) = 0;
+    /** Handles the end of an element. */
+    virtual TResult EndElement(const std::string& aName) = 0;
+    /** Handles some character data. The text of a single element may be passed in several pieces. */
+    virtual TResult Text(const char* aText,size_t aLength) = 0;
+    };
+
+/**
+A streaming XML parser, which reads a document in chunks and passes elements and text to an MXmlHandler as they are completed.
+Unlike a parser which builds a document tree, its memory use does not depend on the size of the document, so that files
+of many gigabytes can be read. Only UTF-8 documents are supported; namespace prefixes are passed to the handler unchanged;
+comments, processing instructions, document type declarations and text outside the root element are ignored.
+*/
+class CXmlStreamParser
+    {
+    public:
+    /** A function called with the number of bytes read so far and the length of the stream, or -1 if unknown; it returns false to cancel parsing. */
+    using TProgressCallBack = std::function<bool(int64_t aBytesRead,int64_t aLength)>;
+
+    /** The maximum length of an element tag, comment or other markup in bytes. */
+    static constexpr size_t KMaxMarkupLength = 4 * 1024 * 1024;
+    /** The length of text after which it is passed to the handler even if the element is not yet complete. */
+    static constexpr size_t KMaxPendingTextLength = 64 * 1024;
+
+    /** Creates a parser which passes the contents of a document to aHandler. */
+    explicit CXmlStreamParser(MXmlHandler& aHandler): iHandler(aHandler) { }
+
+    /**
+    Parses an entire document from aInput. If aProgress is non-null it is called at intervals of roughly
+    aProgressInterval bytes, and at the end; if it returns false parsing stops and KErrorCancel is returned.
+    */
+    TResult Parse(MInputStream& aInput,TProgressCallBack aProgress = nullptr,int64_t aProgressInterval = 1024 * 1024)
+        {
+        iBuffer.clear();
+        iElement.clear();
+        iRootFound = false;
+        TResult error = KErrorNone;
+        int64_t length = aInput.Length(error);
+        if (error)
+            length = -1;
+        error = KErrorNone;
+        int64_t bytes_read = 0;
+        int64_t next_progress = aProgressInterval;
+        while (!aInput.EndOfStream())
+            {
+            const uint8_t* p = nullptr;
+            size_t n = 0;
+            error = aInput.Read(p,n);
+            if (error)
+                return error;
+            if (!n)
+                break;
+            bytes_read += n;
+            iBuffer.append((const char*)p,n);
+            error = ParseBuffer(false);
+            if (error)
+                return error;
+            if (aProgress && bytes_read >= next_progress)
+                {
+                if (!aProgress(bytes_read,length))
+                    return KErrorCancel;
+                next_progress = bytes_read + aProgressInterval;
+                }
+            }
+        error = ParseBuffer(true);
+        if (!error && (!iRootFound || !iElement.empty()))
+            error = KErrorCorrupt;
+        if (!error && aProgress && !aProgress(bytes_read,length))
+            error = KErrorCancel;
+        return error;
+        }
+
+    /** Decodes the XML entities in some text and appends the result to aDest. Unknown entities are left unchanged. */
+    static void AppendDecodedText(std::string& aDest,const char* aText,size_t aLength)
+        {
+        const char* end = aText + aLength;
+        while (aText < end)
+            {
+            const char* amp = (const char*)memchr(aText,'&',end - aText);
+            if (!amp)
+                {
+                aDest.append(aText,end);
+                return;
+                }
+            aDest.append(aText,amp);
+            const char* semicolon = (const char*)memchr(amp,';',end - amp);
+            if (!semicolon)
+                {
+                aDest.append(amp,end);
+                return;
+                }
+            std::string entity(amp + 1,semicolon);
+            if (entity == "lt") aDest += '<';
+            else if (entity == "gt") aDest += '>';
+            else if (entity == "amp") aDest += '&';
+            else if (entity == "quot") aDest += '"';
+            else if (entity == "apos") aDest += '\'';
+            else if (entity.size() > 1 && entity[0] == '#')
+                {
+                bool hex = entity[1] == 'x' || entity[1] == 'X';
+                uint32_t c = uint32_t(strtoul(entity.c_str() + (hex ? 2 : 1),nullptr,hex ? 16 : 10));
+                AppendUtf8(aDest,c);
+                }
+            else
+                aDest.append(amp,semicolon + 1);
+            aText = semicolon + 1;
+            }
+        }
+
+    private:
+    static void AppendUtf8(std::string& aDest,uint32_t aChar)
+        {
+        if (aChar < 0x80)
+            aDest += char(aChar);
+        else if (aChar < 0x800)
+            {
+            aDest += char(0xC0 | (aChar >> 6));
+            aDest += char(0x80 | (aChar & 0x3F));
+            }
+        else if (aChar < 0x10000)
+            {
+            aDest += char(0xE0 | (aChar >> 12));
+            aDest += char(0x80 | ((aChar >> 6) & 0x3F));
+            aDest += char(0x80 | (aChar & 0x3F));
+            }
+        else if (aChar < 0x110000)
+            {
+            aDest += char(0xF0 | (aChar >> 18));
+            aDest += char(0x80 | ((aChar >> 12) & 0x3F));
+            aDest += char(0x80 | ((aChar >> 6) & 0x3F));
+            aDest += char(0x80 | (aChar & 0x3F));
+            }
+        }
+
+    static bool IsSpace(char aChar) { return aChar == ' ' || aChar == '\t' || aChar == '\r' || aChar == '\n'; }
+
+    /** Parses as much of the buffer as possible, then discards the parsed part. If aEnd is true there is no more data. */
+    TResult ParseBuffer(bool aEnd)
+        {
+        size_t pos = 0;
+        TResult error = KErrorNone;
+        while (!error && pos < iBuffer.size())
+            {
+            if (iBuffer[pos] != '<')
+                {
+                size_t end = iBuffer.find('<',pos);
+                if (end == std::string::npos)
+                    {
+                    if (!aEnd && iBuffer.size() - pos < KMaxPendingTextLength)
+                        break;
+                    end = iBuffer.size();
+
+                    // Don't split an entity between two pieces of text.
+                    size_t amp = iBuffer.rfind('&');
+                    if (!aEnd && amp != std::string::npos && amp >= pos && iBuffer.find(';',amp) == std::string::npos)
+                        {
+                        if (amp == pos)
+                            return KErrorCorrupt;
+                        end = amp;
+                        }
+                    }
+                error = HandleText(iBuffer.data() + pos,end - pos,true);
+                pos = end;
+                continue;
+                }
+
+            size_t end = FindMarkupEnd(pos,aEnd);
+            if (end == std::string::npos)
+                {
+                if (aEnd || iBuffer.size() - pos > KMaxMarkupLength)
+                    return KErrorCorrupt;
+                break;
+                }
+            error = HandleMarkup(pos,end);
+            pos = end;
+            }
+        iBuffer.erase(0,pos);
+        return error;
+        }
+
+    /** Returns the position after the markup starting at aPos, or npos if it is incomplete. */
+    size_t FindMarkupEnd(size_t aPos,bool aEnd) const
+        {
+        const size_t n = iBuffer.size();
+        if (!aEnd && n - aPos < 9)
+            return std::string::npos;
+        auto find_end = [&](const char* aTerminator,size_t aStart) -> size_t
+            {
+            size_t p = iBuffer.find(aTerminator,aStart);
+            return p == std::string::npos ? p : p + strlen(aTerminator);
+            };
+        if (!iBuffer.compare(aPos,4,"<!--"))
+            return find_end("-->",aPos + 4);
+        if (!iBuffer.compare(aPos,9,"<![CDATA["))
+            return find_end("]]>",aPos + 9);
+        if (!iBuffer.compare(aPos,2,"<?"))
+            return find_end("?>",aPos + 2);
+
+        // Find the closing '>' of a tag or declaration, ignoring quoted text and a bracketed internal subset.
+        char quote = 0;
+        int bracket_depth = 0;
+        for (size_t p = aPos + 1; p < n; p++)
+            {
+            char c = iBuffer[p];
+            if (quote)
+                {
+                if (c == quote)
+                    quote = 0;
+                }
+            else if (c == '"' || c == '\'')
+                quote = c;
+            else if (c == '[')
+                bracket_depth++;
+            else if (c == ']')
+                bracket_depth--;
+            else if (c == '>' && bracket_depth <= 0)
+                return p + 1;
+            }
+        return std::string::npos;
+        }
+
+    TResult HandleText(const char* aText,size_t aLength,bool aDecode)
+        {
+        // Ignore text outside the root element, which can only be white space.
+        if (iElement.empty())
+            return KErrorNone;
+        iText.clear();
+        if (aDecode)
+            AppendDecodedText(iText,aText,aLength);
+        else
+            iText.assign(aText,aLength);
+        return iHandler.Text(iText.data(),iText.size());
+        }
+
+    TResult HandleMarkup(size_t aStart,size_t aEnd)
+        {
+        const char* p = iBuffer.data() + aStart;
+        const char* end = iBuffer.data() + aEnd - 1;
+        if (p[1] == '!')
+            {
+            if (end - p >= 11 && !memcmp(p,"<![CDATA[",9))
+                return HandleText(p + 9,end - p - 11,false);
+            return KErrorNone;
+            }
+        if (p[1] == '?')
+            return KErrorNone;
+
+        if (p[1] == '/')
+            {
+            const char* name_start = p + 2;
+            const char* name_end = name_start;
+            while (name_end < end && !IsSpace(*name_end))
+                name_end++;
+            if (iElement.empty() || iElement.back().compare(0,std::string::npos,name_start,name_end - name_start))
+                return KErrorCorrupt;
+            TResult error = iHandler.EndElement(iElement.back());
+            iElement.pop_back();
+            return error;
+            }
+
+        bool empty_element = end[-1] == '/';
+        if (empty_element)
+            end--;
+        const char* q = p + 1;
+        while (q < end && !IsSpace(*q))
+            q++;
+        if (q == p + 1)
+            return KErrorCorrupt;
+        if (iElement.empty() && iRootFound)
+            return KErrorCorrupt;
+        iRootFound = true;
+        iElement.emplace_back(p + 1,q);
+
+        iAttribute.clear();
+        for (;;)
+            {
+            while (q < end && IsSpace(*q))
+                q++;
+            if (q == end)
+                break;
+            const char* name_start = q;
+            while (q < end && *q != '=' && !IsSpace(*q))
+                q++;
+            const char* name_end = q;
+            while (q < end && IsSpace(*q))
+                q++;
+            if (q == end || *q != '=')
+                return KErrorCorrupt;
+            q++;
+            while (q < end && IsSpace(*q))
+                q++;
+            if (q == end || (*q != '"' && *q != '\''))
+                return KErrorCorrupt;
+            const char* value_end = (const char*)memchr(q + 1,*q,end - q - 1);
+            if (!value_end)
+                return KErrorCorrupt;
+            iAttribute.emplace_back(std::string(name_start,name_end),std::string());
+            AppendDecodedText(iAttribute.back().second,q + 1,value_end - q - 1);
+            q = value_end + 1;
+            }
+
+        TResult error = iHandler.StartElement(iElement.back(),iAttribute);
+        if (!error && empty_element)
+            {
+            error = iHandler.EndElement(iElement.back());
+            iElement.pop_back();
+            }
+        return error;
+        }
+
+    MXmlHandler& iHandler;
+    std::string iBuffer;
+    std::string iText;
+    std::vector<std::string> iElement;
+    CXmlAttributeArray iAttribute;
+    bool iRootFound = false;
+    };
+
+/** Parameters for importing map objects from GPX or KML. */
+class TXmlImportParam
+    {
+    public:
+    /** The number of map objects passed to the batch function at a time. */
+    size_t iBatchSize = 1024;
+    /** The maximum length in bytes of a name or description; longer text is truncated. */
+    size_t iMaxTextLength = 64 * 1024;
+    /** If non-null, a function called to report progress, which returns false to cancel importing. */
+    CXmlStreamParser::TProgressCallBack iProgressCallBack;
+    /** The approximate interval in bytes between calls to the progress function. */
+    int64_t iProgressInterval = 1024 * 1024;
+    };
+
+/** A map object read from a GPX or KML file. */
+class CImportedMapObject
+    {
+    public:
+    /** The type of the object: point, line or polygon. */
+    TMapObjectType iType = TMapObjectType::Point;
+    /** The geometry in degrees of longitude and latitude. */
+    CGeometry iGeometry { TCoordType::Degree };
+    /** The string attributes, as UTF-8, in the form used by CFramework::InsertMapObject: label|key1=value1|key2=value2 etc. */
+    std::string iStringAttributes;
+    };
+
+/** A function to receive a batch of map objects when importing GPX or KML. It may move the objects out of the array. */
+using ImportBatchCallBack = std::function<TResult(std::vector<CImportedMapObject>& aBatch)>;
+
+/**
+An XML handler which creates map objects from GPX or KML, passing them to a function in batches.
+GPX waypoints become points, and routes and tracks become lines, with one contour per track segment.
+KML placemarks become points, lines or polygons, with inner boundaries as extra contours, and with
+one object for each part of a multi-geometry. The name and description become the label and the
+'desc' attribute.
+*/
+class CXmlMapImporter: public MXmlHandler
+    {
+    public:
+    /** Creates an importer which passes objects to aCallBack in batches. */
+    CXmlMapImporter(const TXmlImportParam& aParam,ImportBatchCallBack aCallBack):
+        iParam(aParam),
+        iCallBack(aCallBack)
+        {
+        }
+
+    /** Returns the file type found from the root element: TFileType::GPX, TFileType::KML, or TFileType::None if it is not yet known. */
+    TFileType FileType() const { return iFileType; }
+    /** Returns the number of objects created so far. */
+    uint64_t ObjectCount() const { return iObjectCount; }
+
+    /** Passes any remaining objects to the batch function. This must be called after parsing the document. */
+    TResult Finish()
+        {
+        TResult error = KErrorNone;
+        if (!iBatch.empty())
+            error = iCallBack(iBatch);
+        iBatch.clear();
+        return error;
+        }
+
+    // virtual functions from MXmlHandler
+    TResult StartElement(const std::string& aName,const CXmlAttributeArray& aAttributes) override
+        {
+        std::string name = LocalName(aName);
+        const std::string parent = iElement.empty() ? std::string() : iElement.back();
+        iElement.push_back(name);
+        iText = nullptr;
+
+        if (iElement.size() == 1)
+            {
+            if (name == "gpx")
+                iFileType = TFileType::GPX;
+            else if (name == "kml")
+                iFileType = TFileType::KML;
+            else
+                return KErrorUnknownDataFormat;
+            return KErrorNone;
+            }
+
+        if (iFileType == TFileType::GPX)
+            {
+            if (name == "wpt" || name == "rte" || name == "trk")
+                {
+                BeginObject(name == "wpt" ? TMapObjectType::Point : TMapObjectType::Line);
+                iObjectElement = name;
+                if (name == "wpt")
+                    AppendGpxPoint(aAttributes);
+                }
+            else if (iInObject && (name == "rtept" || name == "trkpt"))
+                AppendGpxPoint(aAttributes);
+            else if (iInObject && name == "trkseg")
+                iGeometry.BeginContour();
+            else if (iInObject && parent == iObjectElement)
+                CaptureText(name);
+            }
+        else
+            {
+            if (name == "Placemark")
+                {
+                BeginObject(TMapObjectType::Point);
+                iPlacemarkGeometry.clear();
+                }
+            else if (!iInObject)
+                return KErrorNone;
+            else if (parent == "Placemark" && (name == "name" || name == "description"))
+                CaptureText(name);
+            else if (name == "Point" || name == "LineString" || name == "Track" || name == "Polygon" || (name == "LinearRing" && !iInPolygon))
+                {
+                iGeometry = CGeometry(TCoordType::Degree,name == "Polygon" || name == "LinearRing");
+                iType = name == "Point" ? TMapObjectType::Point : iGeometry.IsClosed() ? TMapObjectType::Polygon : TMapObjectType::Line;
+                iInPolygon = name == "Polygon";
+                }
+            else if (name == "LinearRing")
+                iGeometry.BeginContour();
+            else if (name == "coordinates" || (name == "coord" && parent == "Track"))
+                {
+                iCoordinates.clear();
+                iInCoordinates = true;
+                iCoordinateSeparatorIsComma = name == "coordinates";
+                }
+            }
+        return KErrorNone;
+        }
+
+    TResult EndElement(const std::string& aName) override
+        {
+        std::string name = LocalName(aName);
+        iElement.pop_back();
+        iText = nullptr;
+        if (!iInObject)
+            return KErrorNone;
+
+        if (iFileType == TFileType::GPX)
+            {
+            if (name == iObjectElement && iElement.size() == 1)
+                return EndObject();
+            }
+        else
+            {
+            if (iInCoordinates && (name == "coordinates" || name == "coord"))
+                {
+                ParseCoordinates(true);
+                iInCoordinates = false;
+                }
+            else if (name == "Point" || name == "LineString" || name == "Track" || name == "Polygon" || (name == "LinearRing" && !iInPolygon))
+                {
+                if (!iGeometry.IsEmpty())
+                    iPlacemarkGeometry.emplace_back(iType,std::move(iGeometry));
+                iGeometry = CGeometry(TCoordType::Degree);
+                iInPolygon = false;
+                }
+            else if (name == "Placemark")
+                {
+                TResult error = KErrorNone;
+                for (size_t i = 0; !error && i < iPlacemarkGeometry.size(); i++)
+                    {
+                    iType = iPlacemarkGeometry[i].first;
+                    iGeometry = std::move(iPlacemarkGeometry[i].second);
+                    iInObject = true;
+                    error = EndObject();
+                    }
+                iPlacemarkGeometry.clear();
+                iInObject = false;
+                return error;
+                }
+            }
+        return KErrorNone;
+        }
+
+    TResult Text(const char* aText,size_t aLength) override
+        {
+        if (iInCoordinates)
+            {
+            iCoordinates.append(aText,aLength);
+            ParseCoordinates(false);
+            }
+        else if (iText && iText->size() < iParam.iMaxTextLength)
+            iText->append(aText,std::min(aLength,iParam.iMaxTextLength - iText->size()));
+        return KErrorNone;
+        }
+
+    private:
+    static std::string LocalName(const std::string& aName)
+        {
+        size_t colon = aName.find(':');
+        return colon == std::string::npos ? aName : aName.substr(colon + 1);
+        }
+
+    void BeginObject(TMapObjectType aType)
+        {
+        iInObject = true;
+        iType = aType;
+        iGeometry = CGeometry(TCoordType::Degree);
+        iName.clear();
+        iDescription.clear();
+        }
+
+    void CaptureText(const std::string& aName)
+        {
+        if (aName == "name")
+            iText = &iName;
+        else if (aName == "desc" || aName == "description")
+            iText = &iDescription;
+        if (iText)
+            iText->clear();
+        }
+
+    void AppendGpxPoint(const CXmlAttributeArray& aAttributes)
+        {
+        const char* lat = nullptr;
+        const char* lon = nullptr;
+        for (const auto& a : aAttributes)
+            {
+            if (a.first == "lat")
+                lat = a.second.c_str();
+            else if (a.first == "lon")
+                lon = a.second.c_str();
+            }
+        if (lat && lon)
+            iGeometry.AppendPoint(strtod(lon,nullptr),strtod(lat,nullptr));
+        }
+
+    /** Parses the complete coordinate tuples in the coordinate text, keeping any incomplete tuple at the end unless aEnd is true. */
+    void ParseCoordinates(bool aEnd)
+        {
+        auto is_space = [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; };
+        size_t end = iCoordinates.size();
+        if (!aEnd)
+            {
+            // KML coordinates are tuples separated by white space; gx:coord values are separated by white space within the element.
+            if (!iCoordinateSeparatorIsComma)
+                return;
+            while (end > 0 && !is_space(iCoordinates[end - 1]))
+                end--;
+            }
+        const char* p = iCoordinates.c_str();
+        const char* q = p + end;
+        while (p < q)
+            {
+            while (p < q && is_space(*p))
+                p++;
+            if (p == q)
+                break;
+            char* next = nullptr;
+            double x = strtod(p,&next);
+            if (next == p)
+                break;
+            p = next;
+            if (iCoordinateSeparatorIsComma)
+                {
+                if (p == q || *p != ',')
+                    break;
+                p++;
+                }
+            double y = strtod(p,&next);
+            if (next == p)
+                break;
+            iGeometry.AppendPoint(x,y);
+            p = next;
+
+            // Skip the altitude, if any.
+            if (iCoordinateSeparatorIsComma)
+                while (p < q && !is_space(*p))
+                    p++;
+            else
+                p = q;
+            }
+        iCoordinates.erase(0,end);
+        }
+
+    TResult EndObject()
+        {
+        iInObject = false;
+        if (iGeometry.IsEmpty())
+            return KErrorNone;
+        if (iType == TMapObjectType::Point)
+            {
+            // A point has a single contour containing a single point.
+            auto p = iGeometry.Point(0,0);
+            iGeometry = CGeometry(TCoordType::Degree);
+            iGeometry.AppendPoint(p);
+            }
+        iBatch.emplace_back();
+        CImportedMapObject& object = iBatch.back();
+        object.iType = iType;
+        object.iGeometry = std::move(iGeometry);
+        iGeometry = CGeometry(TCoordType::Degree);
+        AppendAttribute(object.iStringAttributes,nullptr,iName);
+        if (!iDescription.empty())
+            AppendAttribute(object.iStringAttributes,"desc",iDescription);
+        iObjectCount++;
+        if (iBatch.size() >= iParam.iBatchSize)
+            {
+            TResult error = iCallBack(iBatch);
+            iBatch.clear();
+            return error;
+            }
+        return KErrorNone;
+        }
+
+    /** Appends an attribute; vertical bars, which separate attributes, are replaced by spaces. */
+    static void AppendAttribute(std::string& aDest,const char* aKey,const std::string& aValue)
+        {
+        if (aKey)
+            {
+            aDest += '|';
+            aDest += aKey;
+            aDest += '=';
+            }
+        size_t start = aDest.size();
+        aDest += aValue;
+        for (size_t i = start; i < aDest.size(); i++)
+            if (aDest[i] == '|')
+                aDest[i] = ' ';
+        }
+
+    TXmlImportParam iParam;
+    ImportBatchCallBack iCallBack;
+    TFileType iFileType = TFileType::None;
+    std::vector<std::string> iElement;
+    std::vector<CImportedMapObject> iBatch;
+    uint64_t iObjectCount = 0;
+    bool iInObject = false;
+    std::string iObjectElement;
+    TMapObjectType iType = TMapObjectType::Point;
+    CGeometry iGeometry { TCoordType::Degree };
+    std::vector<std::pair<TMapObjectType,CGeometry>> iPlacemarkGeometry;
+    bool iInPolygon = false;
+    bool iInCoordinates = false;
+    bool iCoordinateSeparatorIsComma = true;
+    std::string iCoordinates;
+    std::string iName;
+    std::string iDescription;
+    std::string* iText = nullptr;
+    };
+
+/**
+Reads map objects from a GPX or KML document in aInput, passing them to aCallBack in batches as they are completed.
+The document is read in chunks and memory use does not depend on its size.
+*/
+inline TResult ImportXmlMapData(MInputStream& aInput,const TXmlImportParam& aParam,ImportBatchCallBack aCallBack)
+    {
+    CXmlMapImporter importer(aParam,aCallBack);
+    CXmlStreamParser parser(importer);
+    TResult error = parser.Parse(aInput,aParam.iProgressCallBack,aParam.iProgressInterval);
+    if (!error)
+        error = importer.Finish();
+    return error;
+    }
+
+}
+
+#endif
@@ -0,0 +1,123 @@
+/*
+cartotype_color_matrix_test.cpp
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+
+Tests that color matrices give the same results whether pixels are transformed singly, by the portable code,
+or in runs, by the SSE2 or NEON code where available. Returns zero if all the tests pass.
+*/
+
+#include <cartotype_framework.h>
+#include <cartotype_color_matrix.h>
+
+#include <cstdio>
+#include <random>
+
+using namespace CartoType;
+
+static int TheFailureCount = 0;
+
+static void Check(bool aCondition,const char* aDescription)
+    {
+    if (!aCondition)
+        {
+        printf("FAILED: %s\n",aDescription);
+        TheFailureCount++;
+        }
+    }
+
+/** Creates a random premultiplied pixel. */
+static uint32_t RandomPixel(std::mt19937& aRandom)
+    {
+    uint32_t a = aRandom() & 0xFF;
+    if (aRandom() % 4 == 0)
+        a = aRandom() % 2 ? 0xFF : 0;
+    uint32_t r = aRandom() % (a + 1);
+    uint32_t g = aRandom() % (a + 1);
+    uint32_t b = aRandom() % (a + 1);
+    return a << 24 | b << 16 | g << 8 | r;
+    }
+
+static void TestVectorMatchesScalar()
+    {
+    std::mt19937 random(1);
+    std::uniform_real_distribution<double> weight(-2,2);
+    std::uniform_real_distribution<double> constant(-255,255);
+    size_t mismatch_count = 0;
+    for (int trial = 0; trial < 500; trial++)
+        {
+        TColorMatrix matrix;
+        if (trial == 1)
+            matrix = TColorMatrix::NightMode();
+        else if (trial == 2)
+            matrix = TColorMatrix::NightMode(TColor(0,0,64,200));
+        else if (trial > 2)
+            {
+            double coeff[3][4];
+            for (auto& row : coeff)
+                {
+                for (int i = 0; i < 3; i++)
+                    row[i] = weight(random);
+                row[3] = constant(random);
+                }
+            matrix = TColorMatrix(coeff);
+            }
+
+        // Use odd lengths and offsets so that the vector code's remainder and unaligned cases are used.
+        std::vector<uint32_t> pixel(1000 + trial % 7);
+        for (auto& p : pixel)
+            p = RandomPixel(random);
+        std::vector<uint32_t> run(pixel);
+        const size_t offset = trial % 3;
+        matrix.Transform(run.data() + offset,run.size() - offset);
+        for (size_t i = 0; i < pixel.size(); i++)
+            {
+            uint32_t expected = i < offset ? pixel[i] : matrix.Transform(TColor(pixel[i])).iValue;
+            if (run[i] != expected)
+                mismatch_count++;
+            }
+        }
+    Check(mismatch_count == 0,"transforming a run of pixels gives the same result as transforming them one at a time");
+    }
+
+static void TestResults()
+    {
+    std::mt19937 random(2);
+    TColorMatrix identity;
+    Check(identity.IsIdentity(),"the default matrix is the identity");
+    std::vector<uint32_t> pixel(257);
+    for (auto& p : pixel)
+        p = RandomPixel(random);
+    std::vector<uint32_t> copy(pixel);
+    identity.Transform(copy.data(),copy.size());
+    Check(copy == pixel,"the identity matrix leaves pixels unchanged");
+
+    // Night mode makes light colors dark and dark colors light, keeps alpha, and never exceeds alpha in the color channels.
+    TColorMatrix night = TColorMatrix::NightMode();
+    Check(!night.IsIdentity(),"the night mode matrix is not the identity");
+    TColor white = night.Transform(TColor(KWhite));
+    TColor black = night.Transform(TColor(KBlack));
+    Check(white.Red() + white.Green() + white.Blue() < black.Red() + black.Green() + black.Blue(),"night mode reverses lightness");
+    Check(white.Alpha() == 255 && black.Alpha() == 255,"night mode keeps alpha");
+    copy = pixel;
+    night.Transform(copy.data(),copy.size());
+    bool premultiplied = true;
+    for (size_t i = 0; i < copy.size(); i++)
+        {
+        TColor c(copy[i]);
+        if (c.Alpha() != TColor(pixel[i]).Alpha() || c.Red() > c.Alpha() || c.Green() > c.Alpha() || c.Blue() > c.Alpha())
+            premultiplied = false;
+        }
+    Check(premultiplied,"results are valid premultiplied colors");
+    }
+
+int main()
+    {
+    TestVectorMatchesScalar();
+    TestResults();
+    if (TheFailureCount)
+        printf("%d color matrix tests failed\n",TheFailureCount);
+    else
+        printf("color matrix tests passed\n");
+    return TheFailureCount ? 1 : 0;
+    }
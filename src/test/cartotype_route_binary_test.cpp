@@ -0,0 +1,197 @@
+/*
+cartotype_route_binary_test.cpp
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+
+Tests writing routes in the compact binary format and reading them back.
+Returns zero if all the tests pass.
+*/
+
+#include <cartotype_framework.h>
+#include <cartotype_route_binary.h>
+
+#include <cstdio>
+
+using namespace CartoType;
+
+static int TheFailureCount = 0;
+
+static void Check(bool aCondition,const char* aDescription)
+    {
+    if (!aCondition)
+        {
+        printf("FAILED: %s\n",aDescription);
+        TheFailureCount++;
+        }
+    }
+
+/** Creates a route with aSegmentCount segments, starting at aStart in map units. */
+static std::unique_ptr<CRoute> CreateTestRoute(size_t aSegmentCount,const TPoint& aStart)
+    {
+    const char* name[] = { "High Street","Station Road","","Long Lane" };
+    const char* ref[] = { "A1","","B1234","" };
+    std::unique_ptr<CRoute> route(new CRoute);
+    route->iPointScale = 32;
+    TPoint p = aStart;
+    for (size_t i = 0; i < aSegmentCount; i++)
+        {
+        std::unique_ptr<CRouteSegment> s(new CRouteSegment);
+        s->iRoadType = i % 3 ? TRoadType::Primary : TRoadType::Motorway;
+        s->iMaxSpeed = i % 2 ? 48.28 : 0;
+        s->iName = name[i % 4];
+        s->iRef = ref[i % 4];
+        s->iDistance = 100.5 + i;
+        s->iTurnTime = i ? 3.25 : 0;
+        s->iTime = s->iDistance / 13.4 + s->iTurnTime;
+        s->iSection = int32_t(i / 5);
+        s->iRestricted = i == 3;
+        s->iTurn.iTurnType = i % 2 ? TTurnType::Left : TTurnType::Ahead;
+        s->iTurn.iContinue = i % 2 == 0;
+        s->iTurn.iTurnAngle = -87.5;
+        s->iTurn.iInDirection = 12.125;
+        s->iTurn.iOutDirection = 284.625;
+        s->iTurn.iChoices = 3;
+        s->iTurn.iLeftAlternatives = 1;
+        s->iTurn.iJunctionName = i % 4 ? "" : "Five Ways";
+        s->iTurn.iIsFork = i == 2;
+
+        // Consecutive segments share their end points, as they do in routes made by the router.
+        for (int32_t j = 0; j < 3; j++)
+            {
+            s->iPath.AppendPoint(p);
+            if (j < 2)
+                p += TPoint(3200 + int32_t(i) * 64,-1600 + j * 999);
+            }
+
+        route->iDistance += s->iDistance;
+        route->iTime += s->iTime;
+        for (size_t j = route->iPath.Points() ? 1 : 0; j < s->iPath.Points(); j++)
+            route->iPath.AppendPoint(s->iPath.Point(j));
+        route->iRouteSegment.push_back(std::move(s));
+        }
+    route->iPathToJunctionBefore.iStartRoadType = TRoadType::Residential;
+    route->iPathToJunctionBefore.iEndRoadType = TRoadType::Primary;
+    route->iPathToJunctionBefore.iDistance = 40;
+    route->iPathToJunctionBefore.iPath.AppendPoint(TPoint(aStart.iX - 1280,aStart.iY));
+    route->iPathToJunctionBefore.iPath.AppendPoint(aStart);
+    return route;
+    }
+
+static bool Equal(const CContour& aA,const CContour& aB)
+    {
+    if (aA.Points() != aB.Points() || aA.Closed() != aB.Closed())
+        return false;
+    for (size_t i = 0; i < aA.Points(); i++)
+        if (aA.Point(i) != aB.Point(i))
+            return false;
+    return true;
+    }
+
+static bool Equal(const TTurn& aA,const TTurn& aB)
+    {
+    return aA.iTurnType == aB.iTurnType && aA.iContinue == aB.iContinue && aA.iRoundaboutState == aB.iRoundaboutState &&
+           aA.iTurnAngle == aB.iTurnAngle && aA.iInDirection == aB.iInDirection && aA.iOutDirection == aB.iOutDirection &&
+           aA.iExitNumber == aB.iExitNumber && aA.iChoices == aB.iChoices && aA.iLeftAlternatives == aB.iLeftAlternatives &&
+           aA.iRightAlternatives == aB.iRightAlternatives && aA.iIsFork == aB.iIsFork && aA.iTurnOff == aB.iTurnOff &&
+           aA.iJunctionName == aB.iJunctionName && aA.iJunctionRef == aB.iJunctionRef;
+    }
+
+static bool Equal(const CRoute& aA,const CRoute& aB)
+    {
+    if (aA.iPointScale != aB.iPointScale || aA.iDistance != aB.iDistance || aA.iTime != aB.iTime || aA.iProfile != aB.iProfile ||
+        aA.iRouteSegment.size() != aB.iRouteSegment.size() || !Equal(aA.iPath,aB.iPath))
+        return false;
+    for (const CPathToJunction* p : { &aA.iPathToJunctionBefore,&aA.iPathToJunctionAfter })
+        {
+        const CPathToJunction& q = p == &aA.iPathToJunctionBefore ? aB.iPathToJunctionBefore : aB.iPathToJunctionAfter;
+        if (p->iStartRoadType != q.iStartRoadType || p->iEndRoadType != q.iEndRoadType || p->iDistance != q.iDistance || !Equal(p->iPath,q.iPath))
+            return false;
+        }
+    for (size_t i = 0; i < aA.iRouteSegment.size(); i++)
+        {
+        const CRouteSegment& a = *aA.iRouteSegment[i];
+        const CRouteSegment& b = *aB.iRouteSegment[i];
+        if (a.iRoadType != b.iRoadType || a.iMaxSpeed != b.iMaxSpeed || a.iName != b.iName || a.iRef != b.iRef ||
+            a.iDistance != b.iDistance || a.iTime != b.iTime || a.iTurnTime != b.iTurnTime || a.iSection != b.iSection ||
+            a.iRestricted != b.iRestricted || !Equal(a.iTurn,b.iTurn) || !Equal(a.iPath,b.iPath))
+            return false;
+        }
+    return true;
+    }
+
+static void TestRoundTrip()
+    {
+    // The second route has the same profile as the first, so the profile is not stored again;
+    // the third has a different profile and a path that is not the concatenation of its segment paths.
+    std::unique_ptr<CRoute> route[3] = { CreateTestRoute(12,TPoint(-32000,64000)),CreateTestRoute(1,TPoint(0,0)),CreateTestRoute(40,TPoint(1 << 28,-(1 << 28))) };
+    route[2]->iProfile = TRouteProfile(TRouteProfileType::Walk);
+    route[2]->iProfile.iShortest = true;
+    route[2]->iPath.AppendPoint(TPoint(5,5));
+
+    CMemoryOutputStream output;
+    CRouteBinaryWriter writer(output);
+    for (const auto& r : route)
+        Check(writer.Write(*r) == KErrorNone,"write a route");
+
+    TMemoryInputStream input(output.Data(),output.Length());
+    CRouteBinaryReader reader(input);
+    for (const auto& r : route)
+        {
+        TResult error = KErrorNone;
+        std::unique_ptr<CRoute> copy = reader.Read(error);
+        Check(error == KErrorNone && copy != nullptr,"read a route");
+        if (copy)
+            Check(Equal(*r,*copy),"the route read is the same as the route written");
+        }
+    Check(reader.EndOfData(),"no data follows the last route");
+    }
+
+static void TestEmptyRoute()
+    {
+    CRoute route;
+    CMemoryOutputStream output;
+    CRouteBinaryWriter writer(output);
+    Check(writer.Write(route) == KErrorNone,"write an empty route");
+    TMemoryInputStream input(output.Data(),output.Length());
+    CRouteBinaryReader reader(input);
+    TResult error = KErrorNone;
+    std::unique_ptr<CRoute> copy = reader.Read(error);
+    Check(error == KErrorNone && copy && Equal(route,*copy),"read an empty route");
+    }
+
+static void TestBadData()
+    {
+    const uint8_t not_a_route[] = "CTROUTE?\x01";
+    TMemoryInputStream input(not_a_route,sizeof(not_a_route) - 1);
+    CRouteBinaryReader reader(input);
+    TResult error = KErrorNone;
+    Check(reader.Read(error) == nullptr && error == KErrorUnknownDataFormat,"data without the right header is rejected");
+
+    // Every truncated copy of a valid stream must give an error, not a route.
+    std::unique_ptr<CRoute> route = CreateTestRoute(5,TPoint(100,200));
+    CMemoryOutputStream output;
+    CRouteBinaryWriter writer(output);
+    writer.Write(*route);
+    size_t accepted = 0;
+    for (size_t length = 0; length < output.Length(); length++)
+        {
+        TMemoryInputStream truncated(output.Data(),length);
+        CRouteBinaryReader truncated_reader(truncated);
+        error = KErrorNone;
+        if (truncated_reader.Read(error) || !error)
+            accepted++;
+        }
+    Check(accepted == 0,"truncated data is rejected");
+    }
+
+int main()
+    {
+    TestRoundTrip();
+    TestEmptyRoute();
+    TestBadData();
+    if (TheFailureCount)
+        printf("%d route binary tests failed\n",TheFailureCount);
+    else
+        printf("route binary tests passed\n");
+    return TheFailureCount ? 1 : 0;
+    }
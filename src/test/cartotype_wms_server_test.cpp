@@ -0,0 +1,207 @@
+/*
+cartotype_wms_server_test.cpp
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+
+Tests the web map service request handler: normalization, coalescing of identical requests,
+caching, rejection under overload and expiry. Returns zero if all the tests pass.
+*/
+
+#include <cartotype_wms_server.h>
+
+#include <cstdio>
+
+using namespace CartoType;
+
+static int TheFailureCount = 0;
+
+static void Check(bool aCondition,const char* aDescription)
+    {
+    if (!aCondition)
+        {
+        printf("FAILED: %s\n",aDescription);
+        TheFailureCount++;
+        }
+    }
+
+/** A gate which holds up drawing until it is opened, so that the tests can control which requests are waiting or being drawn. */
+class TGate
+    {
+    public:
+    /** Waits until aCount drawing operations have started. */
+    void WaitForStarts(int aCount)
+        {
+        std::unique_lock<std::mutex> lock(iMutex);
+        iChanged.wait(lock,[&] { return iStartCount >= aCount; });
+        }
+    void Open()
+        {
+        std::lock_guard<std::mutex> lock(iMutex);
+        iOpen = true;
+        iChanged.notify_all();
+        }
+    void Pass()
+        {
+        std::unique_lock<std::mutex> lock(iMutex);
+        iStartCount++;
+        iChanged.notify_all();
+        iChanged.wait(lock,[&] { return iOpen; });
+        }
+
+    private:
+    std::mutex iMutex;
+    std::condition_variable iChanged;
+    int iStartCount = 0;
+    bool iOpen = false;
+    };
+
+/** A renderer which returns the request as the image data, failing requests containing 'fail'. */
+class TTestRenderer: public MWebMapServiceRenderer
+    {
+    public:
+    explicit TTestRenderer(TGate& aGate): iGate(aGate) { }
+    TResult GetMap(const char* aWebMapServiceRequest,std::vector<uint8_t>& aData) override
+        {
+        iGate.Pass();
+        if (strstr(aWebMapServiceRequest,"fail"))
+            return KErrorInvalidArgument;
+        aData.assign(aWebMapServiceRequest,aWebMapServiceRequest + strlen(aWebMapServiceRequest));
+        return KErrorNone;
+        }
+
+    private:
+    TGate& iGate;
+    };
+
+static std::unique_ptr<CWebMapServiceServer> NewServer(TGate& aGate,const TWebMapServiceServerParam& aParam)
+    {
+    TResult error = KErrorNone;
+    auto server = CWebMapServiceServer::New(error,[&aGate](TResult& aError)
+        {
+        aError = KErrorNone;
+        return std::unique_ptr<MWebMapServiceRenderer>(new TTestRenderer(aGate));
+        },aParam);
+    Check(!error && server,"create a server");
+    return server;
+    }
+
+static void TestNormalization()
+    {
+    std::string a = CWebMapServiceServer::NormalizeRequest("?service=WMS&Request=GetMap&bbox=1.0,2,3e0,4.50&width=256&LAYERS=a%2Cb&format=image/PNG");
+    std::string b = CWebMapServiceServer::NormalizeRequest("REQUEST=getmap&BBOX=1,2,3,4.5&SERVICE=wms&WIDTH=256.0&layers=a,b&FORMAT=image/png");
+    std::string c = CWebMapServiceServer::NormalizeRequest("REQUEST=getmap&BBOX=1,2,3,4.5&SERVICE=wms&WIDTH=256.0&layers=b,a&FORMAT=image/png");
+    Check(a == b,"requests differing only in order, case and number format are the same after normalization");
+    Check(a != c,"requests for different layers are different after normalization");
+    }
+
+static void TestCoalescing()
+    {
+    TGate gate;
+    TWebMapServiceServerParam param;
+    param.iThreadCount = 1;
+    auto server = NewServer(gate,param);
+
+    // The first request is being drawn while the others arrive, so they must all share its result.
+    std::vector<std::shared_future<CWebMapServiceResponse>> response;
+    response.push_back(server->Request("BBOX=1,2,3,4&WIDTH=10"));
+    gate.WaitForStarts(1);
+    for (int i = 1; i < 100; i++)
+        response.push_back(server->Request(i % 2 ? "bbox=1,2,3,4&width=10" : "WIDTH=10.0&BBOX=1,2,3,4"));
+    gate.Open();
+    bool same = true;
+    for (auto& r : response)
+        {
+        const CWebMapServiceResponse& x = r.get();
+        if (x.iError || !x.iData || x.iData != response[0].get().iData)
+            same = false;
+        }
+    Check(same,"identical concurrent requests get the same response");
+    TWebMapServiceServerStatistics statistics = server->Statistics();
+    Check(statistics.iDrawCount == 1 && statistics.iCoalescedCount == 99,"identical concurrent requests are drawn once");
+
+    std::vector<uint8_t> data;
+    Check(server->GetMap("width=10&bbox=1,2,3,4",data) == KErrorNone && !data.empty(),"a repeated request succeeds");
+    statistics = server->Statistics();
+    Check(statistics.iDrawCount == 1 && statistics.iCacheHitCount == 1,"a repeated request is answered from the cache");
+
+    Check(server->GetMap("fail=1",data) == KErrorInvalidArgument,"drawing errors are returned");
+    Check(server->GetMap("fail=1",data) == KErrorInvalidArgument && server->Statistics().iDrawCount == 3,"failed requests are not cached");
+    }
+
+static void TestClearCache()
+    {
+    TGate gate;
+    TWebMapServiceServerParam param;
+    param.iThreadCount = 1;
+    auto server = NewServer(gate,param);
+
+    // A request made after ClearCache must not be joined to a request drawn using the old data.
+    auto a = server->Request("z=1");
+    gate.WaitForStarts(1);
+    server->ClearCache();
+    auto b = server->Request("z=1");
+    auto c = server->Request("z=1");
+    gate.Open();
+    a.get();
+    b.get();
+    c.get();
+    TWebMapServiceServerStatistics statistics = server->Statistics();
+    Check(statistics.iDrawCount == 2 && statistics.iCoalescedCount == 1,"requests are not joined to requests made before ClearCache");
+    }
+
+static void TestOverload()
+    {
+    TGate gate;
+    TWebMapServiceServerParam param;
+    param.iThreadCount = 1;
+    param.iMaxQueueLength = 4;
+    auto server = NewServer(gate,param);
+
+    auto first = server->Request("x=0");
+    gate.WaitForStarts(1);
+    std::vector<std::shared_future<CWebMapServiceResponse>> response;
+    for (int i = 1; i <= 10; i++)
+        response.push_back(server->Request("x=" + std::to_string(i)));
+    int rejected = 0;
+    for (auto& r : response)
+        if (r.wait_for(std::chrono::seconds(0)) == std::future_status::ready && r.get().iError == KErrorOverflow)
+            rejected++;
+    Check(rejected == 6,"requests beyond the maximum queue length are rejected at once");
+    gate.Open();
+    int succeeded = first.get().iError == KErrorNone;
+    for (auto& r : response)
+        succeeded += r.get().iError == KErrorNone;
+    Check(succeeded == 5,"queued requests are drawn");
+    Check(server->Statistics().iRejectedCount == 6,"rejected requests are counted");
+    }
+
+static void TestExpiry()
+    {
+    TGate gate;
+    TWebMapServiceServerParam param;
+    param.iThreadCount = 1;
+    param.iMaxQueueTimeInMilliseconds = 20;
+    auto server = NewServer(gate,param);
+
+    auto first = server->Request("y=0");
+    gate.WaitForStarts(1);
+    auto second = server->Request("y=1");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    gate.Open();
+    Check(first.get().iError == KErrorNone,"a request being drawn is not abandoned");
+    Check(second.get().iError == KErrorCancel && server->Statistics().iExpiredCount == 1,"requests waiting too long are abandoned");
+    }
+
+int main()
+    {
+    TestNormalization();
+    TestCoalescing();
+    TestClearCache();
+    TestOverload();
+    TestExpiry();
+    if (TheFailureCount)
+        printf("%d web map service server tests failed\n",TheFailureCount);
+    else
+        printf("web map service server tests passed\n");
+    return TheFailureCount ? 1 : 0;
+    }
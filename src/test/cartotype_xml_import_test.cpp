@@ -0,0 +1,194 @@
+/*
+cartotype_xml_import_test.cpp
+Copyright (C) 2020 CartoType Ltd.
+See www.cartotype.com for more information.
+
+Tests importing map objects from GPX and KML, with the input split into pieces of various sizes.
+Returns zero if all the tests pass.
+*/
+
+#include <cartotype_xml_import.h>
+
+#include <cstdio>
+
+using namespace CartoType;
+
+static int TheFailureCount = 0;
+
+static void Check(bool aCondition,const char* aDescription)
+    {
+    if (!aCondition)
+        {
+        printf("FAILED: %s\n",aDescription);
+        TheFailureCount++;
+        }
+    }
+
+/** An input stream which returns its data a few bytes at a time, so that elements, entities and UTF-8 sequences are split between reads. */
+class TPieceInputStream: public MInputStream
+    {
+    public:
+    TPieceInputStream(const std::string& aData,size_t aPieceSize):
+        iData(aData),
+        iPieceSize(aPieceSize)
+        {
+        }
+    TResult Read(const uint8_t*& aPointer,size_t& aLength) override
+        {
+        aLength = std::min(iPieceSize,iData.size() - iPosition);
+        aPointer = (const uint8_t*)iData.data() + iPosition;
+        iPosition += aLength;
+        return KErrorNone;
+        }
+    bool EndOfStream() const override { return iPosition >= iData.size(); }
+    TResult Seek(int64_t aPosition) override { iPosition = size_t(aPosition); return KErrorNone; }
+    int64_t Position(TResult& aError) override { aError = KErrorNone; return int64_t(iPosition); }
+    int64_t Length(TResult& aError) override { aError = KErrorNone; return int64_t(iData.size()); }
+
+    private:
+    const std::string& iData;
+    size_t iPieceSize;
+    size_t iPosition = 0;
+    };
+
+/** Imports aText, returning the objects in a text form that is easy to compare, and the number of batches. */
+static TResult Import(std::string& aObjects,size_t& aBatchCount,const std::string& aText,size_t aPieceSize,size_t aBatchSize)
+    {
+    TPieceInputStream input(aText,aPieceSize);
+    TXmlImportParam param;
+    param.iBatchSize = aBatchSize;
+    aObjects.clear();
+    aBatchCount = 0;
+    return ImportXmlMapData(input,param,[&](std::vector<CImportedMapObject>& aBatch) -> TResult
+        {
+        aBatchCount++;
+        for (const auto& object : aBatch)
+            {
+            aObjects += object.iType == TMapObjectType::Point ? "point" : object.iType == TMapObjectType::Line ? "line" : "polygon";
+            aObjects += " [" + object.iStringAttributes + "]";
+            for (size_t i = 0; i < object.iGeometry.ContourCount(); i++)
+                {
+                aObjects += " (";
+                for (size_t j = 0; j < object.iGeometry.PointCount(i); j++)
+                    {
+                    char buffer[64];
+                    snprintf(buffer,sizeof(buffer),j ? " %g,%g" : "%g,%g",object.iGeometry.Point(i,j).iX,object.iGeometry.Point(i,j).iY);
+                    aObjects += buffer;
+                    }
+                aObjects += ")";
+                }
+            aObjects += "\n";
+            }
+        return KErrorNone;
+        });
+    }
+
+static void TestDocument(const char* aName,const std::string& aText,const std::string& aExpected)
+    {
+    for (size_t piece_size : { 1,2,3,7,64,1 << 20 })
+        {
+        std::string objects;
+        size_t batch_count = 0;
+        TResult error = Import(objects,batch_count,aText,piece_size,2);
+        if (error || objects != aExpected)
+            printf("%s, pieces of %d bytes: error %d, objects:\n%s",aName,int(piece_size),int(error),objects.c_str());
+        Check(!error && objects == aExpected,aName);
+        }
+    }
+
+static void TestGpx()
+    {
+    // A byte order mark, a comment, entities, a character reference, CDATA and single and double quotes.
+    const std::string gpx =
+        "\xEF\xBB\xBF<?xml version='1.0'?>\n<!-- a comment -- with dashes --><gpx version=\"1.1\" xmlns:x='a'>"
+        "<wpt lat=\"51.5\" lon=\"-0.1\"><name>Big &amp; Ben &#x263A;|x</name><desc><![CDATA[<b>d</b>]]></desc></wpt>"
+        "<trk><name>T</name><trkseg><trkpt lat='1' lon='2'/><trkpt lat='3' lon='4'><ele>5</ele></trkpt></trkseg>"
+        "<trkseg><trkpt lat='5' lon='6'/></trkseg></trk>"
+        "<rte><rtept lat='7' lon='8'/></rte></gpx>\n";
+    const std::string expected =
+        "point [Big & Ben \xE2\x98\xBA x|desc=<b>d</b>] (-0.1,51.5)\n"
+        "line [T] (2,1 4,3) (6,5)\n"
+        "line [] (8,7)\n";
+    TestDocument("GPX import",gpx,expected);
+    }
+
+static void TestKml()
+    {
+    const std::string kml =
+        "<?xml version='1.0'?><kml xmlns='http://www.opengis.net/kml/2.2' xmlns:gx='g'><Document><Folder>"
+        "<Placemark><name>P</name><Point><coordinates>1.5,2.5,0</coordinates></Point></Placemark>"
+        "<Placemark><description>multi</description><MultiGeometry>"
+        "<LineString><coordinates>\n 1,2,3 4,5,6\n 7,8 </coordinates></LineString>"
+        "<Polygon><outerBoundaryIs><LinearRing><coordinates>0,0 1,0 1,1 0,0</coordinates></LinearRing></outerBoundaryIs>"
+        "<innerBoundaryIs><LinearRing><coordinates>0.1,0.1 0.2,0.1 0.1,0.1</coordinates></LinearRing></innerBoundaryIs></Polygon>"
+        "</MultiGeometry></Placemark>"
+        "<Placemark><name>tr</name><gx:Track><when>x</when><gx:coord>9 10 0</gx:coord><gx:coord>11 12 0</gx:coord></gx:Track></Placemark>"
+        "</Folder></Document></kml>";
+    const std::string expected =
+        "point [P] (1.5,2.5)\n"
+        "line [|desc=multi] (1,2 4,5 7,8)\n"
+        "polygon [|desc=multi] (0,0 1,0 1,1 0,0) (0.1,0.1 0.2,0.1 0.1,0.1)\n"
+        "line [tr] (9,10 11,12)\n";
+    TestDocument("KML import",kml,expected);
+    }
+
+static void TestErrors()
+    {
+    const std::pair<const char*,TResult> test[] =
+        {
+        { "<gpx><a></b></gpx>",KErrorCorrupt },
+        { "<gpx>",KErrorCorrupt },
+        { "<foo/>",KErrorUnknownDataFormat },
+        { "<gpx/><gpx/>",KErrorCorrupt },
+        { "<gpx a=b/>",KErrorCorrupt }
+        };
+    for (const auto& t : test)
+        {
+        std::string objects;
+        size_t batch_count = 0;
+        TResult error = Import(objects,batch_count,t.first,3,1024);
+        if (error != t.second)
+            printf("%s: expected error %d, got %d\n",t.first,int(t.second),int(error));
+        Check(error == t.second,"invalid documents are rejected");
+        }
+    }
+
+static void TestBatchesAndCancel()
+    {
+    std::string kml = "<kml><Document>";
+    for (int i = 0; i < 10000; i++)
+        kml += "<Placemark><name>n" + std::to_string(i) + "</name><Point><coordinates>1,2</coordinates></Point></Placemark>";
+    kml += "</Document></kml>";
+
+    TPieceInputStream input(kml,4096);
+    TXmlImportParam param;
+    param.iBatchSize = 1000;
+    size_t object_count = 0;
+    size_t max_batch_size = 0;
+    TResult error = ImportXmlMapData(input,param,[&](std::vector<CImportedMapObject>& aBatch) -> TResult
+        {
+        object_count += aBatch.size();
+        max_batch_size = std::max(max_batch_size,aBatch.size());
+        return KErrorNone;
+        });
+    Check(!error && object_count == 10000 && max_batch_size == 1000,"objects are passed in batches of the requested size");
+
+    TPieceInputStream cancelled_input(kml,4096);
+    param.iProgressInterval = 10000;
+    param.iProgressCallBack = [](int64_t aBytesRead,int64_t) { return aBytesRead < 100000; };
+    error = ImportXmlMapData(cancelled_input,param,[](std::vector<CImportedMapObject>&) { return KErrorNone; });
+    Check(error == KErrorCancel,"the progress function can cancel importing");
+    }
+
+int main()
+    {
+    TestGpx();
+    TestKml();
+    TestErrors();
+    TestBatchesAndCancel();
+    if (TheFailureCount)
+        printf("%d XML import tests failed\n",TheFailureCount);
+    else
+        printf("XML import tests passed\n");
+    return TheFailureCount ? 1 : 0;
+    }